@@ -0,0 +1,149 @@
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "FetchThread.h"
+#include "Recorder.h"
+#include "Metrics.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::atomic<bool> shutdown;
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/FetchThread.cpp#1 $";
+
+// how long to wait for room when the queue is full
+const useconds_t FetchThread::pollPeriod_usec = 10000;
+
+//-----------------------------------------------------------------------------
+// FetchThread CTOR
+//-----------------------------------------------------------------------------
+FetchThread::FetchThread(Recorder& r, const int pt, const size_t queueSize) :
+	_recorder(r), _pageType(pt), _tpuHandle(NULL),
+	_fetcher(r, pt, &_tpuHandle), _queue(queueSize),
+	_running(false), _record(false), _stalls(0)
+{
+}
+//-----------------------------------------------------------------------------
+// FetchThread DTOR
+//-----------------------------------------------------------------------------
+FetchThread::~FetchThread()
+{
+	stop();
+}
+//-----------------------------------------------------------------------------
+// FetchThread::start()
+//-----------------------------------------------------------------------------
+void FetchThread::start()
+{
+	if (_running) return;
+
+	_running = true;
+	_thread = std::thread(&FetchThread::run, this);
+}
+//-----------------------------------------------------------------------------
+// FetchThread::stop()
+//-----------------------------------------------------------------------------
+void FetchThread::stop()
+{
+	_running = false;
+
+	if (_thread.joinable())
+		_thread.join();
+}
+//-----------------------------------------------------------------------------
+// FetchThread::run()
+//-----------------------------------------------------------------------------
+void FetchThread::run()
+{
+	_recorder.connectToTPU(_tpuHandle);
+
+	// the TPU's errors are const char*, the rest std::exception, e.g. a
+	// page that couldn't be allocated. either way start over, one
+	// escaping the thread would terminate the recorder.
+	const auto recover = [this](const char* e)
+	{
+		std::cerr << "Caught: " << e << ", PT: " << _pageType << std::endl;
+		Metrics::instance().reconnect();
+		{
+			Metrics::Timer t(Metrics::reopen, 0, _pageType);
+			_recorder.disconnectFromTPU(_tpuHandle);
+			_recorder.connectToTPU(_tpuHandle);
+		}
+		_fetcher.reset();
+	};
+
+	while (_running && !shutdown)
+	{
+		try
+		{
+			bool gotPage = false;
+
+			_scheduler.start();
+
+			// while we fetch a page, queue it
+			while (_running && _record.load(std::memory_order_relaxed)
+					&& _fetcher.fetchPage())
+			{
+				PageRef page = _fetcher.takePage();
+				if (page) push(page);
+				gotPage = true;
+			}
+
+			// the recorder thread keeps the ping interval current
+			_scheduler.interval(_recorder.pingInterval());
+			_scheduler.finish(gotPage);
+			_scheduler.sleep();
+		}
+		catch (const char*& e)
+		{
+			recover(e);
+		}
+		catch (const std::exception& e)
+		{
+			recover(e.what());
+		}
+	}
+
+	_recorder.disconnectFromTPU(_tpuHandle);
+}
+//-----------------------------------------------------------------------------
+// FetchThread::push()
+//-----------------------------------------------------------------------------
+void FetchThread::push(PageRef& p)
+{
+	// the writer is behind, wait for it rather than lose the page,
+	// the TPU holds on to its pages in the meantime
+	if (_queue.push(std::move(p))) return;
+
+	_stalls.fetch_add(1, std::memory_order_relaxed);
+
+	{
+		std::ostringstream os;
+		printTime(os);
+		os << " - Fetch queue full, PT: " << _pageType
+			<< ", stalls: " << stalls();
+		std::cerr << os.str() << std::endl;
+	}
+
+	while (_running && !_queue.push(std::move(p)))
+		usleep(pollPeriod_usec);
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const FetchThread& f)
+	{
+		out << "FetchThread PT: " << f._pageType
+			<< ", queued: " << f.queueDepth() << "/" << f._queue.capacity()
+			<< ", stalls: " << f.stalls();
+		return out;
+	}
+}
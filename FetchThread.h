@@ -0,0 +1,75 @@
+#ifndef _KLEIN_FETCH_THREAD_H_
+#define _KLEIN_FETCH_THREAD_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/FetchThread.h#1 $
+//
+
+#include <ostream>
+#include <atomic>
+#include <thread>
+#include <unistd.h> // useconds_t
+#include <stdint.h>
+
+#include "KleinSonar.h"
+#include "PagePool.h"
+#include "PageFetcher.h"
+#include "SpscQueue.h"
+#include "PingScheduler.h"
+
+namespace klein
+{
+
+class Recorder;
+
+// a PageFetcher running on its own thread with its own (slave)
+// connection to the TPU. fetched pages are pushed into a bounded
+// SPSC queue that the Recorder's writer thread drains, so a slow
+// page type no longer holds up the others.
+class FetchThread
+{
+	public:
+
+		FetchThread(Recorder& r, const int pt, const size_t queueSize);
+		~FetchThread();
+
+		void start();
+		void stop();
+
+		// writer side - only fetch while the writer is recording
+		inline void record(const bool r) { _record.store(r, std::memory_order_relaxed); }
+
+		// writer side - next page, false if none queued
+		inline bool pop(PageRef& p) { return _queue.pop(p); }
+
+		inline int pageType() const { return _pageType; }
+		inline size_t queueDepth() const { return _queue.size(); }
+		inline uint64_t stalls() const { return _stalls.load(std::memory_order_relaxed); }
+
+	private:
+		// no copy or operator = ctors
+		FetchThread(const FetchThread& rhs);
+		FetchThread& operator = (const FetchThread& rhs);
+
+		void run();
+		void push(PageRef& p);
+
+		Recorder& _recorder;
+		const int _pageType;
+		TPU_HANDLE _tpuHandle;
+		PageFetcher _fetcher;
+		SpscQueue<PageRef> _queue;
+		PingScheduler _scheduler;
+
+		std::atomic<bool> _running;
+		std::atomic<bool> _record;
+		std::atomic<uint64_t> _stalls;
+		std::thread _thread;
+
+		static const useconds_t pollPeriod_usec;
+
+	friend std::ostream& operator << (std::ostream& out, const FetchThread& f);
+};
+
+} // namespace klein
+#endif // _KLEIN_FETCH_THREAD_H_
@@ -0,0 +1,664 @@
+#include <cstring> // memset()
+#include <errno.h>
+#include <limits.h> // IOV_MAX
+#include <unistd.h> // lseek(), syscall()
+#include <fcntl.h> // fallocate()
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+#include "IoBackend.h"
+
+// io_uring needs the kernel header and the system call numbers, without
+// them there is only writev
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define KLEIN_IO_URING 1
+#endif
+#endif
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/IoBackend.cpp#1 $";
+
+//-----------------------------------------------------------------------------
+// IoBackend::create()
+//-----------------------------------------------------------------------------
+IoBackend* IoBackend::create(const IoConfig& c, const PagePool* pool)
+{
+	if (c.backend == IoConfig::uring)
+	{
+		IoBackend* b = UringBackend::create(c.depth, pool);
+		if (b) return b;
+	}
+	if (c.backend == IoConfig::mmap)
+		return new MmapBackend;
+
+	return new WritevBackend;
+}
+//-----------------------------------------------------------------------------
+// IoBackend::end()
+//-----------------------------------------------------------------------------
+off_t IoBackend::end(const int fd)
+{
+	// the file is O_APPEND, its end is where the last write went
+	return lseek(fd, 0, SEEK_END);
+}
+//-----------------------------------------------------------------------------
+// WritevBackend::write()
+//-----------------------------------------------------------------------------
+bool WritevBackend::write(const int fd, struct iovec* iov, const size_t n)
+{
+	struct iovec* v = iov;
+	size_t left = n;
+
+	while (left)
+	{
+		const int cnt = (left > IOV_MAX) ? IOV_MAX : left;
+
+		const ssize_t w = writev(fd, v, cnt);
+
+		if (w < 0)
+		{
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		// step over what was written
+		size_t done = w;
+		while (left && done >= v->iov_len)
+		{
+			done -= v->iov_len;
+			v++;
+			left--;
+		}
+		if (done)
+		{
+			v->iov_base = (uint8_t*)v->iov_base + done;
+			v->iov_len -= done;
+		}
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// MmapBackend
+//-----------------------------------------------------------------------------
+const size_t MmapBackend::window = 16 << 20;
+const size_t MmapBackend::minAllocation = 64 << 20;
+
+//-----------------------------------------------------------------------------
+// MmapBackend CTOR
+//-----------------------------------------------------------------------------
+MmapBackend::MmapBackend() :
+	_fd(-1), _end(0), _allocated(0), _map(NULL), _mapOffset(0), _hint(0),
+	_slides(0), _grows(0)
+{
+}
+//-----------------------------------------------------------------------------
+// MmapBackend DTOR
+//-----------------------------------------------------------------------------
+MmapBackend::~MmapBackend()
+{
+	detach();
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::allocate()
+//-----------------------------------------------------------------------------
+bool MmapBackend::allocate(const off_t size)
+{
+	// make the file at least size, all of it real blocks if the file
+	// system will, sparse otherwise. the window must never go past the
+	// end of the file, touching that is a SIGBUS.
+	if (size <= _allocated) return true;
+
+	if (fallocate(_fd, 0, _allocated, size - _allocated) != 0)
+	{
+		if (errno != EOPNOTSUPP) return false;
+
+		if (ftruncate(_fd, size) != 0) return false;
+	}
+
+	_allocated = size;
+	_grows++;
+	return true;
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::attach()
+//-----------------------------------------------------------------------------
+bool MmapBackend::attach(const int fd)
+{
+	// anything already in the file, e.g. one opened again, is kept
+	detach();
+
+	const off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0) return false;
+
+	_fd = fd;
+	_end = _allocated = size;
+
+	const off_t want = size + std::max(_hint, minAllocation);
+
+	// the window is mapped by slide() on the first write
+	return allocate(want);
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::detach()
+//-----------------------------------------------------------------------------
+void MmapBackend::detach()
+{
+	if (_fd < 0) return;
+
+	if (_map)
+	{
+		munmap(_map, window);
+		_map = NULL;
+	}
+
+	// give back the preallocation that wasn't used
+	if (_allocated > _end) (void) ftruncate(_fd, _end);
+
+	_fd = -1;
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::slide()
+//-----------------------------------------------------------------------------
+bool MmapBackend::slide()
+{
+	// map the window holding _end
+	if (_map)
+	{
+		// the dirty pages stay in the page cache for writeback, this only
+		// lets go of the mapping
+		madvise(_map, window, MADV_DONTNEED);
+		munmap(_map, window);
+		_map = NULL;
+	}
+
+	const off_t offset = (_end / window) * window;
+	const off_t need = offset + (off_t)window;
+
+	if (_allocated < need)
+	{
+		// past the preallocation, grow by a quarter of the hint at a
+		// time, not a window. only what the window needs if the disk
+		// can't give that much.
+		const off_t more = std::max(std::max(_hint, minAllocation) / 4, window);
+
+		if (!allocate(std::max(need, _allocated + more)) && !allocate(need)) return false;
+	}
+
+	void* m = mmap(NULL, window, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+	if (m == MAP_FAILED) return false;
+
+	madvise(m, window, MADV_SEQUENTIAL);
+
+	_map = (uint8_t*)m;
+	_mapOffset = offset;
+	_slides++;
+	return true;
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::write()
+//-----------------------------------------------------------------------------
+bool MmapBackend::write(const int fd, struct iovec* iov, const size_t n)
+{
+	if (fd != _fd && !attach(fd)) return false;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		const uint8_t* p = (const uint8_t*)iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left)
+		{
+			if (!_map || _end >= _mapOffset + (off_t)window)
+			{
+				if (!slide()) return false;
+			}
+
+			const size_t room = _mapOffset + window - _end;
+			const size_t k = std::min(room, left);
+
+			memcpy(_map + (_end - _mapOffset), p, k);
+
+			_end += k;
+			p += k;
+			left -= k;
+		}
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::end()
+//-----------------------------------------------------------------------------
+off_t MmapBackend::end(const int fd)
+{
+	// the file itself is bigger, it is preallocated
+	return (fd == _fd) ? _end : IoBackend::end(fd);
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::closing()
+//-----------------------------------------------------------------------------
+void MmapBackend::closing(const int fd)
+{
+	if (fd == _fd) detach();
+}
+//-----------------------------------------------------------------------------
+// MmapBackend::describe()
+//-----------------------------------------------------------------------------
+void MmapBackend::describe(std::ostream& out) const
+{
+	out << name() << " window: " << window
+		<< ", size hint: " << _hint
+		<< ", slides: " << _slides
+		<< ", grows: " << _grows;
+}
+//-----------------------------------------------------------------------------
+// UringBackend CTOR
+//-----------------------------------------------------------------------------
+UringBackend::UringBackend() :
+	_ring(-1), _entries(0),
+	_sqMap(NULL), _sqMapSize(0), _cqMap(NULL), _cqMapSize(0),
+	_sqes(NULL), _sqesSize(0),
+	_sqHead(NULL), _sqTail(NULL), _sqMask(NULL), _sqArray(NULL),
+	_cqHead(NULL), _cqTail(NULL), _cqMask(NULL), _cqes(NULL),
+	_pool(NULL), _generation(0), _fixed(false), _fallback(false),
+	_fixedWrites(0), _vectorWrites(0), _shortWrites(0), _failedWrites(0)
+{
+}
+//-----------------------------------------------------------------------------
+// UringBackend DTOR
+//-----------------------------------------------------------------------------
+UringBackend::~UringBackend()
+{
+	// nothing is in flight, write() waits for all of it. closing the
+	// ring drops the registered buffers too.
+	if (_sqes) munmap(_sqes, _sqesSize);
+	if (_cqMap && _cqMap != _sqMap) munmap(_cqMap, _cqMapSize);
+	if (_sqMap) munmap(_sqMap, _sqMapSize);
+	if (_ring >= 0) close(_ring);
+}
+#ifdef KLEIN_IO_URING
+//-----------------------------------------------------------------------------
+// the system calls, glibc has no wrappers
+//-----------------------------------------------------------------------------
+static inline int uringSetup(const unsigned entries, struct io_uring_params* p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+static inline int uringEnter(const int fd, const unsigned submit,
+		const unsigned complete, const unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+static inline int uringRegister(const int fd, const unsigned op, void* arg,
+		const unsigned n)
+{
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+//-----------------------------------------------------------------------------
+// UringBackend::create()
+//-----------------------------------------------------------------------------
+UringBackend* UringBackend::create(const unsigned depth, const PagePool* pool)
+{
+	UringBackend* u = new UringBackend;
+
+	if (!u->setup(depth ? depth : 1))
+	{
+		delete u;
+		return NULL;
+	}
+
+	u->_pool = pool;
+	return u;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::setup()
+//-----------------------------------------------------------------------------
+bool UringBackend::setup(const unsigned depth)
+{
+	struct io_uring_params p;
+	memset(&p, '\0', sizeof(p));
+
+	_ring = uringSetup(depth, &p);
+	if (_ring < 0) return false;
+
+	_entries = p.sq_entries;
+
+	// map the rings, newer kernels share one mapping for both
+	_sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		_sqMapSize = _cqMapSize = std::max(_sqMapSize, _cqMapSize);
+
+	void* m = mmap(NULL, _sqMapSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+	if (m == MAP_FAILED) return false;
+	_sqMap = m;
+
+	if (single)
+	{
+		_cqMap = _sqMap;
+	}
+	else
+	{
+		m = mmap(NULL, _cqMapSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+		if (m == MAP_FAILED) return false;
+		_cqMap = m;
+	}
+
+	_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	m = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+	if (m == MAP_FAILED) return false;
+	_sqes = m;
+
+	uint8_t* sq = (uint8_t*)_sqMap;
+	_sqHead = (unsigned*)(sq + p.sq_off.head);
+	_sqTail = (unsigned*)(sq + p.sq_off.tail);
+	_sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+	_sqArray = (unsigned*)(sq + p.sq_off.array);
+
+	uint8_t* cq = (uint8_t*)_cqMap;
+	_cqHead = (unsigned*)(cq + p.cq_off.head);
+	_cqTail = (unsigned*)(cq + p.cq_off.tail);
+	_cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+	_cqes = cq + p.cq_off.cqes;
+
+	return true;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::registerArena()
+//-----------------------------------------------------------------------------
+void UringBackend::registerArena()
+{
+	// only between batches, nothing can be in flight from the old set
+	if (!_buffers.empty())
+	{
+		uringRegister(_ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		_buffers.clear();
+	}
+	_fixed = false;
+
+	_generation = _pool->arenas(_buffers);
+	if (_buffers.empty()) return;
+
+	// sorted so a page's slab is a binary search
+	std::sort(_buffers.begin(), _buffers.end());
+
+	std::vector<struct iovec> v(_buffers.size());
+	for (size_t i = 0; i < _buffers.size(); i++)
+	{
+		v[i].iov_base = _buffers[i].first;
+		v[i].iov_len = _buffers[i].second;
+	}
+
+	if (uringRegister(_ring, IORING_REGISTER_BUFFERS, v.data(), v.size()) < 0)
+	{
+		// most likely over RLIMIT_MEMLOCK, it won't get better
+		_buffers.clear();
+		_pool = NULL;
+		return;
+	}
+	_fixed = true;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::fixedBuffer()
+//-----------------------------------------------------------------------------
+int UringBackend::fixedBuffer(const struct iovec& v) const
+{
+	// the registered slab holding all of v, or -1
+	const uint8_t* p = (const uint8_t*)v.iov_base;
+
+	size_t lo = 0;
+	size_t hi = _buffers.size();
+
+	// the last buffer starting at or below p
+	while (lo < hi)
+	{
+		const size_t mid = (lo + hi) / 2;
+		if (_buffers[mid].first <= p) lo = mid + 1;
+		else hi = mid;
+	}
+	if (!lo) return -1;
+
+	const std::pair<uint8_t*, size_t>& b = _buffers[lo - 1];
+
+	return (p + v.iov_len <= b.first + b.second) ? (int)(lo - 1) : -1;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::submit()
+//-----------------------------------------------------------------------------
+bool UringBackend::submit(const int fd, off_t& offset, const struct iovec* iov,
+		const size_t first, const unsigned count, size_t& ok, size_t& partial)
+{
+	// one linked chain for count of the ops from first, at most _entries.
+	// ok is how many were written in full, partial the bytes of the next
+	// one, the caller writev's the rest of the batch from there. false
+	// with errno set if it can't know how far the chain got.
+	const Op* ops = &_ops[first];
+
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*)_sqes;
+	const unsigned mask = *_sqMask;
+
+	// only this thread fills the queue
+	unsigned tail = *_sqTail;
+
+	for (unsigned k = 0; k < count; k++)
+	{
+		const Op& o = ops[k];
+		const unsigned i = tail & mask;
+
+		struct io_uring_sqe* sqe = &sqes[i];
+		memset(sqe, '\0', sizeof(*sqe));
+
+		sqe->fd = fd;
+		sqe->off = offset;
+		sqe->user_data = k;
+
+		if (o.buf >= 0)
+		{
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->addr = (uint64_t)(uintptr_t)iov[o.first].iov_base;
+			sqe->len = iov[o.first].iov_len;
+			sqe->buf_index = o.buf;
+			_fixedWrites++;
+		}
+		else
+		{
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (uint64_t)(uintptr_t)&iov[o.first];
+			sqe->len = o.count;
+			_vectorWrites++;
+		}
+
+		// in order, each waits for the one before
+		if (k + 1 < count) sqe->flags = IOSQE_IO_LINK;
+
+		_sqArray[i] = i;
+		offset += o.bytes;
+		tail++;
+	}
+
+	__atomic_store_n(_sqTail, tail, __ATOMIC_RELEASE);
+
+	// submit them all and wait for every completion, one never
+	// submitted is as good as cancelled
+	_results.assign(count, -ECANCELED);
+
+	unsigned submitted = 0;
+	unsigned reaped = 0;
+
+	while (reaped < count)
+	{
+		const int r = uringEnter(_ring, count - submitted, count - reaped,
+				IORING_ENTER_GETEVENTS);
+
+		if (r < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+
+			// the ring is no good to us now
+			_fallback = true;
+
+			// with writes still in flight where the chain ends is
+			// anyone's guess, writing the rest again could double it
+			if (submitted != reaped) return false;
+
+			// otherwise the rest of the batch goes to writev, below
+			break;
+		}
+		submitted += r;
+
+		unsigned head = *_cqHead;
+		const unsigned ctail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		const struct io_uring_cqe* cqes = (const struct io_uring_cqe*)_cqes;
+
+		while (head != ctail)
+		{
+			const struct io_uring_cqe& c = cqes[head & *_cqMask];
+			if (c.user_data < count) _results[c.user_data] = c.res;
+			head++;
+			reaped++;
+		}
+
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	// how far did the chain get?
+	for (ok = 0; ok < count; ok++)
+	{
+		const int res = _results[ok];
+
+		if (res >= 0 && (size_t)res == ops[ok].bytes) continue;
+
+		partial = (res > 0) ? res : 0;
+
+		if (res >= 0 || res == -ECANCELED || res == -EAGAIN || res == -EINTR)
+		{
+			_shortWrites++;
+		}
+		else if (res == -EINVAL || res == -EOPNOTSUPP)
+		{
+			// the kernel has io_uring but not these ops
+			_fallback = true;
+		}
+		else
+		{
+			// an error, writev tries the rest of the batch again and
+			// reports it if it gets it too
+			_failedWrites++;
+		}
+		break;
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::write()
+//-----------------------------------------------------------------------------
+bool UringBackend::write(const int fd, struct iovec* iov, const size_t n)
+{
+	if (_fallback) return _writev.write(fd, iov, n);
+
+	if (!n) return true;
+
+	if (_pool && _pool->generation() != _generation) registerArena();
+
+	// a fixed write per registered page, a writev per run of the rest
+	_ops.clear();
+
+	size_t i = 0;
+	while (i < n)
+	{
+		int b = _fixed ? fixedBuffer(iov[i]) : -1;
+
+		if (b >= 0)
+		{
+			const Op o = { i, 1, b, iov[i].iov_len };
+			_ops.push_back(o);
+			i++;
+			continue;
+		}
+
+		Op o = { i, 0, -1, 0 };
+		do
+		{
+			o.bytes += iov[i].iov_len;
+			o.count++;
+			i++;
+		}
+		while (i < n && o.count < IOV_MAX && !(_fixed && fixedBuffer(iov[i]) >= 0));
+
+		_ops.push_back(o);
+	}
+
+	// the files are O_APPEND, the kernel puts it at the end anyway
+	off_t offset = lseek(fd, 0, SEEK_END);
+	if (offset < 0) return false;
+
+	for (size_t first = 0; first < _ops.size(); )
+	{
+		const unsigned count = std::min((size_t)_entries, _ops.size() - first);
+
+		size_t ok = 0;
+		size_t partial = 0;
+
+		if (!submit(fd, offset, iov, first, count, ok, partial)) return false;
+
+		if (ok < count)
+		{
+			// cut short, writev the rest from where it stopped
+			size_t at = _ops[first + ok].first;
+			while (partial && partial >= iov[at].iov_len)
+			{
+				partial -= iov[at].iov_len;
+				at++;
+			}
+			if (partial)
+			{
+				iov[at].iov_base = (uint8_t*)iov[at].iov_base + partial;
+				iov[at].iov_len -= partial;
+			}
+			return _writev.write(fd, iov + at, n - at);
+		}
+
+		first += count;
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// UringBackend::describe()
+//-----------------------------------------------------------------------------
+void UringBackend::describe(std::ostream& out) const
+{
+	out << name() << " depth: " << _entries
+		<< ", fixed buffers: " << (_fixed ? _buffers.size() : 0)
+		<< ", fixed writes: " << _fixedWrites
+		<< ", vector writes: " << _vectorWrites
+		<< ", short writes: " << _shortWrites
+		<< ", failed writes: " << _failedWrites;
+
+	if (_fallback) out << ", fell back to writev";
+}
+#else // KLEIN_IO_URING
+//-----------------------------------------------------------------------------
+// no io_uring in this build
+//-----------------------------------------------------------------------------
+UringBackend* UringBackend::create(const unsigned, const PagePool*)
+{
+	return NULL;
+}
+bool UringBackend::write(const int fd, struct iovec* iov, const size_t n)
+{
+	return _writev.write(fd, iov, n);
+}
+void UringBackend::describe(std::ostream& out) const
+{
+	out << name() << " not built";
+}
+#endif // KLEIN_IO_URING
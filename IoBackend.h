@@ -0,0 +1,206 @@
+#ifndef _KLEIN_IO_BACKEND_H_
+#define _KLEIN_IO_BACKEND_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/IoBackend.h#1 $
+//
+
+#include <ostream>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h> // iovec
+#include <sys/types.h> // off_t
+
+#include <utility>
+#include <vector>
+
+#include "PagePool.h"
+#include "RecorderConfig.h"
+
+namespace klein
+{
+
+// how the IoThread gets a gather list into a file. write() only returns
+// once all of it is written, or it failed, so the pages can go back to
+// the pool as soon as it does.
+class IoBackend
+{
+	public:
+
+		virtual ~IoBackend() {}
+
+		// write all n iovecs to the end of fd, in order. fd must be
+		// O_APPEND, iov may be changed. false with errno set if it failed.
+		virtual bool write(const int fd, struct iovec* iov, const size_t n) = 0;
+
+		virtual const char* name() const = 0;
+
+		// where the data written to fd ends
+		virtual off_t end(const int fd);
+
+		// fd is about to be synced and closed
+		virtual void closing(const int) {}
+
+		// about how big the next new file will get, 0 if unknown
+		virtual void sizeHint(const size_t) {}
+
+		// what it is doing, for the logs
+		virtual void describe(std::ostream& out) const { out << name(); }
+
+		// the backend the config asks for, or writev if the kernel
+		// can't do it. pool, if given, is registered for fixed buffer
+		// writes. never NULL.
+		static IoBackend* create(const IoConfig& c, const PagePool* pool = NULL);
+};
+
+// writev() as much as it will take, it may stop short and there is
+// a limit on the vector length
+class WritevBackend : public IoBackend
+{
+	public:
+
+		virtual bool write(const int fd, struct iovec* iov, const size_t n);
+		virtual const char* name() const { return "writev"; }
+};
+
+// pages are copied straight into a shared mapping of the file, so a
+// write is a memcpy, no system call.
+//
+// a new file is fallocated to the size hint up front, so it doesn't
+// fragment or stall on block allocation as it grows, and grows by a
+// quarter of that if the hint was short. only a window of the file is
+// mapped, it slides forward a window at a time, MADV_SEQUENTIAL while
+// it is being filled and MADV_DONTNEED once it is done with. the file
+// is cut back to what was written when it is closed.
+//
+// if the recorder dies the file keeps its zero filled tail.
+class MmapBackend : public IoBackend
+{
+	public:
+
+		MmapBackend();
+		virtual ~MmapBackend();
+
+		virtual bool write(const int fd, struct iovec* iov, const size_t n);
+		virtual const char* name() const { return "mmap"; }
+		virtual off_t end(const int fd);
+		virtual void closing(const int fd);
+		virtual void sizeHint(const size_t bytes) { _hint = bytes; }
+		virtual void describe(std::ostream& out) const;
+
+	private:
+		// no copy or operator = ctors
+		MmapBackend(const MmapBackend& rhs);
+		MmapBackend& operator = (const MmapBackend& rhs);
+
+		bool attach(const int fd);
+		void detach();
+		bool slide();
+		bool allocate(const off_t size);
+
+		int _fd;			// the file mapped, or -1
+		off_t _end;			// written up to here
+		off_t _allocated;	// the file is this big
+		uint8_t* _map;		// the window, or NULL
+		off_t _mapOffset;	// file offset of the window
+		size_t _hint;
+
+		uint64_t _slides;
+		uint64_t _grows;
+
+		// bytes mapped at once, a multiple of the page size
+		static const size_t window;
+		// smallest preallocation
+		static const size_t minAllocation;
+};
+
+// io_uring through the raw system calls, no liburing.
+//
+// a batch goes in as one chain of linked writes, so the kernel does
+// them in order. a gather list that lies in a registered slab of the
+// page arena is a WRITE_FIXED, anything else (markers, heap pages) runs
+// of plain WRITEVs. a batch longer than the queue goes in as several
+// chains, one after the other.
+//
+// the arena is registered again whenever its layout generation moves,
+// that only happens while it warms up. if it can't be registered, most
+// likely RLIMIT_MEMLOCK, every write is a WRITEV.
+//
+// a short write cancels the rest of its chain, what is left is written
+// with writev(). if the kernel turns the ops down the backend switches
+// to writev() for good.
+class UringBackend : public IoBackend
+{
+	public:
+
+		// NULL if the kernel doesn't do io_uring
+		static UringBackend* create(const unsigned depth, const PagePool* pool);
+
+		virtual ~UringBackend();
+
+		virtual bool write(const int fd, struct iovec* iov, const size_t n);
+		virtual const char* name() const { return "io_uring"; }
+		virtual void describe(std::ostream& out) const;
+
+	private:
+		UringBackend();
+
+		// no copy or operator = ctors
+		UringBackend(const UringBackend& rhs);
+		UringBackend& operator = (const UringBackend& rhs);
+
+		// one sqe's worth of the gather list
+		struct Op
+		{
+			size_t first;	// iovec index
+			size_t count;	// iovecs, 1 for a fixed write
+			int buf;		// registered buffer, -1 for a writev
+			size_t bytes;
+		};
+
+		bool setup(const unsigned depth);
+		void registerArena();
+		int fixedBuffer(const struct iovec& v) const;
+		bool submit(const int fd, off_t& offset, const struct iovec* iov,
+				const size_t first, const unsigned count, size_t& ok, size_t& partial);
+
+		int _ring;
+		unsigned _entries;
+
+		// mmapped rings
+		void* _sqMap;
+		size_t _sqMapSize;
+		void* _cqMap;
+		size_t _cqMapSize;
+		void* _sqes;
+		size_t _sqesSize;
+
+		unsigned* _sqHead;
+		unsigned* _sqTail;
+		unsigned* _sqMask;
+		unsigned* _sqArray;
+		unsigned* _cqHead;
+		unsigned* _cqTail;
+		unsigned* _cqMask;
+		void* _cqes;
+
+		// registered page arena, sorted by address
+		const PagePool* _pool;
+		uint64_t _generation;
+		std::vector<std::pair<uint8_t*, size_t> > _buffers;
+		bool _fixed;		// registration works
+
+		bool _fallback;		// the kernel turned the ops down
+
+		std::vector<Op> _ops;
+		std::vector<int> _results;
+		WritevBackend _writev;
+
+		uint64_t _fixedWrites;
+		uint64_t _vectorWrites;
+		uint64_t _shortWrites;
+		uint64_t _failedWrites;	// errors writev was given the rest for
+};
+
+} // namespace klein
+#endif // _KLEIN_IO_BACKEND_H_
@@ -0,0 +1,271 @@
+// compares the ways the Recorder can get pages to disk: stdio, as the
+// PageWriter used to, and the writev, io_uring and mmap IoBackends.
+//
+// the same batches of arena pages are written over and over to a file
+// in dir, each run ends with an fdatasync. reports sustained MB/s and
+// the batch write latency, one line per backend:
+//
+//   backend=io_uring mb_s=812.4 batches=8192 p50_us=101 p99_us=388 max_us=2210
+//
+// the IoBench configuration builds it, with IoBackend.cpp, PagePool.cpp
+// and ToolUtil.cpp
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/IoBench.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "PagePool.h"
+#include "IoBackend.h"
+#include "ToolUtil.h"
+
+using namespace klein;
+
+// a batch as the PageWriter builds it, a marker then a page, repeated
+struct Batch
+{
+	Batch() : bytes(0) {}
+
+	std::vector<PageRef> pages;
+	std::vector<struct iovec> iov;
+	size_t bytes;
+};
+
+static const uint32_t marker = 0xffffffff;
+
+// the latency and throughput of one run
+struct Result
+{
+	std::string backend;
+	double mb_s;
+	std::vector<int64_t> ns;	// per batch
+};
+
+static void report(const Result& r)
+{
+	std::vector<int64_t> ns(r.ns);
+
+	std::cout << "backend=" << r.backend
+		<< " mb_s=" << std::fixed << std::setprecision(1) << r.mb_s
+		<< " batches=" << ns.size()
+		<< " p50_us=" << percentile(ns, 50) / 1000
+		<< " p99_us=" << percentile(ns, 99) / 1000
+		<< " max_us=" << percentile(ns, 100) / 1000 << std::endl;
+}
+
+// write rounds batches through a backend, or stdio if b is NULL
+static bool run(const std::string& path, IoBackend* b,
+		const std::vector<Batch>& batches, const size_t rounds, Result& r)
+{
+	const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+	if (fd < 0)
+	{
+		std::cerr << "open(" << path << ") failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	FILE* fp = NULL;
+	if (!b)
+	{
+		// the old PageWriter: fwrite each piece, fflush each batch
+		fp = fdopen(fd, "ab");
+		if (!fp)
+		{
+			close(fd);
+			return false;
+		}
+	}
+
+	size_t bytes = 0;
+	std::vector<struct iovec> iov;
+	bool ok = true;
+
+	r.ns.clear();
+	r.ns.reserve(rounds);
+
+	const int64_t start = now();
+
+	for (size_t i = 0; i < rounds && ok; i++)
+	{
+		const Batch& batch = batches[i % batches.size()];
+
+		// the backends may change the gather list
+		iov = batch.iov;
+
+		const int64_t t0 = now();
+
+		if (b)
+		{
+			ok = b->write(fd, iov.data(), iov.size());
+		}
+		else
+		{
+			for (auto& v : iov)
+				ok = ok && fwrite(v.iov_base, 1, v.iov_len, fp) == v.iov_len;
+			ok = ok && fflush(fp) == 0;
+		}
+
+		r.ns.push_back(now() - t0);
+		bytes += batch.bytes;
+	}
+
+	if (!ok) std::cerr << r.backend << " write failed: " << strerror(errno) << std::endl;
+
+	// the run isn't over until it is on disk
+	if (b) b->closing(fd);
+	ok = (fdatasync(fd) == 0) && ok;
+
+	const int64_t elapsed = now() - start;
+
+	if (fp) fclose(fp);
+	else close(fd);
+
+	unlink(path.c_str());
+
+	r.mb_s = elapsed ? (bytes / 1e6) / (elapsed / 1e9) : 0;
+	return ok;
+}
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[-d --dir path]"
+		<< "[--mb total]"
+		<< "[--page bytes]"
+		<< "[--batch pages]"
+		<< "[--depth entries]"
+		<< std::endl;
+	std::cerr << "\tdefault: -d /tmp --mb 512 --page 65536 --batch 16 --depth 64"
+		<< std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	std::string dir("/tmp");
+	size_t mb = 512;
+	size_t pageSize = 65536;
+	size_t batchPages = 16;
+	unsigned depth = 64;
+
+	try
+	{
+		ops >> GetOpt::Option('d', "dir", dir, dir)
+			>> GetOpt::Option("mb", mb, mb)
+			>> GetOpt::Option("page", pageSize, pageSize)
+			>> GetOpt::Option("batch", batchPages, batchPages)
+			>> GetOpt::Option("depth", depth, depth);
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	if (!pageSize || !batchPages)
+	{
+		usage(av[0]);
+		return -1;
+	}
+
+	// as many pages as the Recorder's arena holds by default, spread
+	// over batches the way the Policy hands them out
+	const size_t slabs = 64;
+	PagePool pool(slabs);
+
+	std::vector<Batch> batches((slabs + batchPages - 1) / batchPages);
+
+	for (size_t p = 0; p < slabs; p++)
+	{
+		Batch& b = batches[p / batchPages];
+
+		PageRef page = pool.acquire(pageSize, 21, p);
+		memset(page->data, (int)p, pageSize);
+		page->length = pageSize;
+
+		struct iovec v;
+		v.iov_base = const_cast<uint32_t*>(&marker);
+		v.iov_len = sizeof(marker);
+		b.iov.push_back(v);
+		v.iov_base = page->data;
+		v.iov_len = page->length;
+		b.iov.push_back(v);
+
+		b.bytes += sizeof(marker) + page->length;
+		b.pages.push_back(std::move(page));
+	}
+
+	size_t batchBytes = 0;
+	for (auto& b : batches) batchBytes += b.bytes;
+	batchBytes /= batches.size();
+
+	const size_t rounds = std::max((size_t)1, (mb * 1000000) / batchBytes);
+
+	std::cout << "# " << rounds << " batches of " << batchBytes << " bytes to "
+		<< dir << std::endl;
+
+	IoConfig c;
+	c.depth = depth;
+
+	c.backend = IoConfig::writev;
+	std::unique_ptr<IoBackend> writev(IoBackend::create(c, &pool));
+
+	c.backend = IoConfig::uring;
+	std::unique_ptr<IoBackend> uring(IoBackend::create(c, &pool));
+
+	c.backend = IoConfig::mmap;
+	std::unique_ptr<IoBackend> mapped(IoBackend::create(c, &pool));
+	mapped->sizeHint(rounds * batchBytes);
+
+	const bool haveUring = strcmp(uring->name(), writev->name()) != 0;
+
+	if (!haveUring)
+		std::cout << "# no io_uring in this kernel" << std::endl;
+
+	const std::string path = dir + "/iobench.dat";
+
+	Result r;
+
+	r.backend = "stdio";
+	if (run(path, NULL, batches, rounds, r)) report(r);
+
+	r.backend = writev->name();
+	if (run(path, writev.get(), batches, rounds, r)) report(r);
+
+	if (haveUring)
+	{
+		r.backend = uring->name();
+		if (run(path, uring.get(), batches, rounds, r)) report(r);
+
+		std::cout << "# ";
+		uring->describe(std::cout);
+		std::cout << std::endl;
+	}
+
+	r.backend = mapped->name();
+	if (run(path, mapped.get(), batches, rounds, r)) report(r);
+
+	return 0;
+}
@@ -0,0 +1,505 @@
+#include <iostream>
+#include <sstream>
+#include <cstring> // memset(), strerror()
+#include <errno.h>
+#include <time.h>
+#include <unistd.h> // close(), fdatasync()
+#include <fcntl.h> // sync_file_range()
+
+#include "IoThread.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/IoThread.cpp#1 $";
+
+//-----------------------------------------------------------------------------
+// IoThread::Batch
+//-----------------------------------------------------------------------------
+void IoThread::Batch::add(const void* p, const size_t n)
+{
+	if (!n) return;
+
+	struct iovec v;
+	v.iov_base = const_cast<void*>(p);
+	v.iov_len = n;
+
+	iov.push_back(v);
+	bytes += n;
+}
+void IoThread::Batch::add(PageRef&& page)
+{
+	if (!page) return;
+
+	add(page->data, page->length);
+	pages.push_back(std::move(page));
+}
+void IoThread::Batch::addIndex(const void* p, const size_t n)
+{
+	const uint8_t* b = (const uint8_t*)p;
+	index.insert(index.end(), b, b + n);
+}
+void IoThread::Batch::clear()
+{
+	// vectors keep their capacity, the pages go back to the pool
+	iov.clear();
+	pages.clear();
+	bytes = 0;
+	index.clear();
+}
+//-----------------------------------------------------------------------------
+// IoThread CTOR
+//-----------------------------------------------------------------------------
+IoThread::IoThread(const size_t nBatches, const Durability& d,
+		const IoConfig& io, const PagePool* pool) :
+	_fill(NULL), _busy(false), _running(true), _sizeHint(0),
+	_finalBusy(false), _finalRunning(true), _durability(d),
+	_backend(IoBackend::create(io, pool))
+{
+	// swapping needs at least two
+	const size_t n = (nBatches < 2) ? 2 : nBatches;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		_batches.push_back(new Batch);
+		_free.push_back(_batches.back());
+	}
+
+	_fill = _free.back();
+	_free.pop_back();
+
+	memset(&_stats, '\0', sizeof(_stats));
+
+	_dirty.fd = -1;
+	_dirty.onDisk = _dirty.started = _dirty.end = 0;
+
+	_thread = std::thread(&IoThread::run, this);
+	_finalizer = std::thread(&IoThread::finalize, this);
+}
+//-----------------------------------------------------------------------------
+// IoThread DTOR
+//-----------------------------------------------------------------------------
+IoThread::~IoThread()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_running = false;
+	}
+	_work.notify_one();
+
+	// run() finishes the queue before it returns
+	if (_thread.joinable())
+		_thread.join();
+
+	// then the files it closed
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_finalRunning = false;
+	}
+	_final.notify_one();
+
+	if (_finalizer.joinable())
+		_finalizer.join();
+
+	for (auto b : _batches)
+		delete b;
+}
+//-----------------------------------------------------------------------------
+// IoThread::submit()
+//-----------------------------------------------------------------------------
+IoThread::Batch* IoThread::submit(const int fd, const int indexFd)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	// nothing to write, keep filling the same batch
+	if (fd < 0 || _fill->empty()) return _fill;
+
+	const Job j = { fd, _fill, indexFd };
+	_jobs.push_back(j);
+
+	const uint32_t depth = _jobs.size();
+	_stats.queueDepth = depth;
+	if (depth > _stats.maxQueueDepth) _stats.maxQueueDepth = depth;
+
+	_work.notify_one();
+
+	if (_free.empty())
+	{
+		// the disk is behind, this is what we are trying to avoid
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		_done.wait(lock, [this] { return !_free.empty(); });
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		_stats.stalls++;
+		_stats.stall_usec += (t1.tv_sec - t0.tv_sec) * 1000000
+			+ (t1.tv_nsec - t0.tv_nsec) / 1000;
+	}
+
+	_fill = _free.back();
+	_free.pop_back();
+
+	return _fill;
+}
+//-----------------------------------------------------------------------------
+// IoThread::close()
+//-----------------------------------------------------------------------------
+void IoThread::close(const int fd)
+{
+	if (fd < 0) return;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	const Job j = { fd, NULL, -1 };
+	_jobs.push_back(j);
+
+	_work.notify_one();
+}
+//-----------------------------------------------------------------------------
+// IoThread::drain()
+//-----------------------------------------------------------------------------
+void IoThread::drain()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	_done.wait(lock, [this]
+		{ return _jobs.empty() && !_busy && _finals.empty() && !_finalBusy; });
+}
+//-----------------------------------------------------------------------------
+// IoThread::stats()
+//-----------------------------------------------------------------------------
+IoThread::Stats IoThread::stats() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats;
+}
+//-----------------------------------------------------------------------------
+// IoThread::write()
+//-----------------------------------------------------------------------------
+bool IoThread::write(const Job& j)
+{
+	Batch& b = *j.batch;
+
+	if (!b.iov.empty() && !_backend->write(j.fd, b.iov.data(), b.iov.size()))
+		return false;
+
+	// the index only once the pages it points at are written
+	const uint8_t* p = b.index.data();
+	size_t left = (j.indexFd < 0) ? 0 : b.index.size();
+
+	while (left)
+	{
+		const ssize_t n = ::write(j.indexFd, p, left);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return false;
+		}
+		p += n;
+		left -= n;
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------
+// IoThread::sizeHint()
+//-----------------------------------------------------------------------------
+void IoThread::sizeHint(const size_t bytes)
+{
+	// handed to the backend by the io thread, with the next job
+	std::lock_guard<std::mutex> lock(_mutex);
+	_sizeHint = bytes;
+}
+//-----------------------------------------------------------------------------
+// IoThread::written()
+//-----------------------------------------------------------------------------
+void IoThread::written(const int fd, const size_t bytes)
+{
+	// note how far the file has got, and sync it if that is due
+	if (_durability.mode == Durability::none) return;
+
+	// where this write went
+	const off_t end = _backend->end(fd);
+	if (end < 0) return;
+
+	if (_dirty.fd != fd || end < _dirty.end)
+	{
+		// a new file, one opened again or one cut short, what was there
+		// before is already on disk
+		_dirty.fd = fd;
+		_dirty.onDisk = _dirty.started = end - bytes;
+		_dirty.since = std::chrono::steady_clock::now();
+	}
+	else if (_dirty.end == _dirty.started)
+	{
+		_dirty.since = std::chrono::steady_clock::now();
+	}
+	_dirty.end = end;
+
+	if (syncDue()) sync();
+}
+//-----------------------------------------------------------------------------
+// IoThread::syncDue()
+//-----------------------------------------------------------------------------
+bool IoThread::syncDue() const
+{
+	if (_dirty.fd < 0 || _dirty.end == _dirty.started) return false;
+
+	if ((size_t)(_dirty.end - _dirty.started) >= _durability.bytes) return true;
+
+	return _durability.mode == Durability::datasync && _durability.msec
+		&& std::chrono::steady_clock::now() - _dirty.since
+			>= std::chrono::milliseconds(_durability.msec);
+}
+//-----------------------------------------------------------------------------
+// IoThread::sync()
+//-----------------------------------------------------------------------------
+bool IoThread::sync()
+{
+	// called without the lock held
+	if (_dirty.fd < 0 || _dirty.end == _dirty.onDisk) return true;
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	bool failed = false;
+	const char* what = "fdatasync()";
+
+	if (_durability.mode == Durability::writeback)
+	{
+		// start writeback of what is new, then wait for the chunk
+		// started last time. the disk stays busy and the dirty pages
+		// stay bounded, without flushing the journal.
+		what = "sync_file_range()";
+
+		failed = sync_file_range(_dirty.fd, _dirty.started,
+				_dirty.end - _dirty.started, SYNC_FILE_RANGE_WRITE) != 0;
+
+		if (!failed && _dirty.started > _dirty.onDisk)
+		{
+			failed = sync_file_range(_dirty.fd, _dirty.onDisk,
+					_dirty.started - _dirty.onDisk,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+					| SYNC_FILE_RANGE_WAIT_AFTER) != 0;
+		}
+
+		if (!failed)
+		{
+			_dirty.onDisk = _dirty.started;
+			_dirty.started = _dirty.end;
+		}
+	}
+	else
+	{
+		failed = fdatasync(_dirty.fd) != 0;
+
+		if (!failed) _dirty.onDisk = _dirty.started = _dirty.end;
+	}
+	const int e = errno;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (failed)
+	{
+		std::ostringstream os;
+		printTime(os);
+		os << " - " << what << " failed: " << strerror(e);
+		std::cerr << os.str() << std::endl;
+
+		// don't keep trying on every write
+		_dirty.onDisk = _dirty.started = _dirty.end;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_stats.syncs++;
+	_stats.sync_usec += (t1.tv_sec - t0.tv_sec) * 1000000
+		+ (t1.tv_nsec - t0.tv_nsec) / 1000;
+	if (failed) _stats.writeErrors++;
+
+	return !failed;
+}
+//-----------------------------------------------------------------------------
+// IoThread::run()
+//-----------------------------------------------------------------------------
+void IoThread::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	const auto ready = [this] { return !_jobs.empty() || !_running; };
+
+	for (;;)
+	{
+		if (_durability.mode == Durability::datasync && _durability.msec
+			&& _dirty.fd >= 0 && _dirty.end != _dirty.started)
+		{
+			// don't let unsynced data sit longer than msec, even if
+			// nothing more is written
+			const auto due = _dirty.since + std::chrono::milliseconds(_durability.msec);
+
+			if (!_work.wait_until(lock, due, ready))
+			{
+				lock.unlock();
+				sync();
+				lock.lock();
+				continue;
+			}
+		}
+		else
+		{
+			_work.wait(lock, ready);
+		}
+
+		// only leave once the queue is empty, nothing is lost on shutdown
+		if (_jobs.empty()) break;
+
+		const Job j = _jobs.front();
+		_jobs.pop_front();
+		_busy = true;
+
+		_backend->sizeHint(_sizeHint);
+
+		lock.unlock();
+
+		bool failed = false;
+		int e = 0;
+		size_t bytes = 0;
+
+		if (j.batch)
+		{
+			bytes = j.batch->bytes;
+			failed = !write(j);
+			e = errno;
+
+			// give the pages back
+			j.batch->clear();
+
+			if (!failed) written(j.fd, bytes);
+		}
+		else
+		{
+			// no more writes, the finalizer has it from here
+			_backend->closing(j.fd);
+
+			if (_dirty.fd == j.fd) _dirty.fd = -1;
+		}
+
+		if (failed)
+		{
+			std::ostringstream os;
+			printTime(os);
+			os << " - " << (j.batch ? _backend->name() : "close()")
+				<< " failed: " << strerror(e);
+			std::cerr << os.str() << std::endl;
+		}
+
+		lock.lock();
+
+		if (j.batch)
+		{
+			_free.push_back(j.batch);
+			_stats.batchesWritten++;
+			if (!failed) _stats.bytesWritten += bytes;
+		}
+		else
+		{
+			_finals.push_back(j.fd);
+			_final.notify_one();
+		}
+		if (failed) _stats.writeErrors++;
+
+		_stats.queueDepth = _jobs.size();
+		_busy = false;
+
+		_done.notify_all();
+	}
+}
+//-----------------------------------------------------------------------------
+// IoThread::finalize()
+//-----------------------------------------------------------------------------
+void IoThread::finalize()
+{
+	// sync and close each file the io thread is done with, in order
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	for (;;)
+	{
+		_final.wait(lock, [this] { return !_finals.empty() || !_finalRunning; });
+
+		if (_finals.empty()) break;
+
+		const int fd = _finals.front();
+		_finals.pop_front();
+		_finalBusy = true;
+
+		lock.unlock();
+
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		// only this file, not every file system on the vehicle
+		bool failed = false;
+		const char* what = "fdatasync()";
+
+		if (_durability.mode != Durability::none)
+			failed = fdatasync(fd) != 0;
+
+		if (!failed)
+		{
+			what = "close()";
+			failed = ::close(fd) != 0;
+		}
+		else
+		{
+			::close(fd);
+		}
+		const int e = errno;
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		if (failed)
+		{
+			std::ostringstream os;
+			printTime(os);
+			os << " - " << what << " failed: " << strerror(e);
+			std::cerr << os.str() << std::endl;
+		}
+
+		lock.lock();
+
+		_stats.finals++;
+		_stats.final_usec += (t1.tv_sec - t0.tv_sec) * 1000000
+			+ (t1.tv_nsec - t0.tv_nsec) / 1000;
+		if (failed) _stats.writeErrors++;
+
+		_finalBusy = false;
+
+		_done.notify_all();
+	}
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const IoThread::Stats& s)
+	{
+		out << "IO queue: " << s.queueDepth
+			<< ", max: " << s.maxQueueDepth
+			<< ", stalls: " << s.stalls
+			<< " (" << s.stall_usec << " us)"
+			<< ", batches: " << s.batchesWritten
+			<< ", bytes: " << s.bytesWritten
+			<< ", errors: " << s.writeErrors
+			<< ", syncs: " << s.syncs
+			<< " (" << s.sync_usec << " us)"
+			<< ", files closed: " << s.finals
+			<< " (" << s.final_usec << " us)";
+		return out;
+	}
+}
@@ -0,0 +1,172 @@
+#ifndef _KLEIN_IO_THREAD_H_
+#define _KLEIN_IO_THREAD_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/IoThread.h#1 $
+//
+
+#include <ostream>
+#include <stdint.h>
+#include <sys/uio.h> // iovec
+#include <sys/types.h> // off_t
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+#include "PagePool.h"
+#include "RecorderConfig.h"
+#include "IoBackend.h"
+
+namespace klein
+{
+
+// the PageWriter's disk side. the writer fills one batch while this
+// thread writes out the ones already handed to it, so write, close and
+// sync never run on the fetch thread.
+//
+// a closed file is finished off, synced and closed, by a second thread,
+// so the first writes to the next file don't wait behind the sync of
+// the whole of the last one.
+//
+// a batch is a gather list over the pages themselves, written by the
+// IoBackend, so page data is never copied on its way to disk. the batch
+// owns its pages until they are written, then they go back to the pool.
+//
+// jobs are done strictly in the order they are submitted, so a close
+// queued after a batch always follows that batch's write.
+//
+// the file being written is synced as the Durability says, only that
+// file, never the whole system.
+class IoThread
+{
+	public:
+
+		struct Stats
+		{
+			uint32_t queueDepth;	// batches waiting to be written now
+			uint32_t maxQueueDepth;	// worst seen
+			uint64_t stalls;		// times submit() waited for a free batch
+			uint64_t stall_usec;	// total time spent waiting
+			uint64_t batchesWritten;
+			uint64_t bytesWritten;
+			uint64_t writeErrors;
+			uint64_t syncs;			// fdatasync or sync_file_range waits
+			uint64_t sync_usec;		// total time spent in them
+			uint64_t finals;		// files synced and closed by the finalizer
+			uint64_t final_usec;	// total time spent on them
+		};
+
+		struct Batch
+		{
+			Batch() : bytes(0) {}
+
+			// p must stay valid until written, i.e. static or in pages
+			void add(const void* p, const size_t n);
+			void add(PageRef&& page);
+			// copied, appended to the index file after the batch
+			void addIndex(const void* p, const size_t n);
+			void clear();
+
+			inline bool empty() const { return iov.empty() && index.empty(); }
+
+			std::vector<struct iovec> iov;
+			std::vector<PageRef> pages;
+			size_t bytes;
+			std::vector<uint8_t> index;
+		};
+
+		// at most nBatches are queued or filling at once
+		// pool, if given, is the arena the backend may register
+		IoThread(const size_t nBatches, const Durability& d = Durability(),
+				const IoConfig& io = IoConfig(), const PagePool* pool = NULL);
+		~IoThread();
+
+		// the batch to fill
+		inline Batch* batch() { return _fill; }
+
+		// queue the fill batch for write to fd, and its index to
+		// indexFd, returns the next batch to fill. only waits if every
+		// batch is queued.
+		Batch* submit(const int fd, const int indexFd = -1);
+
+		// queue close() of fd behind its writes, synced first unless the
+		// durability is none. done by the finalizer.
+		void close(const int fd);
+
+		// about how big the next new file will get, 0 if unknown
+		void sizeHint(const size_t bytes);
+
+		// wait until every queued job is done, and every file closed
+		void drain();
+
+		Stats stats() const;
+
+		// only look at it from the io thread, or once drained
+		inline const IoBackend& backend() const { return *_backend; }
+
+	private:
+		// no copy or operator = ctors
+		IoThread(const IoThread& rhs);
+		IoThread& operator = (const IoThread& rhs);
+
+		struct Job
+		{
+			int fd;
+			Batch* batch;	// NULL for a close
+			int indexFd;
+		};
+
+		// the file being written and how much of it is on disk
+		struct Dirty
+		{
+			int fd;				// -1 if nothing is dirty
+			off_t onDisk;		// known to be on disk up to here
+			off_t started;		// writeback started up to here
+			off_t end;			// written up to here
+			std::chrono::steady_clock::time_point since;	// first unsynced write
+		};
+
+		void run();
+		void finalize();
+		bool write(const Job& j);
+		void written(const int fd, const size_t bytes);
+		bool syncDue() const;
+		bool sync();
+
+		std::vector<Batch*> _batches;	// owned
+		std::vector<Batch*> _free;		// not queued or filling
+		Batch* _fill;
+
+		std::deque<Job> _jobs;
+		bool _busy;
+		bool _running;
+		size_t _sizeHint;
+
+		std::deque<int> _finals;	// fds to sync and close
+		bool _finalBusy;
+		bool _finalRunning;
+
+		mutable std::mutex _mutex;
+		std::condition_variable _work;	// jobs queued, or stopping
+		std::condition_variable _done;	// a batch is free, or a job finished
+		std::condition_variable _final;	// fds to close, or stopping
+
+		Stats _stats;
+
+		const Durability _durability;
+		std::unique_ptr<IoBackend> _backend;
+		Dirty _dirty;		// only touched by the io thread
+
+		std::thread _thread;
+		std::thread _finalizer;
+
+	friend std::ostream& operator << (std::ostream& out, const IoThread::Stats& s);
+};
+
+} // namespace klein
+#endif // _KLEIN_IO_THREAD_H_
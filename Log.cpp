@@ -0,0 +1,245 @@
+#include <iostream>
+#include <unistd.h>
+#include <time.h> // localtime_r(), strftime()
+
+#include "Log.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern const char* errorName(const DLLErrorCode ec);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/Log.cpp#1 $";
+
+// records held for the thread, a few seconds of pages at any rate
+const size_t Log::ringSize = 8192;
+
+// written out once this much has been formatted, or the ring is empty
+const size_t Log::batchBytes = 64 << 10;
+
+// how long the thread sleeps when the ring is empty
+const useconds_t Log::pollPeriod_usec = 20000;
+
+// s += v in decimal, zero padded to width
+static void append(std::string& s, int64_t v, const int width = 0)
+{
+	char buf[24];
+	char* p = buf + sizeof(buf);
+	const bool negative = v < 0;
+	uint64_t u = negative ? -(uint64_t)v : v;
+
+	do { *--p = '0' + u % 10; u /= 10; } while (u);
+	while (buf + sizeof(buf) - p < width) *--p = '0';
+	if (negative) *--p = '-';
+
+	s.append(p, buf + sizeof(buf) - p);
+}
+
+//-----------------------------------------------------------------------------
+// Log::instance()
+//-----------------------------------------------------------------------------
+Log& Log::instance()
+{
+	static Log log;
+	return log;
+}
+//-----------------------------------------------------------------------------
+// Log CTOR
+//-----------------------------------------------------------------------------
+Log::Log() :
+	_ring(ringSize), _verbosity(pages), _dropped(0), _reported(0),
+	_second(-1), _os(&std::cout), _es(&std::cerr), _running(false)
+{
+	_clock[0] = '\0';
+	_out.reserve(batchBytes * 2);
+	_err.reserve(batchBytes / 8);
+}
+//-----------------------------------------------------------------------------
+// Log DTOR
+//-----------------------------------------------------------------------------
+Log::~Log()
+{
+	stop();
+}
+//-----------------------------------------------------------------------------
+// Log::start()
+//-----------------------------------------------------------------------------
+void Log::start(std::ostream& out, std::ostream& err)
+{
+	if (_running) return;
+
+	_os = &out;
+	_es = &err;
+
+	_running = true;
+	_thread = std::thread(&Log::run, this);
+}
+//-----------------------------------------------------------------------------
+// Log::stop()
+//-----------------------------------------------------------------------------
+void Log::stop()
+{
+	_running = false;
+
+	if (_thread.joinable())
+		_thread.join();
+}
+//-----------------------------------------------------------------------------
+// Log::log()
+//-----------------------------------------------------------------------------
+bool Log::log(Record& r)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.usec = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	if (_ring.push(r)) return true;
+
+	_dropped.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+//-----------------------------------------------------------------------------
+// Log::run()
+//-----------------------------------------------------------------------------
+void Log::run()
+{
+	Record r;
+
+	while (_running.load(std::memory_order_relaxed))
+	{
+		while (_ring.pop(r))
+		{
+			format(r);
+			if (_out.size() + _err.size() >= batchBytes) flush();
+		}
+
+		flush();
+		usleep(pollPeriod_usec);
+	}
+
+	// what came in while stopping
+	while (_ring.pop(r)) format(r);
+	flush();
+}
+//-----------------------------------------------------------------------------
+// Log::format()
+//-----------------------------------------------------------------------------
+void Log::format(const Record& r)
+{
+	switch (r.event)
+	{
+		case page:
+			timestamp(_out, r.usec);
+			_out += " - Ping : ";
+			append(_out, r.ping);
+			_out += ", numberBytes: ";
+			append(_out, r.bytes);
+			_out += ", pageVersion: ";
+			append(_out, r.version);
+			_out += ", sdfExtensionSize: ";
+			append(_out, r.sdfx);
+			_out += '\n';
+			break;
+
+		case old:
+			timestamp(_err, r.usec);
+			_err += " - Page Status (NGS_GETDATA_ERROR_OLD): ";
+			append(_err, r.status);
+			_err += ", PT: ";
+			append(_err, r.pageType);
+			_err += ", Requested Ping: ";
+			append(_err, r.ping);
+			_err += '\n';
+			break;
+
+		case skipped:
+			{
+				const char* const name = errorName(r.error);
+
+				timestamp(_err, r.usec);
+				_err += " - GetDataPageInfo2() failed, PT: ";
+				append(_err, r.pageType);
+				_err += ", Requested Ping: ";
+				append(_err, r.ping);
+				_err += ' ';
+				if (name) _err += name;
+				else { _err += "Unknown Error Code: "; append(_err, r.error); }
+				_err += '\n';
+			}
+			break;
+	}
+}
+//-----------------------------------------------------------------------------
+// Log::timestamp()
+//-----------------------------------------------------------------------------
+void Log::timestamp(std::string& s, const int64_t usec)
+{
+	// as printTime(), but localtime and strftime only once a second
+	const time_t second = usec / 1000000;
+
+	if (second != _second)
+	{
+		struct tm tm;
+
+		_second = second;
+		if (!localtime_r(&second, &tm) ||
+				strftime(_clock, sizeof(_clock), "%X", &tm) == 0)
+			_clock[0] = '\0';
+	}
+
+	s += _clock;
+	s += '.';
+	append(s, (usec % 1000000) / 1000, 3);
+}
+//-----------------------------------------------------------------------------
+// Log::flush()
+//-----------------------------------------------------------------------------
+void Log::flush()
+{
+	const uint64_t d = dropped();
+
+	if (d != _reported)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		timestamp(_err, (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+		_err += " - Log ring full, dropped: ";
+		append(_err, d - _reported);
+		_err += '\n';
+		_reported = d;
+	}
+
+	write(*_os, _out);
+	write(*_es, _err);
+}
+//-----------------------------------------------------------------------------
+// Log::write()
+//-----------------------------------------------------------------------------
+void Log::write(std::ostream& os, std::string& s)
+{
+	if (s.empty()) return;
+
+	// whole lines in one go, then out of the buffer as std::endl does
+	os.write(s.data(), s.size());
+	os.flush();
+
+	// a full disk or a closed pipe, the next batch tries again
+	os.clear();
+	s.clear();
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const Log& l)
+	{
+		out << "Log verbosity: " << l.verbosity()
+			<< ", queued: " << l._ring.size() << "/" << l._ring.capacity()
+			<< ", dropped: " << l.dropped();
+		return out;
+	}
+}
@@ -0,0 +1,139 @@
+#ifndef _KLEIN_LOG_H_
+#define _KLEIN_LOG_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/Log.h#1 $
+//
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <unistd.h> // useconds_t
+#include <stdint.h>
+#include <time.h>
+
+#include "KleinSonar.h"
+#include "MpscQueue.h"
+
+namespace klein
+{
+
+// the per page log. the fetchers only stamp a fixed size record and
+// push it onto a lock-free ring, the log's own thread turns them into
+// lines and writes them out in batches, so a fetch never waits on the
+// terminal or the journal.
+//
+// page lines go to out, warnings to err, each in the format the
+// fetchers used to print. a batch is one write() to the stream and a
+// flush, as a line ending in std::endl is, so it goes out in order with
+// what the rest of the recorder prints and never in the middle of a
+// line. when the ring is full a record is dropped and counted, the
+// count is written out with the next batch.
+//
+// the verbosity can be changed while running, from any thread or a
+// signal handler. records below it aren't made at all.
+class Log
+{
+	public:
+
+		enum Verbosity { quiet, warnings, pages };
+
+		enum Event
+		{
+			page,		// fetched, pages
+			old,		// NGS_GETDATA_ERROR_OLD, warnings
+			skipped		// page info failed and skipped, warnings
+		};
+
+		// what a line is made from
+		struct Record
+		{
+			Record() {}
+			Record(const Event e, const uint32_t pt) :
+				usec(0), event(e), pageType(pt), ping(0), bytes(0),
+				version(0), sdfx(0), status(0), error(NGS_NO_ERROR) {}
+
+			int64_t usec;			// since the epoch, set by log()
+			Event event;
+			uint32_t pageType;
+			uint32_t ping;			// the header's, or asked for
+			uint32_t bytes;			// the header's numberBytes
+			uint32_t version;		// the header's pageVersion
+			uint32_t sdfx;			// the header's sdfExtensionSize
+			int32_t status;			// page status
+			DLLErrorCode error;
+		};
+
+		static Log& instance();
+
+		// the formatting thread, writing to the streams
+		void start(std::ostream& out = std::cout, std::ostream& err = std::cerr);
+
+		// writes out what is queued
+		void stop();
+
+		inline bool enabled(const Verbosity v) const
+		{
+			return v <= _verbosity.load(std::memory_order_relaxed);
+		}
+
+		inline Verbosity verbosity() const { return _verbosity.load(std::memory_order_relaxed); }
+		inline void verbosity(const Verbosity v) { _verbosity.store(v, std::memory_order_relaxed); }
+
+		// the next verbosity, after pages quiet, for a signal
+		inline void cycle()
+		{
+			_verbosity.store((Verbosity)((verbosity() + 1) % (pages + 1)),
+					std::memory_order_relaxed);
+		}
+
+		// stamps r and queues it, false if it was dropped
+		bool log(Record& r);
+
+		inline uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+	private:
+		Log();
+		~Log();
+
+		// no copy or operator = ctors
+		Log(const Log& rhs);
+		Log& operator = (const Log& rhs);
+
+		void run();
+
+		// formats r onto the end of its batch
+		void format(const Record& r);
+		void timestamp(std::string& s, const int64_t usec);
+		void flush();
+
+		static void write(std::ostream& os, std::string& s);
+
+		MpscQueue<Record> _ring;
+
+		std::atomic<Verbosity> _verbosity;
+		std::atomic<uint64_t> _dropped;
+		uint64_t _reported;
+
+		// formatting thread owned
+		std::string _out;
+		std::string _err;
+		time_t _second;			// of the cached time string
+		char _clock[32];
+
+		std::ostream* _os;
+		std::ostream* _es;
+
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		static const size_t ringSize;
+		static const size_t batchBytes;
+		static const useconds_t pollPeriod_usec;
+
+	friend std::ostream& operator << (std::ostream& out, const Log& l);
+};
+
+} // namespace klein
+#endif // _KLEIN_LOG_H_
@@ -0,0 +1,261 @@
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Metrics.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/Metrics.cpp#1 $";
+
+// the Trace keeps spans by stage
+static_assert(Metrics::stages <= Trace::maxStages, "more stages than the Trace has thresholds for");
+
+// the stage label of each Stage
+const char* const Metrics::stageNames[Metrics::stages] =
+{
+	"page_info", "page", "policy", "file_write", "write_for_real",
+	"file_close", "file_open", "flush", "reconnect", "publish", "proxy", "nap"
+};
+
+// how often the server looks for stop() while nobody connects
+const int Metrics::pollPeriod_msec = 250;
+
+//-----------------------------------------------------------------------------
+// Histogram CTOR
+//-----------------------------------------------------------------------------
+Metrics::Histogram::Histogram() : _sum(0)
+{
+	for (auto& c : _counts) c.store(0, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// Metrics::instance()
+//-----------------------------------------------------------------------------
+Metrics& Metrics::instance()
+{
+	static Metrics metrics;
+	return metrics;
+}
+//-----------------------------------------------------------------------------
+// Metrics CTOR
+//-----------------------------------------------------------------------------
+Metrics::Metrics() : _reconnects(0), _fd(-1), _running(false)
+{
+	for (int t = 0; t < PageTypes::count; t++)
+	{
+		_pages[t].store(0, std::memory_order_relaxed);
+		_bytes[t].store(0, std::memory_order_relaxed);
+		_emptyPolls[t].store(0, std::memory_order_relaxed);
+		_oldResets[t].store(0, std::memory_order_relaxed);
+	}
+}
+//-----------------------------------------------------------------------------
+// Metrics DTOR
+//-----------------------------------------------------------------------------
+Metrics::~Metrics()
+{
+	stop();
+}
+//-----------------------------------------------------------------------------
+// Metrics::start()
+//-----------------------------------------------------------------------------
+void Metrics::start(const std::string& path)
+{
+	if (_running) return;
+
+	struct sockaddr_un a;
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(a.sun_path))
+		throw std::runtime_error("Metrics socket path too long");
+
+	strcpy(a.sun_path, path.c_str());
+
+	// a socket left by the last run
+	(void) unlink(path.c_str());
+
+	_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (_fd < 0 || bind(_fd, (struct sockaddr*)&a, sizeof(a)) < 0 || listen(_fd, 4) < 0)
+	{
+		std::ostringstream os;
+		os << "Couldn't serve metrics: error = " << strerror(errno)
+			<< ", path = " << path;
+
+		if (_fd >= 0) close(_fd);
+		_fd = -1;
+		throw std::runtime_error(os.str());
+	}
+
+	_path = path;
+	_running = true;
+	_thread = std::thread(&Metrics::serve, this);
+}
+//-----------------------------------------------------------------------------
+// Metrics::stop()
+//-----------------------------------------------------------------------------
+void Metrics::stop()
+{
+	_running = false;
+
+	if (_thread.joinable())
+		_thread.join();
+
+	if (_fd >= 0)
+	{
+		close(_fd);
+		_fd = -1;
+		(void) unlink(_path.c_str());
+	}
+}
+//-----------------------------------------------------------------------------
+// Metrics::fetched()
+//-----------------------------------------------------------------------------
+void Metrics::fetched(const int pageType, const uint32_t bytes)
+{
+	const int t = slot(pageType);
+	if (t < 0) return;
+
+	_pages[t].fetch_add(1, std::memory_order_relaxed);
+	_bytes[t].fetch_add(bytes, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// Metrics::emptyPoll()
+//-----------------------------------------------------------------------------
+void Metrics::emptyPoll(const int pageType)
+{
+	const int t = slot(pageType);
+	if (t >= 0) _emptyPolls[t].fetch_add(1, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// Metrics::oldReset()
+//-----------------------------------------------------------------------------
+void Metrics::oldReset(const int pageType)
+{
+	const int t = slot(pageType);
+	if (t >= 0) _oldResets[t].fetch_add(1, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// Metrics::snapshot()
+//-----------------------------------------------------------------------------
+std::string Metrics::snapshot() const
+{
+	// the counts are read one at a time while they go up, a snapshot
+	// is only as consistent as that
+	std::ostringstream os;
+
+	os << "# HELP recorder_stage_seconds time spent in each stage of a pass\n"
+		<< "# TYPE recorder_stage_seconds histogram\n";
+
+	for (int s = 0; s < stages; s++)
+	{
+		const Histogram& h = _stages[s];
+		uint64_t n = 0;
+
+		for (int b = 0; b < Histogram::buckets; b++)
+		{
+			n += h._counts[b].load(std::memory_order_relaxed);
+
+			os << "recorder_stage_seconds_bucket{stage=\"" << stageNames[s] << "\",le=\"";
+			if (b < Histogram::buckets - 1) os << Histogram::bound(b) / 1e9;
+			else os << "+Inf";
+			os << "\"} " << n << "\n";
+		}
+
+		os << "recorder_stage_seconds_sum{stage=\"" << stageNames[s] << "\"} "
+			<< h._sum.load(std::memory_order_relaxed) / 1e9 << "\n"
+			<< "recorder_stage_seconds_count{stage=\"" << stageNames[s] << "\"} "
+			<< n << "\n";
+	}
+
+	struct Counter
+	{
+		const char* name;
+		const char* help;
+		const std::atomic<uint64_t>* values;
+	};
+
+	const Counter counters[] =
+	{
+		{ "recorder_pages_total", "pages fetched", _pages },
+		{ "recorder_page_bytes_total", "bytes of pages fetched", _bytes },
+		{ "recorder_empty_polls_total", "page requests with no page ready", _emptyPolls },
+		{ "recorder_old_resets_total", "NGS_GETDATA_ERROR_OLD, asking for the latest ping again", _oldResets }
+	};
+
+	for (const auto& c : counters)
+	{
+		os << "# HELP " << c.name << " " << c.help << "\n"
+			<< "# TYPE " << c.name << " counter\n";
+
+		for (int t = 0; t < PageTypes::count; t++)
+			os << c.name << "{version=\"" << PageTypes::info[t].version << "\"} "
+				<< c.values[t].load(std::memory_order_relaxed) << "\n";
+	}
+
+	os << "# HELP recorder_reconnects_total connections to the TPU reopened after an error\n"
+		<< "# TYPE recorder_reconnects_total counter\n"
+		<< "recorder_reconnects_total " << _reconnects.load(std::memory_order_relaxed) << "\n";
+
+	return os.str();
+}
+//-----------------------------------------------------------------------------
+// Metrics::serve()
+//-----------------------------------------------------------------------------
+void Metrics::serve()
+{
+	// one connection at a time, a snapshot each, then it is closed
+	while (_running)
+	{
+		struct pollfd p = { _fd, POLLIN, 0 };
+
+		if (poll(&p, 1, pollPeriod_msec) <= 0) continue;
+
+		const int c = accept4(_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (c < 0) continue;
+
+		const std::string s(snapshot());
+
+		for (size_t done = 0; done < s.size(); )
+		{
+			const ssize_t n = send(c, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0)
+			{
+				std::ostringstream os;
+				printTime(os);
+				os << " - Metrics send failed: " << strerror(errno);
+				std::cerr << os.str() << std::endl;
+				break;
+			}
+			done += n;
+		}
+
+		close(c);
+	}
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const Metrics& m)
+	{
+		out << "Metrics socket: " << (m._path.empty() ? "none" : m._path)
+			<< ", reconnects: " << m._reconnects.load(std::memory_order_relaxed);
+		return out;
+	}
+}
@@ -0,0 +1,176 @@
+#ifndef _KLEIN_METRICS_H_
+#define _KLEIN_METRICS_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/Metrics.h#1 $
+//
+
+#include <ostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+
+#include "PageTypes.h"
+#include "PingScheduler.h"
+#include "Trace.h"
+
+namespace klein
+{
+
+// where the time goes. each stage of a recorder pass keeps a histogram
+// of how long it took, and the fetchers count what they got. the hot
+// path only reads the monotonic clock and bumps relaxed atomics, no
+// locks, nothing allocated. every span also goes into the Trace ring.
+//
+// the stages nest, a Policy assembly includes the fileWrite()s of the
+// pings it completes, and those any fileWriteForReal() a full batch
+// makes.
+//
+// start() serves a snapshot on a unix domain socket, in the Prometheus
+// text format, to whoever connects, e.g.
+//
+//   socat - UNIX-CONNECT:/tmp/recorder.metrics
+class Metrics
+{
+	public:
+
+		enum Stage
+		{
+			pageInfo,		// DllGetTheTpuDataPageInfo2
+			page,			// DllGetTheTpuDataPage
+			policy,			// Policy::writePage
+			fileWrite,		// PageWriter::fileWrite of a page
+			writeForReal,	// PageWriter::fileWriteForReal
+			fileClose,		// closing the data file, rotation
+			fileOpen,		// opening the next, rotation
+			flush,			// PageWriter::flush
+			reopen,			// reopening a TPU connection after an error
+			publish,		// PingBus::publish
+			proxy,			// TpuProxy::cache
+			nap,			// Recorder::nap
+			stages
+		};
+
+		// log2 buckets of ns, the first is up to 1us and the last is
+		// anything over 2^(firstBucket + buckets - 2) ns, about 34s
+		class Histogram
+		{
+			public:
+				Histogram();
+
+				inline void record(const int64_t ns)
+				{
+					_counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+					_sum.fetch_add(ns, std::memory_order_relaxed);
+				}
+
+				// ns, the upper bound of bucket b
+				static inline int64_t bound(const int b) { return (int64_t)1 << (firstBucket + b); }
+
+				static const int firstBucket = 10;
+				static const int buckets = 27;
+
+			private:
+				static inline int bucket(const int64_t ns)
+				{
+					if (ns <= bound(0)) return 0;
+
+					const int b = 64 - __builtin_clzll(ns - 1) - firstBucket;
+					return (b < buckets) ? b : buckets - 1;
+				}
+
+				std::atomic<uint64_t> _counts[buckets];
+				std::atomic<uint64_t> _sum;		// ns
+
+			friend class Metrics;
+		};
+
+		// times its scope into a stage, and traces it with the ping and
+		// SDK page type it was for, if any
+		class Timer
+		{
+			public:
+				explicit Timer(const Stage s, const uint32_t ping = 0, const int pageType = 0) :
+					_stage(s), _ping(ping), _pageType(pageType),
+					_start(PingScheduler::now()) {}
+				~Timer()
+				{
+					const int64_t dur = PingScheduler::now() - _start;
+
+					instance()._stages[_stage].record(dur);
+					Trace::instance().span(_stage, _start, dur, _ping, _pageType);
+				}
+
+			private:
+				// no copy or operator = ctors
+				Timer(const Timer& rhs);
+				Timer& operator = (const Timer& rhs);
+
+				const Stage _stage;
+				const uint32_t _ping;
+				const int _pageType;
+				const int64_t _start;
+		};
+
+		static Metrics& instance();
+
+		// serve snapshots on the socket at path, replacing what is there.
+		// throws std::runtime_error if it can't.
+		void start(const std::string& path);
+		void stop();
+
+		// the fetchers' counts, by SDK page type
+		void fetched(const int pageType, const uint32_t bytes);
+		void emptyPoll(const int pageType);
+		void oldReset(const int pageType);
+
+		inline void reconnect() { _reconnects.fetch_add(1, std::memory_order_relaxed); }
+
+		// the Prometheus text
+		std::string snapshot() const;
+
+		// the stage label
+		static inline const char* stageName(const int s) { return stageNames[s]; }
+
+	private:
+		Metrics();
+		~Metrics();
+
+		// no copy or operator = ctors
+		Metrics(const Metrics& rhs);
+		Metrics& operator = (const Metrics& rhs);
+
+		void serve();
+
+		// PageTypes slot of an SDK page type, -1 for none
+		static inline int slot(const int pageType)
+		{
+			for (int t = 0; t < PageTypes::count; t++)
+				if (PageTypes::info[t].pageType == pageType) return t;
+			return -1;
+		}
+
+		Histogram _stages[stages];
+
+		// per PageTypes slot
+		std::atomic<uint64_t> _pages[PageTypes::count];
+		std::atomic<uint64_t> _bytes[PageTypes::count];
+		std::atomic<uint64_t> _emptyPolls[PageTypes::count];
+		std::atomic<uint64_t> _oldResets[PageTypes::count];
+
+		std::atomic<uint64_t> _reconnects;
+
+		std::string _path;
+		int _fd;
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		static const char* const stageNames[stages];
+		static const int pollPeriod_msec;
+
+	friend std::ostream& operator << (std::ostream& out, const Metrics& m);
+};
+
+} // namespace klein
+#endif // _KLEIN_METRICS_H_
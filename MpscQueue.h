@@ -0,0 +1,127 @@
+#ifndef _KLEIN_MPSC_QUEUE_H_
+#define _KLEIN_MPSC_QUEUE_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/MpscQueue.h#1 $
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+namespace klein
+{
+
+// bounded, lock-free, multi producer / single consumer ring
+//
+// any number of threads may push, exactly one thread may pop. each
+// cell carries a sequence number saying whose turn it is: a producer
+// claims a cell by moving the tail on with a CAS, fills it and then
+// publishes it by bumping its sequence, so a slow producer only holds
+// up the consumer at its own cell, never the other producers. T is
+// copied in and out, keep it small and trivially copyable.
+//
+// the capacity is rounded up to a power of two, the head and tail are
+// padded onto their own cache lines as in SpscQueue.
+template <typename T>
+class MpscQueue
+{
+	public:
+
+		explicit MpscQueue(const size_t n) :
+			_size(roundUp(n)), _mask(_size - 1), _ring(new Cell[_size]),
+			_head(0), _tail(0)
+		{
+			for (size_t i = 0; i < _size; i++)
+				_ring[i].seq.store(i, std::memory_order_relaxed);
+		}
+
+		// producer side, false if full
+		bool push(const T& t)
+		{
+			size_t tail = _tail.load(std::memory_order_relaxed);
+			Cell* c;
+
+			for (;;)
+			{
+				c = &_ring[tail & _mask];
+				const intptr_t d = (intptr_t)c->seq.load(std::memory_order_acquire)
+					- (intptr_t)tail;
+
+				if (d == 0)
+				{
+					if (_tail.compare_exchange_weak(tail, tail + 1,
+								std::memory_order_relaxed))
+						break;
+				}
+				// the consumer hasn't got to it yet
+				else if (d < 0) return false;
+				// another producer took it
+				else tail = _tail.load(std::memory_order_relaxed);
+			}
+
+			c->data = t;
+			c->seq.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer side, false if empty or the next cell isn't filled yet
+		bool pop(T& t)
+		{
+			const size_t head = _head.load(std::memory_order_relaxed);
+			Cell& c = _ring[head & _mask];
+
+			if (c.seq.load(std::memory_order_acquire) != head + 1) return false;
+
+			t = c.data;
+			c.seq.store(head + _size, std::memory_order_release);
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// approximate when called while the other side runs
+		inline size_t size() const
+		{
+			return _tail.load(std::memory_order_acquire)
+				- _head.load(std::memory_order_acquire);
+		}
+
+		inline size_t capacity() const { return _size; }
+
+	private:
+		// no copy or operator = ctors
+		MpscQueue(const MpscQueue& rhs);
+		MpscQueue& operator = (const MpscQueue& rhs);
+
+		static size_t roundUp(size_t n)
+		{
+			size_t p = 2;
+			while (p < n) p <<= 1;
+			return p;
+		}
+
+		static const size_t cacheLine = 64;
+
+		struct Cell
+		{
+			std::atomic<size_t> seq;
+			T data;
+		};
+
+		const size_t _size;
+		const size_t _mask;
+		std::unique_ptr<Cell[]> _ring;
+
+		// consumer owned
+		char _pad0[cacheLine];
+		std::atomic<size_t> _head;
+
+		// producers
+		char _pad1[cacheLine];
+		std::atomic<size_t> _tail;
+		char _pad2[cacheLine];
+};
+
+} // namespace klein
+#endif // _KLEIN_MPSC_QUEUE_H_
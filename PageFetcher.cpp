@@ -4,12 +4,13 @@
 
 #include "PageFetcher.h"
 #include "KleinSonar.h"
+#include "Log.h"
+#include "Metrics.h"
 
-// from main.cpp
+// from Util.cpp
 namespace klein
 {
 	extern void writePage(const uint8_t*, const size_t);
-	extern void printTime(std::ostream&);
 	extern std::ostream& printError(TPU_HANDLE tpu, std::ostream& os);
 }
 
@@ -21,12 +22,8 @@ const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/PageFetcher.cpp#1
 //-----------------------------------------------------------------------------
 PageFetcher::~PageFetcher()
 {
-	if (bufSize && buffer)
-	{
-		delete [] buffer;
-		bufSize = 0;
-	}
-	buffer = NULL;
+	// an unwritten page goes back to the pool
+	page.reset();
 }
 //-----------------------------------------------------------------------------
 // PageFetcher::fetchPage()
@@ -37,30 +34,32 @@ bool PageFetcher::fetchPage()
 
 	U32 pageStatus = NGS_FAILURE;
 
-	BoolStat tpuStatus = DllGetTheTpuDataPageInfo2(
-			recorder.tpuHandle(), pageType,
-			lastPingNum + 1, &pageStatus, &numBytes);
+	BoolStat tpuStatus;
+	{
+		Metrics::Timer t(Metrics::pageInfo, lastPingNum + 1, pageType);
+		tpuStatus = DllGetTheTpuDataPageInfo2(
+				tpuHandle(), pageType,
+				lastPingNum + 1, &pageStatus, &numBytes);
+	}
 
 	if (tpuStatus != NGS_SUCCESS)
 	{
-		std::ostringstream os;
-		os << "GetDataPageInfo2() failed" 
-			<< ", PT: " << pageType
-			<< ", Requested Ping: " << lastPingNum+1 << " ";
-		printError(recorder.tpuHandle(), os);
-		std::cerr << os.str() << std::endl;
-
-
 		// handle special case where tpu doesn't terminate SDFX properly
 		// don't want a reset, just skip this page
-		{
-			DLLErrorCode theCode = NGS_NO_ERROR;
-			(void) DllGetLastError(recorder.tpuHandle(), &theCode);
+		DLLErrorCode theCode = NGS_NO_ERROR;
+		(void) DllGetLastError(tpuHandle(), &theCode);
 
-			if (theCode != NGS_SDFX_RECORD_TYPE_UNKNOWN)
+		if (theCode == NGS_SDFX_RECORD_TYPE_UNKNOWN)
+		{
+			Log& log = Log::instance();
+			if (log.enabled(Log::warnings))
 			{
-				throw os.str().c_str();
+				Log::Record r(Log::skipped, pageType);
+				r.ping = lastPingNum + 1;
+				r.error = theCode;
+				log.log(r);
 			}
+
 			// the idea here is that this will fail until
 			// either the page is gone or it is fixed
 			// return false;
@@ -68,6 +67,14 @@ bool PageFetcher::fetchPage()
 			// lastPingNum++;
 			return false;
 		}
+
+		std::ostringstream os;
+		os << "GetDataPageInfo2() failed" 
+			<< ", PT: " << pageType
+			<< ", Requested Ping: " << lastPingNum+1 << " ";
+		printError(tpuHandle(), os);
+		std::cerr << os.str() << std::endl;
+		throw os.str().c_str();
 	}
 
 	switch(pageStatus)
@@ -76,20 +83,17 @@ bool PageFetcher::fetchPage()
 			{
 				if (numBytes == 0) return false;
 
-				// re-allocate buffer for page retrieval
-				if (numBytes > bufSize)
+				// get the region of the arena for this page type in the
+				// expected ping's slab, the page stays in it all the way
+				// to disk
+				page = recorder.pagePool().acquire(numBytes, pageType,
+						(lastPingNum < 0) ? -1 : lastPingNum + 1);
+
 				{
-					if (bufSize)
-					{
-						delete [] buffer;
-						bufSize = 0;
-					}
-					buffer = new U8[numBytes];
-					bufSize = numBytes;
+					Metrics::Timer t(Metrics::page, lastPingNum + 1, pageType);
+					tpuStatus = DllGetTheTpuDataPage(tpuHandle(), page->data, numBytes);
 				}
 
-				tpuStatus = DllGetTheTpuDataPage(recorder.tpuHandle(), buffer, numBytes);
-
 				// ocasssionally the above getTheTpuDataPage failes...
 				// it seems to expect 216 bytes in the SDFX but
 				// low and behold there are only 152 bytes, just enough
@@ -102,32 +106,34 @@ bool PageFetcher::fetchPage()
 						<< ", PT: " << pageType
 						<< ", Requested Ping: " << lastPingNum+1
 						<< ", Expect " << numBytes << " Bytes ";
-					printError(recorder.tpuHandle(), os);
+					printError(tpuHandle(), os);
 					std::cerr << os.str() << std::endl;
 					throw os.str().c_str();
 				}
 						
 				// cast to a page, really should peek at number of bytes which is first 32 bits
-				if (numBytes && numBytes <= bufSize)
+				if (numBytes && numBytes <= page->capacity)
 				{
-					const CKleinType3Header* headerInfo = reinterpret_cast<const CKleinType3Header*>(&buffer[0]);
-					::printTime(std::cout);
-
-					std::cout 
-						<< " - Ping : " << headerInfo->pingNumber
-						// << ", Error: 0x" << std::hex << std::setfill('0') << std::setw(8) << headerInfo.errorFlags
-						// << ", Pitch: " << std::dec << std::setfill(' ') << headerInfo.pitch
-						// << ", Roll: " << std::dec << std::setfill(' ') << headerInfo.roll
-						// << ", Altitude: " << std::dec << std::setfill(' ') << headerInfo.altitude
-						<< ", numberBytes: " << headerInfo->numberBytes
-						<< ", pageVersion: " << headerInfo->pageVersion
-						// << ", headerSize: " << headerInfo->headerSize
-						// << ", header3ExtensionSize: " << headerInfo->header3ExtensionSize
-						<< ", sdfExtensionSize: " << headerInfo->sdfExtensionSize
-						<< std::endl;
+					const CKleinType3Header* headerInfo = reinterpret_cast<const CKleinType3Header*>(page->data);
+
+					// the line is made on the log's thread
+					Log& log = Log::instance();
+					if (log.enabled(Log::pages))
+					{
+						Log::Record r(Log::page, pageType);
+						r.ping = headerInfo->pingNumber;
+						r.bytes = headerInfo->numberBytes;
+						r.version = headerInfo->pageVersion;
+						r.sdfx = headerInfo->sdfExtensionSize;
+						log.log(r);
+					}
+
+					Metrics::instance().fetched(pageType, headerInfo->numberBytes);
 
 					lastPingNum = headerInfo->pingNumber;
 
+					page->length = headerInfo->numberBytes;
+
 				}
 				else
 				{
@@ -139,11 +145,16 @@ bool PageFetcher::fetchPage()
 			break;
 		case NGS_GETDATA_ERROR_OLD: // -1
 			{
-				std::ostringstream os;
-				os << "Page Status (NGS_GETDATA_ERROR_OLD): " << ((int)pageStatus) 
-					<< ", PT: " << pageType
-					<< ", Requested Ping: " << lastPingNum+1;
-				std::cerr << os.str() << std::endl;
+				Metrics::instance().oldReset(pageType);
+
+				Log& log = Log::instance();
+				if (log.enabled(Log::warnings))
+				{
+					Log::Record r(Log::old, pageType);
+					r.ping = lastPingNum + 1;
+					r.status = (int)pageStatus;
+					log.log(r);
+				}
 
 				lastPingNum = -1;	//ask for the latest ping next
 			}
@@ -151,6 +162,7 @@ bool PageFetcher::fetchPage()
 		default:		// 0
 			{
 				// nothing to do - no pages yet available
+				Metrics::instance().emptyPoll(pageType);
 			}
 			break;
 		}
@@ -161,11 +173,21 @@ bool PageFetcher::fetchPage()
 //-----------------------------------------------------------------------------
 void PageFetcher::writePage()
 {
-	if (bufSize < 4) return;
+	PageRef p = takePage();
+
+	if (p) recorder.writePage(std::move(p));
+}
+//-----------------------------------------------------------------------------
+// PageFetcher::takePage()
+//-----------------------------------------------------------------------------
+PageRef PageFetcher::takePage()
+{
+	// hand over the last fetched page, if there is one to write
+	if (!page || page->length < 4) return PageRef();
 
 	if (lastPingNum > 0)
 	{
-		const CKleinType3Header* h= reinterpret_cast<const CKleinType3Header*>(&buffer[0]);
-		recorder.writePage(buffer, (const size_t)h->numberBytes);
+		return std::move(page);
 	}
+	return PageRef();
 }
@@ -7,6 +7,7 @@
 
 #include <ostream>
 
+#include "PagePool.h"
 #include "Recorder.h"
 
 namespace klein
@@ -16,8 +17,10 @@ class PageFetcher
 {
 public:
 
-	PageFetcher(Recorder& r, const int pt) :  
-		recorder(r), pageType(pt), lastPingNum(-1), buffer(NULL), bufSize(0) { }
+	// h, if given, is a connection owned by the caller, otherwise
+	// the recorder's connection is used
+	PageFetcher(Recorder& r, const int pt, TPU_HANDLE* h = NULL) :  
+		recorder(r), pageType(pt), tpu(h), lastPingNum(-1) { }
 
 	virtual ~PageFetcher();
 
@@ -25,14 +28,20 @@ public:
 
 	void writePage();
 
+	PageRef takePage();
+
 	inline void reset() { lastPingNum = -1; }
 
 private:
+	inline TPU_HANDLE tpuHandle() const { return tpu ? *tpu : recorder.tpuHandle(); }
+
 	Recorder& recorder;
 	int pageType;
+	TPU_HANDLE* tpu;
 	int lastPingNum;
-	unsigned char* buffer;
-	size_t bufSize;
+
+	// the last page fetched, filled in place by the TPU
+	PageRef page;
 
 	friend std::ostream& operator << (std::ostream& out, const PageFetcher& pf);
 
@@ -0,0 +1,285 @@
+#include <iostream>
+#include <cstring> // memset()
+
+#include "PagePool.h"
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/PagePool.cpp#1 $";
+
+const size_t PagePool::granularity = 4096;
+
+//-----------------------------------------------------------------------------
+// PageReturn
+//-----------------------------------------------------------------------------
+void PageReturn::operator () (Page* p) const
+{
+	if (p) p->pool->release(p);
+}
+//-----------------------------------------------------------------------------
+// PagePool CTOR
+//-----------------------------------------------------------------------------
+PagePool::PagePool(const size_t slabs) : _types(0), _generation(0)
+{
+	size_t n = 2;
+	while (n < slabs) n <<= 1;
+
+	// slabs are laid out when the first page of a type shows up
+	Slab empty;
+	memset(&empty, '\0', sizeof(empty));
+
+	_slabs.assign(n, empty);
+	_mask = n - 1;
+
+	memset(_typeIds, '\0', sizeof(_typeIds));
+	memset(_typeMax, '\0', sizeof(_typeMax));
+
+	memset(&_stats, '\0', sizeof(_stats));
+	_stats.slabs = n;
+}
+//-----------------------------------------------------------------------------
+// PagePool DTOR
+//-----------------------------------------------------------------------------
+PagePool::~PagePool()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// anything still out is a bug, it will come back to a dead pool
+	if (_stats.regionsBusy || _stats.heapBusy)
+	{
+		std::cerr << "PagePool destroyed with "
+			<< _stats.regionsBusy + _stats.heapBusy
+			<< " pages outstanding" << std::endl;
+	}
+
+	for (auto& s : _slabs)
+	{
+		delete [] s.base;
+		s.base = NULL;
+	}
+}
+//-----------------------------------------------------------------------------
+// PagePool::typeIndex()
+//-----------------------------------------------------------------------------
+int PagePool::typeIndex(const int pageType)
+{
+	if (pageType == untyped) return untyped;
+
+	for (int t = 0; t < _types; t++)
+		if (_typeIds[t] == pageType) return t;
+
+	// first time we've seen this type
+	if (_types == maxTypes) return untyped;
+
+	_typeIds[_types] = pageType;
+	return _types++;
+}
+//-----------------------------------------------------------------------------
+// PagePool::layout()
+//-----------------------------------------------------------------------------
+bool PagePool::layout(Slab& s)
+{
+	// (re)allocate a free slab as one block, a region per type sized
+	// from the largest page seen of that type
+
+	if (s.busy) return false;
+
+	size_t total = 0;
+	size_t offset[maxTypes];
+
+	for (int t = 0; t < _types; t++)
+	{
+		offset[t] = total;
+		total += ((_typeMax[t] + granularity - 1) / granularity) * granularity;
+	}
+
+	delete [] s.base;
+	s.base = new uint8_t[total];
+	s.bytes = total;
+	_generation++;
+
+	for (int t = 0; t < maxTypes; t++)
+	{
+		Page& r = s.region[t];
+		r.pool = this;
+		r.slab = &s - &_slabs[0];
+		r.type = t;
+		r.length = 0;
+
+		if (t < _types)
+		{
+			r.data = s.base + offset[t];
+			r.capacity = ((t + 1 < _types) ? offset[t + 1] : total) - offset[t];
+		}
+		else
+		{
+			r.data = NULL;
+			r.capacity = 0;
+		}
+	}
+
+	_stats.slabGrows++;
+
+	// recount the arena
+	_stats.arenaBytes = 0;
+	for (auto& x : _slabs)
+		for (int t = 0; t < maxTypes; t++)
+			_stats.arenaBytes += x.region[t].capacity;
+
+	return true;
+}
+//-----------------------------------------------------------------------------
+// PagePool::heap()
+//-----------------------------------------------------------------------------
+PageRef PagePool::heap(const size_t n, const int t)
+{
+	Page* p = new Page;
+	p->data = new uint8_t[n];
+	p->capacity = n;
+	p->length = 0;
+	p->pool = this;
+	p->slab = -1;
+	p->type = t;
+
+	if (t != untyped) _stats.overflows++;
+
+	if (++_stats.heapBusy > _stats.heapBusyMax)
+		_stats.heapBusyMax = _stats.heapBusy;
+
+	return PageRef(p);
+}
+//-----------------------------------------------------------------------------
+// PagePool::acquire()
+//-----------------------------------------------------------------------------
+PageRef PagePool::acquire(const size_t n, const int pageType, const int64_t ping)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	const int t = typeIndex(pageType);
+
+	if (t == untyped) return heap(n, t);
+
+	// the high water mark for this type, the next layout will fit it
+	if (n > _typeMax[t]) _typeMax[t] = n;
+
+	// the ping's own slab first, then any other with room
+	const size_t first = (ping < 0) ? 0 : (ping & _mask);
+
+	for (size_t i = 0; i < _slabs.size(); i++)
+	{
+		Slab& s = _slabs[(first + i) & _mask];
+		Page& r = s.region[t];
+
+		if (s.out[t]) continue;
+
+		// grow it if nothing in it is out
+		if (r.capacity < n && !layout(s)) continue;
+
+		if (i && ping >= 0) _stats.misses++;
+
+		s.out[t] = true;
+		s.busy++;
+
+		if (++_stats.regionsBusy > _stats.regionsBusyMax)
+			_stats.regionsBusyMax = _stats.regionsBusy;
+
+		r.length = 0;
+		return PageRef(&r);
+	}
+
+	// every region busy, or too small and in use
+	return heap(n, t);
+}
+//-----------------------------------------------------------------------------
+// PagePool::release()
+//-----------------------------------------------------------------------------
+void PagePool::release(Page* p)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (p->slab < 0)
+	{
+		delete [] p->data;
+		delete p;
+		_stats.heapBusy--;
+		return;
+	}
+
+	// free the region, the slab can be laid out again once all of its
+	// regions are back
+	Slab& s = _slabs[p->slab];
+	p->length = 0;
+	s.out[p->type] = false;
+	s.busy--;
+	_stats.regionsBusy--;
+}
+//-----------------------------------------------------------------------------
+// PagePool::outstanding()
+//-----------------------------------------------------------------------------
+size_t PagePool::outstanding() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats.regionsBusy + _stats.heapBusy;
+}
+//-----------------------------------------------------------------------------
+// PagePool::stats()
+//-----------------------------------------------------------------------------
+PagePool::Stats PagePool::stats() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats;
+}
+//-----------------------------------------------------------------------------
+// PagePool::highWater()
+//-----------------------------------------------------------------------------
+std::vector<size_t> PagePool::highWater() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return std::vector<size_t>(_typeMax, _typeMax + _types);
+}
+//-----------------------------------------------------------------------------
+// PagePool::arenas()
+//-----------------------------------------------------------------------------
+uint64_t PagePool::arenas(std::vector<std::pair<uint8_t*, size_t> >& v) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	v.clear();
+	for (auto& s : _slabs)
+		if (s.base) v.push_back(std::make_pair(s.base, s.bytes));
+
+	return _generation;
+}
+//-----------------------------------------------------------------------------
+// PagePool::generation()
+//-----------------------------------------------------------------------------
+uint64_t PagePool::generation() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _generation;
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const PagePool& p)
+	{
+		std::lock_guard<std::mutex> lock(p._mutex);
+
+		const PagePool::Stats& s = p._stats;
+
+		out << "PagePool slabs: " << s.slabs
+			<< ", arena bytes: " << s.arenaBytes
+			<< ", busy: " << s.regionsBusy << " (max " << s.regionsBusyMax << ")"
+			<< ", heap: " << s.heapBusy << " (max " << s.heapBusyMax << ")"
+			<< ", slab grows: " << s.slabGrows
+			<< ", overflows: " << s.overflows
+			<< ", misses: " << s.misses
+			<< ", largest page";
+
+		for (int t = 0; t < p._types; t++)
+			out << " PT " << p._typeIds[t] << ": " << p._typeMax[t];
+
+		return out;
+	}
+}
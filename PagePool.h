@@ -0,0 +1,142 @@
+#ifndef _KLEIN_PAGE_POOL_H_
+#define _KLEIN_PAGE_POOL_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/PagePool.h#1 $
+//
+
+#include <ostream>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+namespace klein
+{
+
+class PagePool;
+
+// a page buffer from the pool. the TPU fills data directly, and the
+// buffer is then passed along by ownership until it has been written.
+struct Page
+{
+	uint8_t* data;
+	size_t capacity;
+	size_t length;		// bytes in use
+	PagePool* pool;
+	int slab;			// arena slab, or -1 if from the heap
+	int type;			// arena page type index
+};
+
+// returns the page to its pool instead of deleting it
+struct PageReturn
+{
+	void operator () (Page* p) const;
+};
+
+// the only handle to a Page, move only
+typedef std::unique_ptr<Page, PageReturn> PageRef;
+
+// a ping slab arena for page buffers.
+//
+// there is one slab per Policy ping slot, picked the same way, by ping
+// number modulo the slab count. a slab is one contiguous allocation
+// holding a region for each page type, each region sized from the
+// largest page of that type seen so far. a region is busy from the
+// fetch until the page has been written, then it is free again, so in
+// steady state fetching a page never touches the heap.
+//
+// a slab is only reallocated when a bigger page shows up and none of
+// its regions are busy. a page that doesn't fit anywhere, or arrives
+// before its type has been sized, comes from the heap and is counted
+// as an overflow. the high water marks say how to size things so that
+// never happens.
+//
+// acquire() and release are thread safe, pages are taken by the fetch
+// threads and given back by the io thread once written.
+class PagePool
+{
+	public:
+
+		// a page type not in the arena, e.g. a rebuilt page
+		static const int untyped = -1;
+
+		struct Stats
+		{
+			size_t slabs;
+			size_t arenaBytes;
+			size_t regionsBusy;		// now
+			size_t regionsBusyMax;	// high water
+			size_t heapBusy;		// now
+			size_t heapBusyMax;		// high water
+			uint64_t slabGrows;		// slab (re)allocations
+			uint64_t overflows;		// typed pages that went to the heap
+			uint64_t misses;		// typed pages not in their ping's slab
+		};
+
+		explicit PagePool(const size_t slabs);
+		~PagePool();
+
+		// a page with room for at least n bytes, length 0. the TPU page
+		// type and the ping expected pick the region, ping < 0 if unknown
+		PageRef acquire(const size_t n, const int pageType = untyped,
+				const int64_t ping = -1);
+
+		size_t outstanding() const;
+		Stats stats() const;
+
+		// largest page seen of each arena type, 0 if unused
+		std::vector<size_t> highWater() const;
+
+		// the slabs laid out now, for registering with the kernel, and
+		// the layout generation they belong to. the generation changes
+		// whenever a slab is (re)allocated.
+		uint64_t arenas(std::vector<std::pair<uint8_t*, size_t> >& v) const;
+		uint64_t generation() const;
+
+	private:
+		// no copy or operator = ctors
+		PagePool(const PagePool& rhs);
+		PagePool& operator = (const PagePool& rhs);
+
+		static const int maxTypes = 8;
+
+		struct Slab
+		{
+			uint8_t* base;
+			size_t bytes;				// allocated at base
+			size_t busy;				// regions out
+			bool out[maxTypes];			// region[t] is out
+			Page region[maxTypes];		// region[t].capacity 0 if none
+		};
+
+		int typeIndex(const int pageType);
+		bool layout(Slab& s);
+		PageRef heap(const size_t n, const int t);
+		void release(Page* p);
+
+		mutable std::mutex _mutex;
+
+		std::vector<Slab> _slabs;
+		size_t _mask;
+
+		// arena page types, and the largest page seen of each
+		int _typeIds[maxTypes];
+		size_t _typeMax[maxTypes];
+		int _types;
+
+		Stats _stats;
+		uint64_t _generation;
+
+		// regions are sized in multiples of this
+		static const size_t granularity;
+
+	friend struct PageReturn;
+	friend std::ostream& operator << (std::ostream& out, const PagePool& p);
+};
+
+} // namespace klein
+#endif // _KLEIN_PAGE_POOL_H_
@@ -0,0 +1,113 @@
+#ifndef _KLEIN_PAGE_TYPES_H_
+#define _KLEIN_PAGE_TYPES_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/PageTypes.h#1 $
+//
+
+#include <stdint.h>
+
+#include "KleinSonar.h"
+#include "KleinSonarPrivate.h" // SYS_CAP_BATHY
+
+namespace klein
+{
+
+// a TPU page type the recorder fetches and writes.
+//
+//   PT       - the TPU data page type asked for with DllGetTheTpuDataPage
+//   Version  - pageVersion in the page header
+//   Mask     - its bit in the Policy ping mask, the low 3 bits come
+//              straight from the TPU framing mode
+//   Sdfx     - the bathy sdfx goes on the first page of this type in a file
+//   Caps     - 0 if the framing mode turns it on with its Mask bit, else
+//              the ping capabilityMask bits that do
+//   Needs    - and the framing mode bits it needs as well
+template <int PT, uint32_t Version, uint32_t Mask, bool Sdfx,
+	uint32_t Caps = 0, uint32_t Needs = 0>
+struct PageType
+{
+	static const int pageType = PT;
+	static const uint32_t version = Version;
+	static const uint32_t mask = Mask;
+	static const bool sdfx = Sdfx;
+	static const uint32_t caps = Caps;
+	static const uint32_t needs = Needs;
+};
+
+struct LowFrequency : PageType<NGS_PAGE_TYPE_3500_UUV_LF, 3501, 0x01, false> {};
+struct HighFrequency : PageType<NGS_PAGE_TYPE_3500_UUV_HF, 3502, 0x02, false> {};
+struct RawBathy : PageType<NGS_PAGE_TYPE_3500_UUV_BATHY_PC, 3503, 0x04, true> {};
+// NGS_PAGE_TYPE_3500_UUV_BATHY isn't 24 in every SDK. made from the
+// 3503, so only asked for along with it.
+struct ProcessedBathy : PageType<24, 3511, 0x08, true, SYS_CAP_BATHY, RawBathy::mask> {};
+
+// the same, at run time
+struct PageTypeInfo
+{
+	int pageType;
+	uint32_t version;
+	uint32_t mask;
+	bool sdfx;
+	uint32_t caps;
+	uint32_t needs;
+};
+
+// a list of page types. a type's position in the list is its slot, in
+// a Ping and anywhere else that keeps something per page type, and the
+// list order is the order pages are fetched and a ping's pages are
+// written in.
+template <typename... Ts>
+struct PageTypeList
+{
+	static const int count = sizeof...(Ts);
+
+	static const PageTypeInfo info[count];
+
+	// the slot of a page version, -1 if it isn't in the list. unrolled
+	// at compile time into a compare per type.
+	static inline int slot(const uint32_t version)
+	{
+		return find<0, Ts...>(version);
+	}
+
+	// the Policy mask of the pages a ping should have, given the TPU
+	// framing mode and the capabilityMask of its page header
+	static inline uint32_t wanted(const uint32_t framingMode, const uint32_t capabilityMask)
+	{
+		uint32_t m = 0;
+		for (int t = 0; t < count; t++)
+		{
+			const PageTypeInfo& i = info[t];
+
+			if (!i.caps ? (framingMode & i.mask)
+				: ((capabilityMask & i.caps) && (framingMode & i.needs) == i.needs))
+				m |= i.mask;
+		}
+		return m;
+	}
+
+	private:
+
+		template <int I>
+		static inline int find(const uint32_t)
+		{
+			return -1;
+		}
+		template <int I, typename T, typename... Rest>
+		static inline int find(const uint32_t version)
+		{
+			return (version == T::version) ? I : find<I + 1, Rest...>(version);
+		}
+};
+
+template <typename... Ts>
+const PageTypeInfo PageTypeList<Ts...>::info[PageTypeList<Ts...>::count] =
+	{ { Ts::pageType, Ts::version, Ts::mask, Ts::sdfx, Ts::caps, Ts::needs }... };
+
+// what the recorder handles, in write order: LF, raw bathy, processed
+// bathy, HF. a new page type only needs a line above and a place here.
+typedef PageTypeList<LowFrequency, RawBathy, ProcessedBathy, HighFrequency> PageTypes;
+
+} // namespace klein
+#endif // _KLEIN_PAGE_TYPES_H_
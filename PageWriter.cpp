@@ -1,7 +1,9 @@
 #include <sys/statfs.h>
 #include <sys/types.h>		// umask()
 #include <sys/stat.h>		// umask()
-#include <unistd.h>		// sync()
+#include <fcntl.h>		// open()
+#include <unistd.h>		// rmdir()
+#include <limits.h>		// IOV_MAX
 
 #ifdef S3KCONF_UUV_BATHY
 #undef S3KCONF_UUV_BATHY
@@ -9,11 +11,13 @@
 
 #include <iostream> // std::cout
 #include <sstream>
+#include <stdexcept>
 #include <iomanip>
 #include <error.h>
 #include <cstring> // memset()
 #include "PageWriter.h"
 #include "Recorder.h"
+#include "Metrics.h"
 #include "KleinSonarPrivate.h"
 
 namespace klein
@@ -21,7 +25,7 @@ namespace klein
 	extern void writePage(const uint8_t*, const size_t);
 	extern void printTime(std::ostream&);
 	extern std::ostream& printError(TPU_HANDLE tpu, std::ostream& os);
-	extern bool shutdown;
+	extern std::atomic<bool> shutdown;
 	extern bool operator == (const DiskRecordingSettings& lhs, const DiskRecordingSettings& rhs);
 }
 
@@ -33,12 +37,24 @@ const int PageWriter::cacheSize = 10*1e6;
 const char* const _id =
 		"$Id: //TPU-4XXX-Stream/2.13/Recorder/PageWriter.cpp#3 $";
 
+// the ping and SDK page type a page is traced with, 0 for a page that
+// doesn't start with the header of a type we know, e.g. a bathy sdfx
+static void traceTags(const Page& p, uint32_t& ping, int& pageType)
+{
+	const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(p.data);
+	const int t = (p.length >= sizeof(*h)) ? PageTypes::slot(h->pageVersion) : -1;
+
+	ping = (t < 0) ? 0 : h->pingNumber;
+	pageType = (t < 0) ? 0 : PageTypes::info[t].pageType;
+}
+
 //-------------------------------------------------------------------------------------
 // PageWriter CTOR
 //-------------------------------------------------------------------------------------
 PageWriter::PageWriter(Recorder& r) :
-		recorder(r), _fp(NULL), _cacheBytes(0), _cache(NULL), _cachePtr(NULL), _fileSize(
-				0), _numPings(0)
+		recorder(r), _fd(-1), _batch(NULL), _batchLimit(0), _fileSize(0),
+		_numPings(0), _pingBytes(0), _indexFd(-1), _spare(r.config().index),
+		_framingMode(0)
 {
 	// C++ 11 _filename = {};
 	_filename[0] = '\0';
@@ -56,9 +72,20 @@ PageWriter::PageWriter(Recorder& r) :
 	// Set file permissions so that any user can read/modify/delete the output files
 	umask(~(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
 
-	// allocate the cache, if using
-	if (cacheSize > 0)
-		_cache = new uint8_t[cacheSize];
+	// at least two swap batches so one fills while the io thread writes
+	// the others, each holds up to its share of the cache
+	{
+		const size_t n = (r.config().cacheBuffers < 2) ? 2 : r.config().cacheBuffers;
+		_io.reset(new IoThread(n, r.config().durability, r.config().io, &r.pagePool()));
+
+		std::ostringstream os;
+		printTime(os);
+		os << " - Writing with ";
+		_io->backend().describe(os);
+		std::cout << os.str() << std::endl;
+		_batch = _io->batch();
+		_batchLimit = cacheSize / n;
+	}
 
 	// send the status, get the settings
 	// but we need the settings to get the status
@@ -82,8 +109,35 @@ PageWriter::PageWriter(Recorder& r) :
 		std::cout << _settings << std::endl;
 	}
 
+	// the Policy reads the framing mode from here for every new ping
+	r.tpuSettings().refresh(r.tpuHandle(), true);
+	_framingMode = getFramingMode();
+
 	// construct the policy
-	_policy.reset(new Policy(this));
+	_policy.reset(new Policy(this, r.config().pingQueueSize));
+
+	// the recording matters more, carry on without it
+	if (!r.config().bus.name.empty())
+	{
+		const BusConfig& b = r.config().bus;
+
+		try
+		{
+			_bus.reset(new PingBus(b.name, b.slots, b.slotBytes));
+
+			std::ostringstream os;
+			printTime(os);
+			os << " - " << *_bus;
+			std::cout << os.str() << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::ostringstream os;
+			printTime(os);
+			os << " - " << e.what();
+			std::cerr << os.str() << std::endl;
+		}
+	}
 
 }
 //-------------------------------------------------------------------------------------
@@ -92,14 +146,10 @@ PageWriter::PageWriter(Recorder& r) :
 PageWriter::~PageWriter()
 {
 	closeDataFile();
-	if (cacheSize > 0)
-	{
-		if (_cache)
-		{
-			delete [] _cache;
-			_cache = NULL;
-		}
-	}
+
+	// the io thread finishes its queue, the pages go back to the pool
+	_io.reset();
+	_batch = NULL;
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::getDiskUsedPercent()
@@ -122,19 +172,7 @@ float PageWriter::getDiskUsedPercent(void)
 	const float usagePercent = 100.0f - (usage * 100.0f);
 
 	// return 99% if over 19/20ths used or % used
-	return (usagePercent > .95f) ? 99.0f : usagePercent;
-}
-//-------------------------------------------------------------------------------------
-// PageWriter::getFramingMode()
-//-------------------------------------------------------------------------------------
-uint32_t PageWriter::getFramingMode(void)
-{
-	U32 mode = 0;
-	const BoolStat theStatus = DllGetTheTpuFramingMode(recorder.tpuHandle(), &mode);
-	if (theStatus != NGS_SUCCESS)
-		throw "GetTheTpuFramingMode() failed";
-
-	return mode;
+	return (usagePercent > 95.0f) ? 99.0f : usagePercent;
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::openNewDataFile()
@@ -146,9 +184,11 @@ void PageWriter::openNewDataFile(const CKleinType3Header* h, const U32 ff)
 	// of the ping specified by pHeader.
 
 	// Close the old file if it is open
-	if (_fp)
+	if (_fd >= 0)
 		closeDataFile();
 
+	Metrics::Timer t(Metrics::fileOpen, h ? h->pingNumber : 0);
+
 	if (!h)
 		throw "No page header";
 
@@ -168,7 +208,15 @@ void PageWriter::openNewDataFile(const CKleinType3Header* h, const U32 ff)
 
 	sprintf(_filename, "%s/%s", _settings.szFilePath, _status.szFileName);
 
-	if ((_fp = fopen(_filename, "wb")) == NULL)
+	// the next file will likely be the size of the last, a bit over to
+	// save growing it
+	_io->sizeHint((size_t)_settings.nPingsPerFile * _pingBytes * 11 / 10);
+
+	// usually the spare made after the last rotation, it is only
+	// opened here if there isn't one. read as well, the mmap backend
+	// maps it.
+	if ((_fd = _spare.take(_settings.szFilePath, _filename, &_indexFd)) < 0
+		&& (_fd = open(_filename, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666)) < 0)
 	{
 		std::ostringstream os;
 		os << "Couldn't open file: error = " << strerror(errno)
@@ -178,6 +226,33 @@ void PageWriter::openNewDataFile(const CKleinType3Header* h, const U32 ff)
 
 	_numPings = 0;
 	_fileSize = 0;
+
+	if (recorder.config().index)
+	{
+		const std::string index(std::string(_filename) + sdfIndexSuffix);
+
+		if (_indexFd < 0)
+			_indexFd = open(index.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+
+		if (_indexFd < 0)
+		{
+			// the data matters more, record without it
+			std::ostringstream os;
+			printTime(os);
+			os << " - Couldn't open index: error = " << strerror(errno)
+				<< ", fileName = " << index;
+			std::cerr << os.str() << std::endl;
+		}
+		else
+		{
+			SdfIndexHeader ih;
+			ih.init();
+			_batch->addIndex(&ih, sizeof(ih));
+		}
+	}
+
+	// and the one after
+	_spare.prepare(_settings.szFilePath);
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::openDataFile()
@@ -197,18 +272,25 @@ void PageWriter::openDataFile(void)
 	}
 
 	// already open?
-	if (_fp) return;
+	if (_fd >= 0) return;
 
 	// no filename?
 	if (!_filename[0]) return;
 
-	if ((_fp = fopen(_filename, "ab")) == NULL)
+	if ((_fd = open(_filename, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0)
 	{
 		std::ostringstream os;
 		os << "Error = " << strerror(errno) << "  Couldn't open file "
 				<< _filename;
 		throw os.str().c_str();
 	}
+
+	// carry on with its index, if it had one
+	if (recorder.config().index)
+	{
+		const std::string index(std::string(_filename) + sdfIndexSuffix);
+		_indexFd = open(index.c_str(), O_WRONLY | O_APPEND);
+	}
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::closeDataFile()
@@ -216,16 +298,39 @@ void PageWriter::openDataFile(void)
 void PageWriter::closeDataFile(void)
 {
 	// Close current data file
-	if (_fp)
+	if (_fd >= 0)
 	{
+		Metrics::Timer t(Metrics::fileClose);
+
 		// flush out any unwritten pings.
 		fileWriteForReal();
 
-		fclose(_fp);
-		_fp = NULL;
+		if (_numPings) _pingBytes = _fileSize / _numPings;
+
+		// sync and close off the io thread, after the writes above
+		_io->close(_fd);
+		_fd = -1;
+
+		if (_indexFd >= 0)
+		{
+			_io->close(_indexFd);
+			_indexFd = -1;
+		}
 
-		// Syncs the file system 
-		sync();
+		std::ostringstream os;
+		printTime(os);
+		os << " - " << _io->stats() << std::endl;
+		printTime(os);
+		os << " - " << _spare.stats() << std::endl;
+		printTime(os);
+		os << " - " << recorder.pagePool();
+		if (_bus)
+		{
+			os << std::endl;
+			printTime(os);
+			os << " - " << *_bus;
+		}
+		std::cout << os.str() << std::endl;
 	}
 }
 //-------------------------------------------------------------------------------------
@@ -274,6 +379,9 @@ void PageWriter::update()
 	}
 	else
 	{
+		// the bathy sdfx may have changed with them
+		_bathySdfx.clear();
+
 		std::ostringstream os;
 		os << "Settings changed: " << t;
 		printTime(std::cout);
@@ -291,12 +399,14 @@ void PageWriter::update()
 	//
 	// framing mode changed?
 	{
-		static U32 fm = getFramingMode();
-		U32 m = getFramingMode();
-		if (m != fm)
+		// the settings changed, don't wait for the next scheduled look
+		recorder.tpuSettings().refresh(recorder.tpuHandle(), true);
+
+		const U32 m = getFramingMode();
+		if (m != _framingMode)
 		{
 			// keep this mode for reference
-			fm = m;
+			_framingMode = m;
 			// force new file
 			t.nNewFile = 1;
 		}
@@ -333,7 +443,8 @@ void PageWriter::update()
 			memset(_filename, '\0', sizeof(_filename));
 			break;
 		case 3:
-			// delete empty dir
+			// delete empty dir, the spare would keep it from being
+			_spare.release();
 			rmdir(t.szFilePath);
 			break;
 	}
@@ -346,22 +457,26 @@ void PageWriter::update()
 //-------------------------------------------------------------------------------------
 void PageWriter::flush()
 {
-	// note - only clears userspace in 'C' lib - not kernel buffs, would need to 
-	// sync metadata for file and directory, which blocks.
+	Metrics::Timer t(Metrics::flush);
 
-	if (!(_numPings % 100) && _numPings != 0)
-	{
-		closeDataFile();
-		openDataFile();
-	}
+	// the file stays open, the io thread syncs it as the durability
+	// setting says
+
+	// pings that have waited too long for a missing page go out now
+	_policy->expire(PingScheduler::now());
+
+	// hand this pass's pings to the io thread now, their arena regions
+	// are only free again once they are on disk
+	fileWriteForReal();
 }
 
 //-------------------------------------------------------------------------------------
 // PageWriter::writePage()
 //-------------------------------------------------------------------------------------
-void PageWriter::writePage(const uint8_t* p, const size_t n)
+void PageWriter::writePage(PageRef&& page)
 {
 	// write page to file
+	if (!page) return;
 	
 	// handle file related path actions
 	switch(_settings.nPathAction)
@@ -401,13 +516,18 @@ void PageWriter::writePage(const uint8_t* p, const size_t n)
 	else
 	{
 		// open a new file based on page header info
-		const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(p);
+		const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(page->data);
 
 		openNewDataFile(h);
 	}
 
 	// finally write page
-	_policy->writePage(p, n);
+	uint32_t ping;
+	int pageType;
+	traceTags(*page, ping, pageType);
+
+	Metrics::Timer t(Metrics::policy, ping, pageType);
+	_policy->writePage(std::move(page));
 
 }
 //-------------------------------------------------------------------------------------
@@ -415,161 +535,104 @@ void PageWriter::writePage(const uint8_t* p, const size_t n)
 //-------------------------------------------------------------------------------------
 void PageWriter::fileWrite(const uint8_t* p, const size_t n)
 {
-	// This method doesn't actually write to file.  It caches for write later
-	if (_cacheBytes + n < cacheSize)
-	{
-		// make sure cachePtr is where it ought to be
-		_cachePtr = _cache + _cacheBytes;
+	// This method doesn't actually write to file.  It queues for write later,
+	// so p must stay put until then - it is only used for the page marker
+	_batch->add(p, n);
 
-		memcpy(_cachePtr, p, n);
+	if (_batch->bytes >= _batchLimit || _batch->iov.size() >= IOV_MAX)
+		fileWriteForReal();
+}
+void PageWriter::fileWrite(PageRef&& page)
+{
+	if (!page) return;
 
-		// advance
-		_cachePtr += n;
-		_cacheBytes += n;
-	}
-	else
-	{
-		{
-		std::ostringstream os;
-		os << "Cache buffer size exceeded.  Data lost. cacheBytes: "
-				<< _cacheBytes << ", n: " << n;
+	uint32_t ping;
+	int pageType;
+	traceTags(*page, ping, pageType);
 
-		}
+	Metrics::Timer t(Metrics::fileWrite, ping, pageType);
+
+	// the batch takes the page, nothing is copied
+	_batch->add(std::move(page));
+
+	if (_batch->bytes >= _batchLimit || _batch->iov.size() >= IOV_MAX)
 		fileWriteForReal();
-		
-		// try again
-		fileWrite(p, n);
-	}
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::fileWriteForReal()
 //-------------------------------------------------------------------------------------
 void PageWriter::fileWriteForReal()
 {
-	if (_cacheBytes)
+	// hand the batch to the io thread and carry on with the next,
+	// only blocks if every batch is still waiting for the disk
+	if (_batch->empty()) return;
+
+	if (_fd < 0)
 	{
-		fwrite(_cache, 1, _cacheBytes, _fp);
+		// no file to write to (disk full), nothing to do but drop it
+		std::ostringstream os;
+		printTime(os);
+		os << " - No data file, " << _batch->bytes << " bytes dropped";
+		std::cerr << os.str() << std::endl;
 
-		_fileSize += _cacheBytes;
-		_cachePtr = _cache;
-		_cacheBytes = 0;
-		fflush(_fp);
+		_batch->clear();
+		return;
 	}
+
+	Metrics::Timer t(Metrics::writeForReal);
+
+	_fileSize += _batch->bytes;
+	_batch = _io->submit(_fd, _indexFd);
 }
 //-------------------------------------------------------------------------------------
-// PageWriter::addBathySdfx()
+// PageWriter::addSdfxRecord()
 //-------------------------------------------------------------------------------------
-void PageWriter::addBathySdfx(klein::UcBuffer& p)
+void PageWriter::addSdfxRecord(std::vector<uint8_t>& sdfx, const U32 id, const char* name)
 {
-	// put the bathy sdfx onto the page in p, do this by
-	//   - taking off the SDFX END
-	//   - adding the BATHY SDFX
-	//   - add the SDFX END back
-	//   - fix the sizes
-
-	// Danger - as we are modifying p, the header* could become invalid
-	// note lack of const
-	CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(p.data());
-
+	// append an sdfx record from the TPU to sdfx
+	U32 n = 0;
+	if (NGS_SUCCESS != DllGetTheSdfxRecordSize(recorder.tpuHandle(), id, &n))
 	{
-		std::ostringstream os;
-		os << "Before: " << h->pingNumber << ", " << h->numberBytes << " " << h->sdfExtensionSize;
-		std::cout << os.str() << std::endl;
+		std::ostringstream os; printTime(os); 
+		os << " - Could not GetTheSdfxRecordSize(" << name << ") - "; 
+		printError(recorder.tpuHandle(), os);
+		throw std::runtime_error(os.str());
 	}
 
-	// reservera buffer for the bathy sdfx and the end record
-	klein::UcBuffer bsdfx;
+	// read it straight onto the end
+	const size_t at = sdfx.size();
+	sdfx.resize(at + n);
 
-	// SP does, cal, eng then proc
-	
-	// bathy cal sdfx
+	if (NGS_SUCCESS != DllGetTheSdfxRecord(recorder.tpuHandle(), id, &sdfx[at], n))
 	{
-		U32 n = 0;
-		if (NGS_SUCCESS != DllGetTheSdfxRecordSize(recorder.tpuHandle(), 
-					SDFX_RECORD_ID_BATHY_CAL_1, &n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecordSize(BATHY_CAL) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
-
-		// allocate space for it
-		unsigned char b[n];
-
-		if (NGS_SUCCESS != DllGetTheSdfxRecord(recorder.tpuHandle(), 
-			SDFX_RECORD_ID_BATHY_CAL_1, b, n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecord(BATHY_CAL) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
-
-		// the size returned by the getSdfxRecordSize is not the size of the
-		// structure, basically a rounded up block size 
-		const SDFX_RECORD_HEADER* r = reinterpret_cast<const SDFX_RECORD_HEADER*>(b);
-		klein::UcBuffer b2(b, r->recordNumBytes);
-		bsdfx += b2;
-	}
-
-	// bathy eng sdfx
-	{
-		U32 n = 0;
-		if (NGS_SUCCESS != DllGetTheSdfxRecordSize(recorder.tpuHandle(), 
-					SDFX_RECORD_ID_BATHY_ENG_SETTINGS_1, &n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecordSize(BATHY_ENG_SETTINGS) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
-
-		// allocate space for it
-		unsigned char b[n];
-
-		if (NGS_SUCCESS != DllGetTheSdfxRecord(recorder.tpuHandle(), 
-			SDFX_RECORD_ID_BATHY_ENG_SETTINGS_1, b, n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecord(BATHY_ENG_SETTINGS) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
-
-		const SDFX_RECORD_HEADER* r = reinterpret_cast<const SDFX_RECORD_HEADER*>(b);
-		klein::UcBuffer b2(b, r->recordNumBytes);
-		bsdfx += b2;
+		std::ostringstream os; printTime(os); 
+		os << " - Could not GetTheSdfxRecord(" << name << ") - "; 
+		printError(recorder.tpuHandle(), os);
+		throw std::runtime_error(os.str());
 	}
 
-	// bathy proc sdfx
-	{
-		U32 n = 0;
-		if (NGS_SUCCESS != DllGetTheSdfxRecordSize(recorder.tpuHandle(), 
-					SDFX_RECORD_ID_BATHY_PROC_SETTINGS_1, &n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecordSize(BATHY_PROC_SETTINGS) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
+	// the size returned by the getSdfxRecordSize is not the size of the
+	// structure, basically a rounded up block size 
+	const SDFX_RECORD_HEADER* r = reinterpret_cast<const SDFX_RECORD_HEADER*>(&sdfx[at]);
+	sdfx.resize(at + r->recordNumBytes);
+}
+//-------------------------------------------------------------------------------------
+// PageWriter::bathySdfx()
+//-------------------------------------------------------------------------------------
+const std::vector<uint8_t>& PageWriter::bathySdfx()
+{
+	// the bathy sdfx records and the end record, only asked for again
+	// after the settings change
+	if (!_bathySdfx.empty()) return _bathySdfx;
 
-		// allocate space for it
-		unsigned char b[n];
+	// built aside, a record failing part way leaves nothing cached and
+	// the next page asks again
+	std::vector<uint8_t> sdfx;
 
-		if (NGS_SUCCESS != DllGetTheSdfxRecord(recorder.tpuHandle(), 
-			SDFX_RECORD_ID_BATHY_PROC_SETTINGS_1, b, n))
-		{
-			std::ostringstream os; printTime(os); 
-			os << " - Could not GetTheSdfxRecord(BATHY_PROC_SETTINGS) - "; 
-			printError(recorder.tpuHandle(), os);
-			throw os.str().c_str();
-		}
-
-		const SDFX_RECORD_HEADER* r = reinterpret_cast<const SDFX_RECORD_HEADER*>(b);
-		klein::UcBuffer b2(b, r->recordNumBytes);
-		bsdfx += b2;
-	}
+	// SP does, cal, eng then proc
+	addSdfxRecord(sdfx, SDFX_RECORD_ID_BATHY_CAL_1, "BATHY_CAL");
+	addSdfxRecord(sdfx, SDFX_RECORD_ID_BATHY_ENG_SETTINGS_1, "BATHY_ENG_SETTINGS");
+	addSdfxRecord(sdfx, SDFX_RECORD_ID_BATHY_PROC_SETTINGS_1, "BATHY_PROC_SETTINGS");
 
 	// end sdfx
 	{
@@ -580,110 +643,184 @@ void PageWriter::addBathySdfx(klein::UcBuffer& p)
 		endSdfx.headerVersion = SDFX_HEADER_VERSION_1;
 		endSdfx.recordVersion = SDFX_RECORD_VERSION_END;
 
-		unsigned char* q = reinterpret_cast<unsigned char*>(&endSdfx);
-		UcBuffer eb(q, sizeof(endSdfx));
+		const uint8_t* q = reinterpret_cast<const uint8_t*>(&endSdfx);
+		sdfx.insert(sdfx.end(), q, q + sizeof(endSdfx));
+	}
+
+	_bathySdfx.swap(sdfx);
+	return _bathySdfx;
+}
+//-------------------------------------------------------------------------------------
+// PageWriter::addBathySdfx()
+//-------------------------------------------------------------------------------------
+PageRef PageWriter::addBathySdfx(PageRef& p)
+{
+	// put the bathy sdfx onto the page in p, do this by
+	//   - taking off the SDFX END
+	//   - adding the BATHY SDFX
+	//   - add the SDFX END back
+	//   - fix the sizes
+	//
+	// the page itself isn't moved, it is cut short and the sdfx goes
+	// in a second page written straight after it. only the sdfx, a few
+	// hundred bytes, is copied.
+
+	// note lack of const
+	CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(p->data);
 
-		bsdfx += eb;
+	{
+		std::ostringstream os;
+		os << "Before: " << h->pingNumber << ", " << h->numberBytes << " " << h->sdfExtensionSize;
+		std::cout << os.str() << std::endl;
 	}
 
-	// fix the page inside of p
+	// for some reason unknown to me, the sdfx size is
+	// also written after the data section (as well as header)
+
+	const U32 numberBytes = h->numberBytes;
+	const U32 sdfxSize = h->sdfExtensionSize;
+
+	// there has to be the size and an end record to replace
+	if (sdfxSize < sizeof(U32) + sizeof(SDFX_RECORD_HEADER) || sdfxSize > numberBytes)
 	{
-		// for some reason unknown to me, the sdfx size is
-		// also written after the data section (as well as header)
+		std::ostringstream os;
+		printTime(os);
+		os << " - No sdfx to add bathy sdfx to, ping: " << h->pingNumber
+			<< ", version: " << h->pageVersion;
+		std::cerr << os.str() << std::endl;
+		return PageRef();
+	}
 
-		const U32 numberBytes = h->numberBytes;
-		const U32 sdfxSize = h->sdfExtensionSize;
+	const std::vector<uint8_t>& bsdfx = bathySdfx();
 
-		// truncate p at end - sizeof sdfx end
-		p.resize(numberBytes - sizeof(SDFX_RECORD_HEADER));
+	// truncate p at end - sizeof sdfx end
+	const size_t keep = numberBytes - sizeof(SDFX_RECORD_HEADER);
 
-		// now add the sdfx
-		klein::UcBuffer t = p + bsdfx;
+	PageRef t = recorder.pagePool().acquire(bsdfx.size());
+	memcpy(t->data, bsdfx.data(), bsdfx.size());
+	t->length = bsdfx.size();
 
-		p.clear();
-		p = t;
+	p->length = keep;
 
-		// reset h to point to data
-		h = reinterpret_cast<CKleinType3Header*>(p.data());
+	// fix the page inside of p
+	h->numberBytes = keep + bsdfx.size();
+	h->sdfExtensionSize = sdfxSize - sizeof(SDFX_RECORD_HEADER) + bsdfx.size();
 
-		// h points into p, p may change with the addition
-		h->numberBytes = p.length();
-		h->sdfExtensionSize = sdfxSize - sizeof(SDFX_RECORD_HEADER) + bsdfx.length();
+	// overwrite the spot that has the sdfx size after the channel data
+	unsigned char* xSize = p->data + numberBytes - sdfxSize;
+	U32* xx = (U32*)xSize;
+	*xx = h->sdfExtensionSize;
 
-		// overwrite the spot that has the sdfx size after the channel data
-		unsigned char* xSize = p.data() + numberBytes - sdfxSize;
-		U32* xx = (U32*)xSize;
-		*xx = h->sdfExtensionSize;
-	}
+	return t;
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::Policy CTOR
 //-------------------------------------------------------------------------------------
-PageWriter::Policy::Policy(PageWriter* pw) : _pw(pw),
-	_queue(new PingQueue_t(50))
+PageWriter::Policy::Policy(PageWriter* pw, const size_t capacity) : _pw(pw),
+	_mask(0), _watermark(0), _started(false), _latePages(0), _overduePings(0)
 {
+	memset(_deadline, '\0', sizeof(_deadline));
+	memset(_lastPing, '\0', sizeof(_lastPing));
+
+	size_t n = 2;
+	while (n < capacity) n <<= 1;
+
+	// every slot starts out free
+	_ring.reserve(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		_ring.push_back(Ping(0, 0));
+		_ring.back().written = true;
+	}
+	_mask = n - 1;
 }
 //-------------------------------------------------------------------------------------
 // PageWriter::Policy::writePage()
 //-------------------------------------------------------------------------------------
-void PageWriter::Policy::writePage(const uint8_t* p, const size_t n)
+void PageWriter::Policy::writePage(PageRef&& page)
 {
 
 	// sanity check ping
-	if (n < 4) throw "writePage() empty ping";
+	if (!page || page->length < 4) throw "writePage() empty ping";
 
-	const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(p);
+	const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(page->data);
 
-	if (h->numberBytes < n) throw "writePage() too small  ping";
+	if (h->numberBytes < page->length) throw "writePage() too small  ping";
 
 	const uint32_t pingNum = h->pingNumber;
 
-	// search the queue for this ping
-	PingQueue_t::iterator pit = findPing(pingNum);
-	if (pit == _queue->end())
-	{
-		// construct a new ping
-		const uint32_t mode = _pw->getFramingMode();
-		const bool bathy = h->capabilityMask & SYS_CAP_BATHY;
-		// mask bits MSB to LSB [bathy, 3503, HF, LF]
-		// don't try to get bathy pages without the 3503
-		const uint32_t mask = mode + ((bathy && (mode & 0x4))? 8 : 0);
-
-		// if the queue is full, we may want to write pings
-		// before they fall off... - useful if bathy proc dies
-		// btw, they don't get their dtors called so do it explicitly
-		if (_queue->full())
+	if (!_started)
+	{
+		_watermark = pingNum;
+		_started = true;
+	}
+
+	const int t = PageTypes::slot(h->pageVersion);
+
+	// a type going back past its own last page can't be a late page,
+	// however small the step, the TPU restarted
+	const bool known = t >= 0 && _lastPing[t] != 0;
+	const bool rewound = known && pingNum < _lastPing[t];
+	if (t >= 0) _lastPing[t] = pingNum;
+
+	// distance from the oldest ping we could still be holding
+	const int32_t ahead = (int32_t)(pingNum - _watermark);
+
+	// a type still moving forward is only lagging, however far behind.
+	// with nothing to go on for this type, a long way back is a restart.
+	const bool restart = rewound
+		|| (!known && ahead < 0 && -ahead > (int32_t)capacity());
+
+	if (ahead < 0 || restart)
+	{
+		if (!restart)
 		{
-			Ping& p = _queue->front();
-			writePings(p.pingNum);
-			_queue->pop_front();
+			// a page for a ping that has already been written
+			if (!(_latePages++ % 100))
+			{
+				std::ostringstream os;
+				printTime(os);
+				os << " - Late page dropped, ping: " << pingNum
+					<< ", version: " << h->pageVersion
+					<< ", total: " << _latePages;
+				std::cerr << os.str() << std::endl;
+			}
+			return;
 		}
 
-		Ping ping(pingNum, mask);
-		pit = _queue->insert(pit, ping);
+		// ping numbers went backwards, the TPU restarted. write out
+		// what we have and start again from here.
+		writePings(_watermark + capacity() - 1);
+		_watermark = pingNum;
 
+		// the other types' last pages are from before the restart
+		for (int i = 0; i < PageTypes::count; i++)
+			if (i != t) _lastPing[i] = 0;
+	}
+	else if (ahead >= (int32_t)capacity())
+	{
+		// the queue is full, write pings before they fall off...
+		// - useful if bathy proc dies
+		writePings(pingNum - capacity());
 	}
 
-	// set an iterator to the ping
-	// and update its buffers
-	switch(h->pageVersion)
+	// look up the slot for this ping
+	Ping* pit = findPing(pingNum);
+	if (!pit)
 	{
-		case 3501:
-			pit->p3501 = UcBuffer(p, n);
-			break;
-		case 3502:
-			pit->p3502 = UcBuffer(p, n);
-			break;
-		case 3503:
-			pit->p3503 = UcBuffer(p, n);
-			break;
-		case 3511:
-			pit->p3511 = UcBuffer(p, n);
-			break;
-		default:
-			break;
+		// construct a new ping, waiting for the pages the PageTypes
+		// say the framing mode and its capabilities make
+		const uint32_t mask = PageTypes::wanted(_pw->getFramingMode(), h->capabilityMask);
+
+		// the slot is free, anything that shared it is below the watermark
+		pit = &slot(pingNum);
+		*pit = Ping(pingNum, mask);
+		pit->created = PingScheduler::now();
 	}
 
+	// hand the page to the ping, a version we don't know is dropped
+	if (t >= 0) pit->pages[t] = std::move(page);
+
 	if (pingReadyForWrite(*pit))
 	{
 		// write all pings upto this ping num
@@ -704,90 +841,139 @@ bool PageWriter::Policy::pingReadyForWrite(const Ping& p)
 	if (p.written) return false;
 
 	// if any are set but empty then not ready
-	if (p.mask & 0x01 && p.p3501.empty()) return false;
-	if (p.mask & 0x02 && p.p3502.empty()) return false;
-	if (p.mask & 0x04 && p.p3503.empty()) return false;
-	if (p.mask & 0x08 && p.p3511.empty()) return false;
+	for (int t = 0; t < PageTypes::count; t++)
+		if (p.mask & PageTypes::info[t].mask && !p.pages[t]) return false;
 
 	// can't think of any other reason why this ping isn't ready
 	// to write
 	return true;
 }
 //-------------------------------------------------------------------------------------
+// PageWriter::Policy::updateDeadlines()
+//-------------------------------------------------------------------------------------
+void PageWriter::Policy::updateDeadlines()
+{
+	// deadlines in ping intervals follow the TPU's current ping rate
+	const uint32_t msec = _pw->recorder.pingInterval();
+	const int64_t interval = msec ? (int64_t)msec * 1000000 : PingScheduler::defaultInterval;
+
+	const RecorderConfig& c = _pw->recorder.config();
+
+	for (int t = 0; t < PageTypes::count; t++)
+	{
+		const Deadline& d = c.deadline[t];
+		_deadline[t] = d.pings ? d.value * interval : (int64_t)d.value * 1000000;
+	}
+}
+//-------------------------------------------------------------------------------------
+// PageWriter::Policy::pingOverdue()
+//-------------------------------------------------------------------------------------
+bool PageWriter::Policy::pingOverdue(const Ping& p, const int64_t now) const
+{
+	if (!p.mask || p.written) return false;
+
+	// every page this ping is still waiting for must have a deadline,
+	// and be past it
+	const int64_t age = now - p.created;
+	bool missing = false;
+
+	for (int t = 0; t < PageTypes::count; t++)
+	{
+		if (!(p.mask & PageTypes::info[t].mask) || p.pages[t]) continue;
+
+		if (!_deadline[t] || age < _deadline[t]) return false;
+
+		missing = true;
+	}
+	return missing;
+}
+//-------------------------------------------------------------------------------------
+// PageWriter::Policy::expire()
+//-------------------------------------------------------------------------------------
+void PageWriter::Policy::expire(const int64_t now)
+{
+	if (!_started) return;
+
+	updateDeadlines();
+
+	// pings go out in order, so stop at the first queued ping that is
+	// still within its deadline, even if a later one is overdue
+	const uint32_t end = _watermark + capacity();
+
+	for (uint32_t n = _watermark; n != end; n++)
+	{
+		const Ping* p = findPing(n);
+
+		if (!p) continue;
+
+		if (!pingOverdue(*p, now)) break;
+
+		if (!(_overduePings++ % 100))
+		{
+			std::ostringstream os;
+			printTime(os);
+			os << " - Ping past deadline written incomplete, ping: " << n
+				<< ", mask: 0x" << std::hex << p->mask << std::dec
+				<< ", total: " << _overduePings;
+			std::cerr << os.str() << std::endl;
+		}
+
+		writePings(n);
+	}
+}
+//-------------------------------------------------------------------------------------
 // PageWriter::Policy::writePings()
 //-------------------------------------------------------------------------------------
 void PageWriter::Policy::writePings(const uint32_t pingNum)
 {
-	// search the queue looking for pings before this ping
-	// that have not been written, write them out.
+	// write out every queued ping from the watermark up to and including
+	// this ping, in ping order, then move the watermark past it.
+	//
+	// only the slots between the watermark and pingNum are visited, and
+	// the watermark never goes back over them, so each ping costs O(1)
+	// amortized. nothing is queued beyond watermark + capacity, so the
+	// walk stops there however far pingNum has jumped.
 
-	// this is a brute force approach chosen for its 
-	// simplcity - a more advanced algorithm would use
-	// the ping iterator found for the current ping and
-	// walk backwards until it found a written ping and 
-	// then start writing from the one previous until 
-	// the current ping is reached - bleh
+	const int32_t span = (int32_t)(pingNum - _watermark);
 
-	for (auto & p : *_queue)
+	if (span < 0) return;
+
+	const uint32_t last = ((uint32_t)span < capacity()) ?
+		pingNum : _watermark + capacity() - 1;
+
+	for (uint32_t n = _watermark; ; n++)
 	{
-		// all done
-		if (p.pingNum > pingNum) return;
+		Ping* p = findPing(n);
 
-		if (!p.written) 
+		if (p)
 		{
-			p.write(_pw);
-			p.written = true;
+			p->write(_pw);
+			p->written = true;
+
+			// the slot is free, let go of any pages not written
+			for (auto& page : p->pages) page.reset();
 		}
+
+		if (n == last) break;
 	}
+
+	_watermark = pingNum + 1;
 }
 
 //-------------------------------------------------------------------------------------
 // PageWriter::Policy::Ping
-//  - this is a containerized object, it may be okay
-//    to use all of the default ctors, but coded them
-//	  anyway, primarily because of the UcBuffer and move
-//	  operations
+//  - this is a containerized object that owns its pages, so
+//    it only moves - the pages themselves are never copied
 //-------------------------------------------------------------------------------------
 // PageWriter::Policy::Ping ctor(pingNum, mask)
 PageWriter::Policy::Ping::Ping(const uint32_t p, const uint32_t m)
-	: pingNum(p), mask(m), written(false) { }
-// PageWriter::Policy::Ping copy ctor
-PageWriter::Policy::Ping::Ping(const PageWriter::Policy::Ping& rhs)
-{
-	pingNum = rhs.pingNum;
-	mask = rhs.mask;
-	written = rhs.written;
-	p3501 = rhs.p3501;
-	p3502 = rhs.p3502;
-	p3503 = rhs.p3503;
-	p3511 = rhs.p3511;
-}
+	: pingNum(p), mask(m), written(false), created(0) { }
 // PageWriter::Policy::Ping move ctor
 PageWriter::Policy::Ping::Ping(PageWriter::Policy::Ping&& rhs)
+	: pingNum(rhs.pingNum), mask(rhs.mask), written(rhs.written), created(rhs.created)
 {
-	pingNum = rhs.pingNum;
-	mask = rhs.mask;
-	written = rhs.written;
-	p3501 = rhs.p3501; 
-	p3502 = rhs.p3502; 
-	p3503 = rhs.p3503; 
-	p3511 = rhs.p3511;
-}
-// PageWriter::Policy::Ping assignment operator
-PageWriter::Policy::Ping& PageWriter::Policy::Ping::operator = (const PageWriter::Policy::Ping& rhs)
-{
-	if (this == &rhs)
-		return *this;
-
-	pingNum = rhs.pingNum;
-	mask = rhs.mask;
-	written = rhs.written;
-	p3501 = rhs.p3501;
-	p3502 = rhs.p3502;
-	p3503 = rhs.p3503;
-	p3511 = rhs.p3511;
-
-	return *this;
+	for (int t = 0; t < PageTypes::count; t++)
+		pages[t] = std::move(rhs.pages[t]);
 }
 // PageWriter::Policy::Ping move operator
 PageWriter::Policy::Ping& PageWriter::Policy::Ping::operator = (PageWriter::Policy::Ping&& rhs)
@@ -798,10 +984,9 @@ PageWriter::Policy::Ping& PageWriter::Policy::Ping::operator = (PageWriter::Poli
 	pingNum = rhs.pingNum;
 	mask = rhs.mask;
 	written = rhs.written;
-	p3501 = rhs.p3501;
-	p3502 = rhs.p3502;
-	p3503 = rhs.p3503;
-	p3511 = rhs.p3511;
+	created = rhs.created;
+	for (int t = 0; t < PageTypes::count; t++)
+		pages[t] = std::move(rhs.pages[t]);
 
 	return *this;
 }
@@ -811,8 +996,7 @@ PageWriter::Policy::Ping& PageWriter::Policy::Ping::operator = (PageWriter::Poli
 void PageWriter::Policy::Ping::write(PageWriter* pw)
 {
 	// finally a ping that is ready to write
-	// this is where the page ordering is implemented, probably 
-	// could be generalized
+	// the page ordering is the PageTypes list order
 	//
 	// friend function of PageWriter
 	//
@@ -821,48 +1005,74 @@ void PageWriter::Policy::Ping::write(PageWriter* pw)
 
 	static const uint32_t pm = 0xffffffff;
 
-	static bool addSdfx3503 = false;
-	static bool addSdfx3511 = false;
+	// per type, the next page needs the bathy sdfx
+	static bool addSdfx[PageTypes::count] = { false };
 
 	if (pw->_numPings == 0)
 	{
-		addSdfx3503 = true;
-		addSdfx3511 = true;
+		for (int t = 0; t < PageTypes::count; t++)
+			addSdfx[t] = PageTypes::info[t].sdfx;
 	}
 
-	if (!p3501.empty()) 
-	{
-		// write marker
-		pw->fileWrite((uint8_t*) &pm, sizeof(uint32_t));
-		// write page
-		pw->fileWrite(p3501.uc_str(), p3501.length());
-	}
-	if (!p3503.empty())
+	// the local readers get the pages as they came from the TPU
+	if (pw->_bus)
 	{
-		pw->fileWrite((uint8_t*) &pm, sizeof(uint32_t));
-		if (addSdfx3503)
+		struct iovec iov[PageTypes::count];
+		int n = 0;
+
+		for (int t = 0; t < PageTypes::count; t++)
 		{
-			// no pings writen to file yet, add bathy sdfx to first 3503 record in file
-			addSdfx3503 = false;
-			pw->addBathySdfx(p3503);
+			if (!pages[t]) continue;
+
+			iov[n].iov_base = pages[t]->data;
+			iov[n].iov_len = pages[t]->length;
+			n++;
 		}
-		pw->fileWrite(p3503.uc_str(), p3503.length());
+
+		Metrics::Timer timer(Metrics::publish, pingNum);
+		pw->_bus->publish(pingNum, iov, n);
 	}
-	if (!p3511.empty())
+
+	for (int t = 0; t < PageTypes::count; t++)
 	{
+		PageRef& page = pages[t];
+
+		if (!page) continue;
+
+		// write marker
 		pw->fileWrite((uint8_t*) &pm, sizeof(uint32_t));
-		if (addSdfx3511)
+
+		// the rest of the page if the sdfx was added
+		PageRef sdfx;
+
+		if (addSdfx[t])
 		{
-			// no pings writen to file yet, add bathy sdfx to first 3503 record in file
-			addSdfx3511 = false;
-			pw->addBathySdfx(p3511);
+			// no pings writen to file yet, add bathy sdfx to first record of this type in file
+			addSdfx[t] = false;
+			sdfx = pw->addBathySdfx(page);
 		}
-		pw->fileWrite(p3511.uc_str(), p3511.length());
-	}
-	if (!p3502.empty())
-	{
-		pw->fileWrite((uint8_t*) &pm, sizeof(uint32_t));
-		pw->fileWrite(p3502.uc_str(), p3502.length());
+
+		SdfIndexRecord r;
+		if (pw->_indexFd >= 0)
+		{
+			// where the page goes, just after the marker
+			const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(page->data);
+
+			r.offset = pw->_fileSize + pw->_batch->bytes;
+			r.length = page->length + (sdfx ? sdfx->length : 0);
+			r.pageVersion = h->pageVersion;
+			r.pingNumber = h->pingNumber;
+			r.reserved = 0;
+			r.time_msec = sdfTime_msec(h->year, h->month, h->day,
+					h->hour, h->minute, h->second, h->hSecond);
+		}
+
+		// write page, the writer takes it
+		pw->fileWrite(std::move(page));
+		pw->fileWrite(std::move(sdfx));
+
+		// indexed behind the page, into whichever batch is filling now
+		if (pw->_indexFd >= 0) pw->_batch->addIndex(&r, sizeof(r));
 	}
 
 	pw->_numPings++;
@@ -874,9 +1084,18 @@ namespace klein
 {
 	std::ostream& operator << (std::ostream& out, const PageWriter::Policy& p)
 	{
-		for (auto const& pp : *(p._queue))
+		out << "Policy watermark: " << p._watermark
+			<< ", capacity: " << p.capacity()
+			<< ", late pages: " << p._latePages
+			<< ", overdue pings: " << p._overduePings;
+
+		// queued pings, in ping order
+		for (uint32_t i = 0; i < p.capacity(); i++)
 		{
-			out << pp;
+			const PageWriter::Policy::Ping& pp = p._ring[(p._watermark + i) & p._mask];
+
+			if (!pp.written && pp.pingNum == p._watermark + i)
+				out << std::endl << pp;
 		}
 
 		return out;
@@ -7,12 +7,17 @@
 
 #include <ostream>
 #include <stdint.h>
-#include <stdio.h> // FILE*
+#include <limits.h> // PATH_MAX
 
 #include <memory>
-#include <boost/circular_buffer.hpp>
+#include <vector>
 
-#include "UcBuffer.h"
+#include "PagePool.h"
+#include "IoThread.h"
+#include "SpareFile.h"
+#include "SdfIndex.h"
+#include "PingBus.h"
+#include "PageTypes.h"
 
 #include "KleinSonar.h"
 #include "Recorder.h"
@@ -38,12 +43,17 @@ class PageWriter
 		// what happens when a page is lost in the ether? well, the policy
 		// will write any prior pings that have not been written when a ping
 		// is ready to write
+		//
+		// a ping owns its pages, it can be moved but not copied
+		//
+		// a page type can also be given a deadline. once every page still
+		// missing from a ping is past its type's deadline the ping is
+		// written with what it has, so a stalled upstream process only
+		// holds pings that long rather than until the queue fills.
 			class Ping
 			{
 				public:
 					Ping(uint32_t p, uint32_t m);
-					Ping(const Ping& rhs);
-					Ping& operator = (const Ping& rhs);
 					Ping(Ping&& rhs);
 					Ping& operator = (Ping&& rhs);
 
@@ -54,50 +64,86 @@ class PageWriter
 					uint32_t pingNum;
 					uint32_t mask;
 					bool written;
+					int64_t created;	// ns monotonic, when its first page came in
+
+					// a slot per PageTypes entry
+					PageRef pages[PageTypes::count];
 
-					klein::UcBuffer p3501;
-					klein::UcBuffer p3502;
-					klein::UcBuffer p3503;
-					klein::UcBuffer p3511;
+				private:
+					// no copy or operator = ctors
+					Ping(const Ping& rhs);
+					Ping& operator = (const Ping& rhs);
 			};
 
-			Policy(PageWriter* pw);
+			// capacity is rounded up to a power of two
+			Policy(PageWriter* pw, const size_t capacity);
 			~Policy() {};
 
-			void writePage(const uint8_t* p, const size_t n);
+			void writePage(PageRef&& page);
+
+			// write the oldest pings that are past their deadlines, now is
+			// ns monotonic
+			void expire(const int64_t now);
+
+			inline size_t capacity() const { return _ring.size(); }
 
 		private:
 			// pointer to parent for callbacks
 			PageWriter* _pw;
 
-			typedef boost::circular_buffer<PageWriter::Policy::Ping> PingQueue_t;
-			std::unique_ptr<PingQueue_t> _queue;
+			// the queue is a slot per ping, indexed by ping number modulo
+			// the capacity. every ping below the watermark has been
+			// written, so the queued pings are [watermark, watermark +
+			// capacity) and each has its own slot. a slot is free when
+			// its ping has been written.
+			typedef std::vector<PageWriter::Policy::Ping> PingRing_t;
+			PingRing_t _ring;
+			uint32_t _mask;
+			uint32_t _watermark;
+			bool _started;
+			uint64_t _latePages;
+			uint64_t _overduePings;
+
+			// the last ping each PageTypes slot brought, 0 for none. a
+			// type's pages come in ping order, one going back is a restart.
+			uint32_t _lastPing[PageTypes::count];
+
+			// ns per PageTypes slot, 0 for none
+			int64_t _deadline[PageTypes::count];
+
+			inline Ping& slot(const uint32_t n) { return _ring[n & _mask]; }
 
 			bool pingReadyForWrite(const Ping& p);
+			bool pingOverdue(const Ping& p, const int64_t now) const;
+			void updateDeadlines();
 			void writePings(const uint32_t pingNum);
 
 		public:
 
-			inline PingQueue_t::iterator findPing(const uint32_t n)
+			// the queued ping n, or NULL
+			inline Ping* findPing(const uint32_t n)
 			{
-				return std::find_if(_queue->begin(), _queue->end(),
-						[n] (const Ping& p) -> bool
-						{ return p.pingNum == n; });
+				Ping& p = slot(n);
+				return (!p.written && p.pingNum == n) ? &p : NULL;
 			}
 
 		friend std::ostream& operator << (std::ostream& out, const Policy& p);
 		friend std::ostream& operator << (std::ostream& out, const Policy::Ping& p);
 
+		// the microbenchmarks, RecorderBench.cpp
+		friend class RecorderBench;
+
 	};
 
 		PageWriter(Recorder& r);
 		~PageWriter();
 	
-		void writePage(const uint8_t* p, const size_t n);
+		void writePage(PageRef&& page);
 		void update();
 		void flush();
 		inline bool record() { return _settings.nRecordMode; }
-		uint32_t getFramingMode();
+		inline uint32_t getFramingMode() { return recorder.tpuSettings().framingMode(); }
+		inline IoThread::Stats ioStats() const { return _io->stats(); }
 
 	private:
 		// no copy or operator = ctors
@@ -110,22 +156,45 @@ class PageWriter
 		void openDataFile();
 		void closeDataFile();
 		void fileWrite(const uint8_t* p, const size_t n);
+		void fileWrite(PageRef&& page);
 		void fileWriteForReal();
 
 		// this probably should be done by the Bathy process...
-		void addBathySdfx(klein::UcBuffer& p);
+		// returns the new end of the page, to write after it
+		PageRef addBathySdfx(PageRef& p);
+		const std::vector<uint8_t>& bathySdfx();
+		void addSdfxRecord(std::vector<uint8_t>& sdfx, const U32 id, const char* name);
 
 		// data structures from the Klein SDK
 		DiskRecordingStatus _status;
 		DiskRecordingSettings _settings;
 
 		Recorder& recorder;
-		FILE* _fp;
-		uint32_t _cacheBytes;
-		uint8_t* _cache;
-		uint8_t* _cachePtr;
-		uint32_t _fileSize;
+		int _fd;
+
+		// writes happen on this thread, _batch is the gather list being
+		// filled, it points at the pages rather than copying them
+		std::unique_ptr<IoThread> _io;
+		IoThread::Batch* _batch;
+		size_t _batchLimit;
+		uint64_t _fileSize;		// bytes handed to the io thread
 		uint32_t _numPings;
+		uint32_t _pingBytes;	// per ping in the last file, for the size hint
+
+		// the page index next to the data file, -1 for none
+		int _indexFd;
+
+		// the next file, made ahead of the rotation
+		SpareFile _spare;
+
+		// every ping written is published here too, NULL for none
+		std::unique_ptr<PingBus> _bus;
+
+		// framing mode the current file was opened under
+		uint32_t _framingMode;
+
+		// bathy sdfx records and end record, empty until needed again
+		std::vector<uint8_t> _bathySdfx;
 
 		char _filename[PATH_MAX+128];
 
@@ -133,10 +202,11 @@ class PageWriter
 		std::unique_ptr<Policy> _policy;
 
 		static const int pingWriteInterval;
-		static const int cacheSize;
+		static const int cacheSize; // bytes in flight, split over the IoThread's batches
 
 	friend std::ostream& operator << (std::ostream& out, const PageWriter& p);
 	friend void PageWriter::Policy::Ping::write(PageWriter* pw);
+	friend class RecorderBench;
 };
 
 } // namespace klein
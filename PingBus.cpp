@@ -0,0 +1,261 @@
+#include <iostream>
+#include <sstream>
+#include <new>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PingBus.h"
+#include "KleinSonar.h"
+
+using namespace klein;
+using namespace klein::PingBusLayout;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/PingBus.cpp#1 $";
+
+//-----------------------------------------------------------------------------
+// PingBus CTOR
+//-----------------------------------------------------------------------------
+PingBus::PingBus(const std::string& name, const size_t slots, const size_t slotBytes) :
+	_name(name), _base(NULL), _size(0), _header(NULL), _published(0), _tooBig(0)
+{
+	size_t n = 2;
+	while (n < slots) n <<= 1;
+
+	// room for the slot header and a page, in whole cache lines
+	size_t b = (slotBytes + align - 1) / align * align;
+	if (b < dataOffset + align) b = dataOffset + align;
+
+	if (b > UINT32_MAX) throw std::runtime_error("Ping bus slots too big");
+
+	_size = sizeof(Header) + n * b;
+
+	// a bus left behind by a recorder that died, its readers keep
+	// what they have mapped
+	(void) shm_unlink(name.c_str());
+
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd < 0 || ftruncate(fd, _size) < 0
+		|| (_base = (uint8_t*)mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		std::ostringstream os;
+		os << "Couldn't make ping bus: error = " << strerror(errno)
+			<< ", name = " << name;
+
+		if (fd >= 0)
+		{
+			close(fd);
+			(void) shm_unlink(name.c_str());
+		}
+		_base = NULL;
+		throw std::runtime_error(os.str());
+	}
+
+	// the mapping holds it
+	close(fd);
+
+	// it is all zeros, so every slot is empty. the magic goes in last,
+	// a reader that sees it sees the rest.
+	_header = reinterpret_cast<Header*>(_base);
+	new (&_header->head) std::atomic<uint64_t>(0);
+	for (size_t i = 0; i < n; i++)
+		new (&slot(i).seq) std::atomic<uint64_t>(0);
+
+	_header->version = version;
+	_header->slots = n;
+	_header->slotBytes = b;
+
+	std::atomic_thread_fence(std::memory_order_release);
+	_header->magic = magic;
+}
+//-----------------------------------------------------------------------------
+// PingBus DTOR
+//-----------------------------------------------------------------------------
+PingBus::~PingBus()
+{
+	if (!_base) return;
+
+	// readers still mapping it keep it until they are done
+	munmap(_base, _size);
+	(void) shm_unlink(_name.c_str());
+}
+//-----------------------------------------------------------------------------
+// PingBus::publish()
+//-----------------------------------------------------------------------------
+void PingBus::publish(const uint32_t pingNum, const struct iovec* pages, const int n)
+{
+	size_t bytes = 0;
+	for (int i = 0; i < n; i++)
+		bytes += (pages[i].iov_len + 7) & ~7;
+
+	if (n > maxPages || dataOffset + bytes > _header->slotBytes)
+	{
+		_tooBig++;
+		return;
+	}
+
+	const uint64_t seq = _published;
+	Slot& s = slot(seq);
+
+	// odd while it is being filled
+	s.seq.store(2 * seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint8_t* const base = reinterpret_cast<uint8_t*>(&s);
+	size_t offset = dataOffset;
+
+	for (int i = 0; i < n; i++)
+	{
+		const size_t length = pages[i].iov_len;
+		const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(pages[i].iov_base);
+
+		memcpy(base + offset, pages[i].iov_base, length);
+
+		s.pages[i].offset = offset;
+		s.pages[i].length = length;
+		s.pages[i].version = (length >= sizeof(*h)) ? h->pageVersion : 0;
+		s.pages[i].reserved = 0;
+
+		offset += (length + 7) & ~7;
+	}
+
+	s.pingNum = pingNum;
+	s.count = n;
+	s.bytes = bytes;
+
+	s.seq.store(2 * seq + 2, std::memory_order_release);
+	_header->head.store(seq + 1, std::memory_order_release);
+
+	_published++;
+}
+//-----------------------------------------------------------------------------
+// PingBusReader CTOR
+//-----------------------------------------------------------------------------
+PingBusReader::PingBusReader(const std::string& name) :
+	_base(NULL), _size(0), _header(NULL), _next(0), _lost(0)
+{
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0
+		|| (_base = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		std::ostringstream os;
+		os << "Couldn't map ping bus: error = " << strerror(errno)
+			<< ", name = " << name;
+
+		if (fd >= 0) close(fd);
+		_base = NULL;
+		throw std::runtime_error(os.str());
+	}
+
+	close(fd);
+	_size = st.st_size;
+	_header = reinterpret_cast<const Header*>(_base);
+
+	if (_size < sizeof(Header) || _header->magic != magic || _header->version != version
+		|| _size < sizeof(Header) + (size_t)_header->slots * _header->slotBytes)
+	{
+		munmap((void*)_base, _size);
+		_base = NULL;
+		throw std::runtime_error("Not a ping bus, or another version of it");
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	_next = _header->head.load(std::memory_order_acquire);
+}
+//-----------------------------------------------------------------------------
+// PingBusReader DTOR
+//-----------------------------------------------------------------------------
+PingBusReader::~PingBusReader()
+{
+	if (_base) munmap((void*)_base, _size);
+}
+//-----------------------------------------------------------------------------
+// PingBusReader::next()
+//-----------------------------------------------------------------------------
+bool PingBusReader::next(Ping& p)
+{
+	const uint64_t slots = _header->slots;
+
+	for (;;)
+	{
+		const uint64_t head = _header->head.load(std::memory_order_acquire);
+
+		if (_next >= head) return false;
+
+		// lapped, the oldest still there is a ring behind the head
+		if (head - _next > slots)
+		{
+			_lost += head - slots - _next;
+			_next = head - slots;
+		}
+
+		const Slot& s = slot(_next);
+		p.seq = _next++;
+
+		// being refilled with a newer ping already
+		if (s.seq.load(std::memory_order_acquire) != 2 * p.seq + 2)
+		{
+			_lost++;
+			continue;
+		}
+
+		const uint8_t* const base = reinterpret_cast<const uint8_t*>(&s);
+
+		p.pingNum = s.pingNum;
+		p.count = (s.count <= (uint32_t)maxPages) ? s.count : 0;
+
+		for (int i = 0; i < p.count; i++)
+		{
+			const Entry& e = s.pages[i];
+
+			// a torn entry could point anywhere, valid() says so below
+			const bool inside = e.offset <= _header->slotBytes
+				&& e.length <= _header->slotBytes - e.offset;
+
+			p.pages[i].data = base + (inside ? e.offset : 0);
+			p.pages[i].length = inside ? e.length : 0;
+			p.pages[i].version = e.version;
+		}
+
+		if (valid(p)) return true;
+
+		_lost++;
+	}
+}
+//-----------------------------------------------------------------------------
+// PingBusReader::valid()
+//-----------------------------------------------------------------------------
+bool PingBusReader::valid(const Ping& p) const
+{
+	// the reads before this can't be moved after the check
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot(p.seq).seq.load(std::memory_order_relaxed) == 2 * p.seq + 2;
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const PingBus& b)
+	{
+		out << "PingBus " << b._name
+			<< " slots: " << b._header->slots << " x " << b._header->slotBytes
+			<< " bytes, published: " << b.published()
+			<< ", too big: " << b.tooBig();
+		return out;
+	}
+
+	std::ostream& operator << (std::ostream& out, const PingBusReader& r)
+	{
+		out << "PingBusReader slots: " << r._header->slots
+			<< ", next: " << r._next
+			<< ", lost: " << r.lost();
+		return out;
+	}
+}
@@ -0,0 +1,185 @@
+#ifndef _KLEIN_PING_BUS_H_
+#define _KLEIN_PING_BUS_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/PingBus.h#1 $
+//
+
+#include <ostream>
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h> // struct iovec
+
+namespace klein
+{
+
+// the live ping bus. the recorder publishes every ping it writes, all
+// its pages, into a POSIX shared memory ring, so the display, QC and
+// bathy monitors on the box read them from there instead of each
+// opening a slave connection to the TPU.
+//
+// the ring is a fixed number of slots, each big enough for a ping. the
+// recorder copies a ping's pages into the next slot and never waits for
+// a reader: a reader that falls more than the ring behind loses the
+// oldest pings, and is told how many.
+//
+// each slot is a seqlock. its sequence is odd while the recorder fills
+// it and 2n + 2 once it holds the nth ping published. a reader looks at
+// the pages where they are in the mapping, no copy, and afterwards
+// checks the sequence is still the same. if it isn't the slot was
+// reused under it and what it read is garbage.
+//
+//   PingBusReader bus("/klein-pings");
+//   PingBusReader::Ping p;
+//
+//   while (running)
+//   {
+//       if (!bus.next(p)) { usleep(10000); continue; }
+//       ... look at p.pages[0 .. p.count) ...
+//       if (!bus.valid(p)) ... it was overwritten, throw away the result
+//   }
+//
+// the layout is the same for both sides, and versioned, readers built
+// against another layout are refused.
+namespace PingBusLayout
+{
+	static const uint32_t magic = 0x4b504247;	// "KPBG"
+	static const uint32_t version = 1;
+	static const int maxPages = 8;
+	static const size_t align = 64;
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slots;			// a power of two
+		uint32_t slotBytes;		// the whole slot, header and pages
+		uint8_t pad0[align - 16];
+
+		// pings published, the next one goes in slot head % slots
+		std::atomic<uint64_t> head;
+		uint8_t pad1[align - sizeof(uint64_t)];
+	};
+
+	struct Entry
+	{
+		uint32_t offset;		// from the slot start
+		uint32_t length;
+		uint32_t version;		// the page's pageVersion
+		uint32_t reserved;
+	};
+
+	struct Slot
+	{
+		std::atomic<uint64_t> seq;
+		uint32_t pingNum;
+		uint32_t count;			// pages
+		uint32_t bytes;			// of pages
+		uint32_t reserved;
+		Entry pages[maxPages];
+	};
+
+	// where the pages start in a slot
+	static const size_t dataOffset = (sizeof(Slot) + align - 1) / align * align;
+}
+
+// the recorder's side, creates the bus and publishes into it
+class PingBus
+{
+	public:
+
+		// replaces a bus of the same name, e.g. one left by a crash.
+		// throws std::runtime_error if the shared memory can't be made.
+		PingBus(const std::string& name, const size_t slots, const size_t slotBytes);
+		~PingBus();
+
+		// a ping's pages, each starting with its header. a ping too
+		// big for a slot is not published, only counted.
+		void publish(const uint32_t pingNum, const struct iovec* pages, const int n);
+
+		inline uint64_t published() const { return _published; }
+		inline uint64_t tooBig() const { return _tooBig; }
+
+	private:
+		// no copy or operator = ctors
+		PingBus(const PingBus& rhs);
+		PingBus& operator = (const PingBus& rhs);
+
+		inline PingBusLayout::Slot& slot(const uint64_t n)
+		{
+			return *reinterpret_cast<PingBusLayout::Slot*>(_base + sizeof(PingBusLayout::Header)
+					+ (n & (_header->slots - 1)) * (size_t)_header->slotBytes);
+		}
+
+		const std::string _name;
+		uint8_t* _base;
+		size_t _size;
+		PingBusLayout::Header* _header;
+
+		uint64_t _published;
+		uint64_t _tooBig;
+
+	friend std::ostream& operator << (std::ostream& out, const PingBus& b);
+};
+
+// the readers' side, any number of them, each with its own place
+class PingBusReader
+{
+	public:
+
+		struct Page
+		{
+			const uint8_t* data;	// in the bus, starting with the header
+			uint32_t length;
+			uint32_t version;
+		};
+
+		struct Ping
+		{
+			uint64_t seq;			// published nth, for valid()
+			uint32_t pingNum;
+			int count;
+			Page pages[PingBusLayout::maxPages];
+		};
+
+		// maps the bus, throws std::runtime_error if it isn't there or is
+		// another layout.
+		// reading starts with the next ping published.
+		explicit PingBusReader(const std::string& name);
+		~PingBusReader();
+
+		// the next ping, false if there isn't one yet. skips what the
+		// recorder has lapped.
+		bool next(Ping& p);
+
+		// p's pages haven't been overwritten since next() returned it
+		bool valid(const Ping& p) const;
+
+		// pings missed, the recorder lapped this reader
+		inline uint64_t lost() const { return _lost; }
+
+	private:
+		// no copy or operator = ctors
+		PingBusReader(const PingBusReader& rhs);
+		PingBusReader& operator = (const PingBusReader& rhs);
+
+		inline const PingBusLayout::Slot& slot(const uint64_t n) const
+		{
+			return *reinterpret_cast<const PingBusLayout::Slot*>(_base + sizeof(PingBusLayout::Header)
+					+ (n & (_header->slots - 1)) * (size_t)_header->slotBytes);
+		}
+
+		const uint8_t* _base;
+		size_t _size;
+		const PingBusLayout::Header* _header;
+
+		uint64_t _next;			// the next ping to read
+		uint64_t _lost;
+
+	friend std::ostream& operator << (std::ostream& out, const PingBusReader& r);
+};
+
+} // namespace klein
+#endif // _KLEIN_PING_BUS_H_
@@ -0,0 +1,315 @@
+// what publishing on the PingBus costs the recorder as readers are
+// added. the readers are processes of their own, as the display and
+// monitors would be, each mapping the bus and reading every page of
+// every ping it gets, where it is. the recorder side never waits for
+// them, so the publish cost should stay the same however many there
+// are, only the readers that can't keep up lose pings. that holds while
+// the box has a core for each reader, past that they take the
+// recorder's cpu.
+//
+// a run per reader count, one line each:
+//
+//   readers=4 pings=2000 mb_s=3010.2 publish_us=174.1 p50_us=171 p99_us=230
+//   max_us=611 got=2000 lost=0 invalid=0
+//
+// got, lost and invalid are per reader, the worst one. invalid are
+// pings overwritten while the reader was still at them.
+//
+//   --rate 0 publishes as fast as it can, the readers fall behind
+//
+// the PingBusBench configuration builds it, with PingBus.cpp and
+// ToolUtil.cpp
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/PingBusBench.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "PingBus.h"
+#include "ToolUtil.h"
+#include "PageTypes.h"
+#include "KleinSonar.h"
+
+using namespace klein;
+
+// what a reader did, in memory shared with the parent
+struct ReaderStats
+{
+	std::atomic<uint64_t> got;
+	std::atomic<uint64_t> lost;
+	std::atomic<uint64_t> invalid;
+	std::atomic<uint64_t> sum;		// so the reads aren't optimised away
+};
+
+struct Shared
+{
+	std::atomic<int> ready;
+	std::atomic<bool> done;
+	ReaderStats readers[1];			// as many as asked for
+};
+
+// a reader process, reads every page it is given until done
+static void reader(const std::string& name, Shared* sh, const int i)
+{
+	ReaderStats& st = sh->readers[i];
+
+	try
+	{
+		PingBusReader bus(name);
+		PingBusReader::Ping p;
+
+		sh->ready.fetch_add(1);
+
+		while (!sh->done.load(std::memory_order_relaxed))
+		{
+			if (!bus.next(p))
+			{
+				usleep(100);
+				continue;
+			}
+
+			// a QC pass over the samples, a load a cache line
+			uint64_t sum = 0;
+			for (int j = 0; j < p.count; j++)
+				for (uint32_t k = 0; k < p.pages[j].length; k += 64)
+					sum += p.pages[j].data[k];
+
+			if (bus.valid(p))
+			{
+				st.got.fetch_add(1, std::memory_order_relaxed);
+				st.sum.fetch_add(sum, std::memory_order_relaxed);
+			}
+			else
+				st.invalid.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// what it missed at the end is no loss, it was told to stop
+		st.lost.store(bus.lost());
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "reader " << i << ": " << e.what() << std::endl;
+		sh->ready.fetch_add(1);
+	}
+}
+
+// the pages of a ping, the PageTypes sizes, each with its header
+class Pages
+{
+	public:
+		Pages(const size_t bytes) : _iov(PageTypes::count)
+		{
+			// LF and 3511 an eighth each, 3503 half, HF a quarter
+			static const size_t share[] = { 1, 4, 1, 2 };
+
+			for (int t = 0; t < PageTypes::count; t++)
+			{
+				const size_t n = std::max(sizeof(CKleinType3Header), bytes * share[t % 4] / 8);
+
+				_pages.push_back(std::vector<uint8_t>(n, t + 1));
+				_iov[t].iov_base = &_pages[t][0];
+				_iov[t].iov_len = n;
+
+				CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(&_pages[t][0]);
+				memset(h, 0, sizeof(*h));
+				h->pageVersion = PageTypes::info[t].version;
+				h->numberBytes = n;
+			}
+		}
+
+		inline const struct iovec* iov(const uint32_t ping)
+		{
+			for (auto& p : _pages)
+				reinterpret_cast<CKleinType3Header*>(&p[0])->pingNumber = ping;
+			return &_iov[0];
+		}
+
+		inline size_t bytes() const
+		{
+			size_t n = 0;
+			for (const auto& i : _iov) n += i.iov_len;
+			return n;
+		}
+
+	private:
+		std::vector<std::vector<uint8_t> > _pages;
+		std::vector<struct iovec> _iov;
+};
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[-n --name bus]"
+		<< "[-r --readers n,n,...]"
+		<< "[--pings n]"
+		<< "[--bytes ping bytes]"
+		<< "[--slots n]"
+		<< "[--rate pings a second]"
+		<< std::endl;
+	std::cerr << "\tdefault: -n /pingbusbench -r 0,1,2,4,8 --pings 2000"
+		<< " --bytes 524288 --slots 16 --rate 200" << std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	std::string name("/pingbusbench");
+	std::string counts("0,1,2,4,8");
+	uint32_t pings = 2000;
+	size_t bytes = 512 << 10;
+	size_t slots = 16;
+	uint32_t rate = 200;
+
+	try
+	{
+		ops >> GetOpt::Option('n', "name", name, name)
+			>> GetOpt::Option('r', "readers", counts, counts)
+			>> GetOpt::Option("pings", pings, pings)
+			>> GetOpt::Option("bytes", bytes, bytes)
+			>> GetOpt::Option("slots", slots, slots)
+			>> GetOpt::Option("rate", rate, rate);
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	std::vector<int> readers;
+	{
+		std::istringstream is(counts);
+		std::string s;
+		while (std::getline(is, s, ','))
+			readers.push_back(atoi(s.c_str()));
+	}
+
+	if (readers.empty() || !pings)
+	{
+		usage(av[0]);
+		return -1;
+	}
+
+	Pages pages(bytes);
+	const int64_t interval = rate ? 1000000000 / rate : 0;
+
+	std::cout << "# pings=" << pings << " bytes=" << pages.bytes()
+		<< " slots=" << slots << " rate=" << rate << std::endl;
+
+	for (const int n : readers)
+	{
+		// the readers' stats, shared across the fork
+		const size_t shSize = sizeof(Shared) + n * sizeof(ReaderStats);
+		void* const m = mmap(NULL, shSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED)
+		{
+			std::cerr << "mmap failed: " << strerror(errno) << std::endl;
+			return -1;
+		}
+		Shared* const sh = reinterpret_cast<Shared*>(m);
+
+		try
+		{
+			std::unique_ptr<PingBus> bus(new PingBus(name, slots, pages.bytes() + 4096));
+
+			std::vector<pid_t> children;
+			for (int i = 0; i < n; i++)
+			{
+				const pid_t pid = fork();
+				if (pid == 0)
+				{
+					reader(name, sh, i);
+					_exit(0);
+				}
+				if (pid > 0) children.push_back(pid);
+			}
+
+			while (sh->ready.load() < (int)children.size())
+				usleep(1000);
+
+			std::vector<int64_t> us;
+			us.reserve(pings);
+
+			int64_t total = 0;
+			const int64_t start = now();
+
+			for (uint32_t i = 0; i < pings; i++)
+			{
+				if (interval)
+				{
+					const int64_t wait = start + i * interval - now();
+					if (wait > 0) usleep(wait / 1000);
+				}
+
+				const int64_t t0 = now();
+				bus->publish(i + 1, pages.iov(i + 1), PageTypes::count);
+				const int64_t t = now() - t0;
+
+				total += t;
+				us.push_back(t / 1000);
+			}
+
+			// let the readers catch up with the last of them
+			usleep(100000);
+			sh->done = true;
+
+			for (const pid_t pid : children)
+				waitpid(pid, NULL, 0);
+
+			uint64_t got = pings, lost = 0, invalid = 0;
+			for (int i = 0; i < n; i++)
+			{
+				got = std::min<uint64_t>(got, sh->readers[i].got);
+				lost = std::max<uint64_t>(lost, sh->readers[i].lost);
+				invalid = std::max<uint64_t>(invalid, sh->readers[i].invalid);
+			}
+
+			std::cout << "readers=" << n
+				<< " pings=" << pings
+				<< std::fixed << std::setprecision(1)
+				<< " mb_s=" << (double)pages.bytes() * pings / (total / 1e3)
+				<< " publish_us=" << total / 1e3 / pings
+				<< " p50_us=" << percentile(us, 50)
+				<< " p99_us=" << percentile(us, 99)
+				<< " max_us=" << percentile(us, 100)
+				<< " got=" << (n ? got : 0)
+				<< " lost=" << lost
+				<< " invalid=" << invalid << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "failed: " << e.what() << std::endl;
+			munmap(m, shSize);
+			return -1;
+		}
+
+		munmap(m, shSize);
+	}
+
+	return 0;
+}
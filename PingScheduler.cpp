@@ -0,0 +1,146 @@
+#include <time.h>
+#include <errno.h>
+
+#include "PingScheduler.h"
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/PingScheduler.cpp#1 $";
+
+// used until the TPU tells us, rather kind to the tpu
+const int64_t PingScheduler::defaultInterval = 100000000;
+// don't probe in steps smaller than this
+const int64_t PingScheduler::minStep = 1000000;
+
+//-----------------------------------------------------------------------------
+// PingScheduler CTOR
+//-----------------------------------------------------------------------------
+PingScheduler::PingScheduler() :
+	_interval(defaultInterval), _start(0), _lastEmpty(0), _expected(0),
+	_wake(0), _polls(0), _emptyPolls(0)
+{
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::now()
+//-----------------------------------------------------------------------------
+int64_t PingScheduler::now()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+	{
+		throw "clock_gettime() failed";
+	}
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::interval()
+//-----------------------------------------------------------------------------
+void PingScheduler::interval(const uint32_t msec)
+{
+	const int64_t i = msec ? (int64_t)msec * 1000000 : defaultInterval;
+
+	if (i == _interval) return;
+
+	// new ping rate, relearn the phase
+	_interval = i;
+	_expected = 0;
+	_lastEmpty = 0;
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::step()
+//-----------------------------------------------------------------------------
+int64_t PingScheduler::step() const
+{
+	const int64_t s = _interval / 16;
+	return (s < minStep) ? minStep : s;
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::start()
+//-----------------------------------------------------------------------------
+void PingScheduler::start()
+{
+	_start = now();
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::finish()
+//-----------------------------------------------------------------------------
+void PingScheduler::finish(const bool gotPage)
+{
+	_polls++;
+
+	const int64_t t = _start;
+
+	if (!gotPage)
+	{
+		_emptyPolls++;
+		_lastEmpty = t;
+
+		// not there yet, look again shortly. if a whole ping went by
+		// with nothing, the sonar stopped or the rate changed, so fall
+		// back to polling once a ping until pages show up again
+		if (_expected && t - _expected > _interval)
+		{
+			_expected = 0;
+			_lastEmpty = 0;
+		}
+
+		_wake = _expected ? t + step() : t + _interval;
+		return;
+	}
+
+	// when did this page become available?
+	const int64_t arrival = _lastEmpty ?
+		_lastEmpty + (t - _lastEmpty) / 2 :	// between the two polls
+		t - step();							// at or before now, try earlier
+
+	if (!_expected)
+	{
+		_expected = arrival;
+	}
+	else
+	{
+		// compare against the prediction for this ping, not the next
+		while (_expected - arrival > _interval / 2) _expected -= _interval;
+		while (arrival - _expected > _interval / 2) _expected += _interval;
+
+		// smooth out the jitter
+		_expected += (arrival - _expected) / 4;
+	}
+
+	_lastEmpty = 0;
+
+	// wake a little ahead of the next one we haven't missed yet
+	const int64_t n = now();
+	do { _expected += _interval; } while (_expected - step() <= n);
+
+	_wake = _expected - step() / 2;
+}
+//-----------------------------------------------------------------------------
+// PingScheduler::sleep()
+//-----------------------------------------------------------------------------
+void PingScheduler::sleep()
+{
+	// don't ever go back in time
+	if (_wake <= now()) return;
+
+	struct timespec ts;
+	ts.tv_sec = _wake / 1000000000;
+	ts.tv_nsec = _wake % 1000000000;
+
+	// absolute deadline, a signal (^C) cuts it short
+	(void) clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const PingScheduler& s)
+	{
+		out << "PingScheduler ipp(ms): " << s.interval()
+			<< ", polls: " << s._polls
+			<< ", empty: " << s._emptyPolls;
+		return out;
+	}
+}
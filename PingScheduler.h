@@ -0,0 +1,77 @@
+#ifndef _KLEIN_PING_SCHEDULER_H_
+#define _KLEIN_PING_SCHEDULER_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/PingScheduler.h#1 $
+//
+
+#include <ostream>
+#include <stdint.h>
+
+namespace klein
+{
+
+// decides when to next ask the TPU for pages.
+//
+// rather than sleeping a fixed interval after a fetch started, it learns
+// when pages actually become available and wakes just before the next
+// one is due. every fetch pass reports whether it got a page:
+//   - page, previous poll empty: the page arrived between the two polls,
+//     take the middle of that bracket as the arrival
+//   - page on the first poll: it may have been waiting, probe a step
+//     earlier next time
+//   - no page: look again a step later
+// the arrival estimate is filtered, so the wake time settles just ahead
+// of the pings with about one empty poll every few pings.
+//
+// all times are full CLOCK_MONOTONIC nanoseconds and the sleep is to an
+// absolute deadline, so a slow fetch or a second boundary doesn't skew it.
+class PingScheduler
+{
+	public:
+
+		PingScheduler();
+
+		// expected ping interval, 0 if unknown
+		void interval(const uint32_t msec);
+		inline uint32_t interval() const { return _interval / 1000000; }
+
+		// a fetch pass is starting
+		void start();
+
+		// the fetch pass that start() stamped is done
+		void finish(const bool gotPage);
+
+		// sleep until the next wake time, returns early on a signal
+		void sleep();
+
+		inline uint64_t polls() const { return _polls; }
+		inline uint64_t emptyPolls() const { return _emptyPolls; }
+
+		// CLOCK_MONOTONIC in ns
+		static int64_t now();
+
+		// ns, assumed until the TPU reports a ping interval
+		static const int64_t defaultInterval;
+
+	private:
+
+		// probe step, about 1/16th of a ping
+		int64_t step() const;
+
+		int64_t _interval;	// ns
+		int64_t _start;		// ns, start of this pass
+		int64_t _lastEmpty;	// ns, last empty poll since the last page, or 0
+		int64_t _expected;	// ns, predicted arrival of the next ping, or 0
+		int64_t _wake;		// ns
+
+		uint64_t _polls;
+		uint64_t _emptyPolls;
+
+		static const int64_t minStep;
+
+	friend std::ostream& operator << (std::ostream& out, const PingScheduler& s);
+};
+
+} // namespace klein
+#endif // _KLEIN_PING_SCHEDULER_H_
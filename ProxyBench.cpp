@@ -0,0 +1,318 @@
+// what the TpuProxy serves as clients are added. one feeder thread caches
+// pings into the proxy at the TPU's rate, as the recorder's single
+// connection would, and each client is a thread with its own connection
+// polling every page type the way a PageFetcher polls the TPU: the next
+// ping's info, its page, and a millisecond's sleep once nothing is
+// ready. upstream stays one feeder however many clients there are, only
+// the aggregate served grows.
+//
+// a run per client count, one line each:
+//
+//   clients=8 secs=2.0 pings=101 pages_s=1615.9 mb_s=211.8 info_p50_us=35
+//   info_p99_us=395 page_p50_us=136 page_p99_us=1363 got=404 old=0
+//
+// pings are what the feeder cached, got is the pages of the client that
+// got fewest and old its NGS_GETDATA_ERROR_OLDs, the pages it fell more
+// than the history behind for. a client keeping up gets every page of
+// every ping, pings times the page types. errors, if any, are mostly
+// pages that went between their info and the page.
+//
+//   --rate 0 feeds as fast as it can, the clients fall behind
+//   -a :7070 goes over TCP on the loopback instead
+//
+// the ProxyBench configuration builds it, with TpuProxy.cpp, Util.cpp and
+// ToolUtil.cpp, and links libTpuShim.a from the TpuShim configuration
+// instead of the Klein SDK
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/ProxyBench.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "TpuProxy.h"
+#include "ToolUtil.h"
+#include "PageTypes.h"
+#include "KleinSonar.h"
+
+using namespace klein;
+
+// what a client did
+struct ClientStats
+{
+	ClientStats() : pages(0), bytes(0), old(0), errors(0) {}
+
+	uint64_t pages;
+	uint64_t bytes;
+	uint64_t old;
+	uint64_t errors;
+	std::vector<int64_t> infoUs;
+	std::vector<int64_t> pageUs;
+};
+
+// a client, polls every page type until done
+static void client(const std::string& address, const std::atomic<bool>& done, ClientStats& st)
+{
+	try
+	{
+		TpuProxyClient proxy(address);
+
+		std::vector<U8> buf(4 << 20);
+		uint32_t last[PageTypes::count] = {};
+
+		while (!done.load(std::memory_order_relaxed))
+		{
+			bool got = false;
+
+			for (int t = 0; t < PageTypes::count; t++)
+			{
+				U32 status = 0, bytes = 0;
+
+				const int64_t t0 = now();
+				const BoolStat ok = proxy.pageInfo(PageTypes::info[t].pageType,
+						last[t] ? last[t] + 1 : 0, &status, &bytes);
+				st.infoUs.push_back((now() - t0) / 1000);
+
+				if (!ok)
+				{
+					st.errors++;
+					continue;
+				}
+
+				if (status == NGS_GETDATA_ERROR_OLD)
+				{
+					st.old++;
+					last[t] = 0;
+					continue;
+				}
+
+				if (status != NGS_GETDATA_SUCCESS) continue;
+
+				const int64_t t1 = now();
+				if (!proxy.page(&buf[0], buf.size()))
+				{
+					st.errors++;
+					continue;
+				}
+				st.pageUs.push_back((now() - t1) / 1000);
+
+				last[t] = reinterpret_cast<const CKleinType3Header*>(&buf[0])->pingNumber;
+				st.pages++;
+				st.bytes += bytes;
+				got = true;
+			}
+
+			if (!got) usleep(1000);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "client: " << e.what() << std::endl;
+	}
+}
+
+// the pages of a ping, the PageTypes sizes, each with its header
+class Pages
+{
+	public:
+		Pages(const size_t bytes)
+		{
+			// LF and 3511 an eighth each, 3503 half, HF a quarter
+			static const size_t share[] = { 1, 4, 1, 2 };
+
+			for (int t = 0; t < PageTypes::count; t++)
+			{
+				const size_t n = std::max(sizeof(CKleinType3Header), bytes * share[t % 4] / 8);
+
+				_pages.push_back(std::vector<uint8_t>(n, t + 1));
+
+				CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(&_pages[t][0]);
+				memset(h, 0, sizeof(*h));
+				h->pageVersion = PageTypes::info[t].version;
+				h->numberBytes = n;
+			}
+		}
+
+		// a ping's pages into the proxy
+		inline void feed(TpuProxy& proxy, const uint32_t ping)
+		{
+			for (auto& p : _pages)
+			{
+				reinterpret_cast<CKleinType3Header*>(&p[0])->pingNumber = ping;
+				proxy.cache(&p[0], p.size());
+			}
+		}
+
+		inline size_t bytes() const
+		{
+			size_t n = 0;
+			for (const auto& p : _pages) n += p.size();
+			return n;
+		}
+
+	private:
+		std::vector<std::vector<uint8_t> > _pages;
+};
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[-a --address socket|[host]:port]"
+		<< "[-c --clients n,n,...]"
+		<< "[--secs seconds]"
+		<< "[--bytes ping bytes]"
+		<< "[--history pings]"
+		<< "[--rate pings a second]"
+		<< std::endl;
+	std::cerr << "\tdefault: -a /tmp/proxybench.sock -c 1,2,4,8,16 --secs 3"
+		<< " --bytes 524288 --history 64 --rate 50" << std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	std::string address("/tmp/proxybench.sock");
+	std::string counts("1,2,4,8,16");
+	double secs = 3;
+	size_t bytes = 512 << 10;
+	size_t history = 64;
+	uint32_t rate = 50;
+
+	try
+	{
+		ops >> GetOpt::Option('a', "address", address, address)
+			>> GetOpt::Option('c', "clients", counts, counts)
+			>> GetOpt::Option("secs", secs, secs)
+			>> GetOpt::Option("bytes", bytes, bytes)
+			>> GetOpt::Option("history", history, history)
+			>> GetOpt::Option("rate", rate, rate);
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	std::vector<int> clients;
+	{
+		std::istringstream is(counts);
+		std::string s;
+		while (std::getline(is, s, ','))
+			clients.push_back(atoi(s.c_str()));
+	}
+
+	if (clients.empty() || secs <= 0)
+	{
+		usage(av[0]);
+		return -1;
+	}
+
+	Pages pages(bytes);
+	const int64_t interval = rate ? 1000000000 / rate : 0;
+
+	std::cout << "# address=" << address << " bytes=" << pages.bytes()
+		<< " history=" << history << " rate=" << rate << std::endl;
+
+	for (const int n : clients)
+	{
+		try
+		{
+			TpuProxy proxy(history);
+			proxy.start(address);
+
+			std::atomic<bool> done(false);
+			std::vector<ClientStats> stats(n);
+			std::vector<std::thread> threads;
+
+			for (int i = 0; i < n; i++)
+				threads.push_back(std::thread(client, address, std::ref(done), std::ref(stats[i])));
+
+			// the clients are connected before the first ping
+			while (proxy.stats().clients < (uint64_t)n)
+				usleep(1000);
+
+			const int64_t start = now();
+			const int64_t end = start + (int64_t)(secs * 1e9);
+			uint32_t pings = 0;
+
+			while (now() < end)
+			{
+				if (interval)
+				{
+					const int64_t wait = start + pings * interval - now();
+					if (wait > 0) usleep(wait / 1000);
+				}
+
+				pages.feed(proxy, ++pings);
+			}
+
+			const double elapsed = (now() - start) / 1e9;
+
+			// let the clients pick up the last of them
+			usleep(100000);
+			done = true;
+
+			for (auto& t : threads) t.join();
+
+			ClientStats all;
+			uint64_t got = UINT64_MAX, old = 0;
+
+			for (auto& s : stats)
+			{
+				all.pages += s.pages;
+				all.bytes += s.bytes;
+				all.errors += s.errors;
+				all.infoUs.insert(all.infoUs.end(), s.infoUs.begin(), s.infoUs.end());
+				all.pageUs.insert(all.pageUs.end(), s.pageUs.begin(), s.pageUs.end());
+
+				got = std::min(got, s.pages);
+				old = std::max(old, s.old);
+			}
+
+			std::cout << "clients=" << n
+				<< std::fixed << std::setprecision(1)
+				<< " secs=" << elapsed
+				<< " pings=" << pings
+				<< " pages_s=" << all.pages / elapsed
+				<< " mb_s=" << all.bytes / elapsed / 1e6
+				<< " info_p50_us=" << percentile(all.infoUs, 50)
+				<< " info_p99_us=" << percentile(all.infoUs, 99)
+				<< " page_p50_us=" << percentile(all.pageUs, 50)
+				<< " page_p99_us=" << percentile(all.pageUs, 99)
+				<< " got=" << (n ? got : 0)
+				<< " old=" << old;
+			if (all.errors) std::cout << " errors=" << all.errors;
+			std::cout << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "failed: " << e.what() << std::endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -3,18 +3,23 @@
 #include <iomanip>
 #include <unistd.h>
 #include <stdint.h>
+#include <memory>
+#include <stdexcept>
 
 #include "KleinSonar.h"
 #include "Recorder.h"
 #include "PageFetcher.h"
 #include "PageWriter.h"
+#include "FetchThread.h"
+#include "PageTypes.h"
+#include "Metrics.h"
 
 const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/Recorder.cpp#1 $";
 
 namespace klein
 {
-	// from main.cpp
-	extern bool shutdown;
+	// from Util.cpp
+	extern std::atomic<bool> shutdown;
 	extern void writePage(const uint8_t*, const size_t);
 	extern void printTime(std::ostream&);
 	extern std::ostream& printError(TPU_HANDLE tpu, std::ostream& os);
@@ -42,23 +47,44 @@ Recorder::~Recorder(void)
 //-------------------------------------------------------------------------------------
 const int Recorder::execute()
 {
+	if (_config.threaded) return executeThreaded();
+
 	connectToTPU();
 
-	PageFetcher pf3501(*this, NGS_PAGE_TYPE_3500_UUV_LF); // low freq, 21
-	PageFetcher pf3502(*this, NGS_PAGE_TYPE_3500_UUV_HF); // high freq, 22
-	PageFetcher pf3503(*this, NGS_PAGE_TYPE_3500_UUV_BATHY_PC); // raw bathy, 23
-	PageFetcher pf3511(*this, 24); // proc bathy, 24
-	// PageFetcher pf3511(*this, NGS_PAGE_TYPE_3500_UUV_BATHY); // proc bathy, 24
+	// a fetcher per page type, in write order
+	std::unique_ptr<PageFetcher> fetchers[PageTypes::count];
+	for (int t = 0; t < PageTypes::count; t++)
+		fetchers[t].reset(new PageFetcher(*this, PageTypes::info[t].pageType));
 
 	// instantiate a writer
 	_pageWriter = new PageWriter(*this);
 
-	// write invokes this chain:
-	// pf.write() -> recorder.write(p,n) -> pw.write(p,n)
+	// the proxy's clients share this connection, the TPU sees only us
+	startProxy();
+
+	// write invokes this chain, the page is moved not copied:
+	// pf.takePage() -> recorder.passPage(page) -> pw.write(page)
+
+	// the TPU's errors are const char*, anything else std::exception,
+	// either way reconnect and start the fetchers over
+	const auto recover = [&](const char* e)
+	{
+		std::cerr << "Caught: " << e << std::endl;
+		Metrics::instance().reconnect();
+		{
+			Metrics::Timer t(Metrics::reopen);
+			disconnectFromTPU();
+			connectToTPU();
+		}
+		_tpuSettings.invalidate();
+		for (auto& pf : fetchers) pf->reset();
+	};
 
 	// get pages loop
 	while (!shutdown)
 	{
+		size_t pages = 0;
+
 		try
 		{
 			// remember when we start fetching
@@ -67,33 +93,124 @@ const int Recorder::execute()
 			// update record settings
 			_pageWriter->update();
 
-			// only bother if we are recording
-			if (_pageWriter->record())
+			const bool record = _pageWriter->record();
+
+			// only bother if we are recording, or serving
+			if (record || _proxy)
 			{
 				// while we fetch a page, write it
-				while (pf3501.fetchPage()) pf3501.writePage();
-				while (pf3503.fetchPage()) pf3503.writePage();
-				while (pf3511.fetchPage()) pf3511.writePage();
-				while (pf3502.fetchPage()) pf3502.writePage();
+				for (auto& pf : fetchers)
+					while (pf->fetchPage()) { passPage(pf->takePage(), record); pages++; }
 
-				_pageWriter->flush();
+				if (record) _pageWriter->flush();
 			}
 
 			// sleep until next expected ping
-			nap();
+			nap(pages != 0);
 		}
 		catch (const char*& e)
 		{
-			std::cerr << "Caught: " << e << std::endl;
+			recover(e);
+		}
+		catch (const std::exception& e)
+		{
+			recover(e.what());
+		}
+	}
+
+	stopProxy();
+
+	disconnectFromTPU();
+
+	return 0;
+}
+//-------------------------------------------------------------------------------------
+// Recorder::executeThreaded()
+//-------------------------------------------------------------------------------------
+const int Recorder::executeThreaded()
+{
+	// same pages as execute(), but each page type is fetched on its own
+	// thread and connection. this thread only assembles and writes.
+
+	connectToTPU();
+
+	// instantiate a writer
+	_pageWriter = new PageWriter(*this);
+
+	// pages from all the fetch threads, but each has its own connection
+	startProxy();
+
+	const size_t qs = _config.fetchQueueSize;
+
+	// keep the serial write order
+	std::unique_ptr<FetchThread> fetchers[PageTypes::count];
+	for (int t = 0; t < PageTypes::count; t++)
+		fetchers[t].reset(new FetchThread(*this, PageTypes::info[t].pageType, qs));
+
+	for (auto& f : fetchers) f->start();
+
+	PageRef page;
+
+	// as execute(), but the fetch threads look after their own connections
+	const auto recover = [this](const char* e)
+	{
+		std::cerr << "Caught: " << e << std::endl;
+		Metrics::instance().reconnect();
+		{
+			Metrics::Timer t(Metrics::reopen);
 			disconnectFromTPU();
 			connectToTPU();
-			pf3501.reset(); 
-			pf3502.reset();
-			pf3503.reset(); 
-			pf3511.reset();
+		}
+		_tpuSettings.invalidate();
+	};
+
+	while (!shutdown)
+	{
+		size_t pages = 0;
+
+		try
+		{
+			// remember when we start draining
+			setStartTime();
+
+			// update record settings
+			_pageWriter->update();
+
+			const bool record = _pageWriter->record();
+
+			for (auto& f : fetchers)
+			{
+				f->record(record || _proxy);
+
+				// drain whatever this page type has queued, pages
+				// queued before recording stopped are only served
+				while (f->pop(page))
+				{
+					passPage(std::move(page), record);
+					page.reset();
+					pages++;
+				}
+			}
+
+			if (record) _pageWriter->flush();
+
+			// sleep until next expected ping
+			nap(pages != 0);
+		}
+		catch (const char*& e)
+		{
+			recover(e);
+		}
+		catch (const std::exception& e)
+		{
+			recover(e.what());
 		}
 	}
 
+	for (auto& f : fetchers) f->stop();
+
+	stopProxy();
+
 	disconnectFromTPU();
 
 	return 0;
@@ -101,7 +218,7 @@ const int Recorder::execute()
 //-------------------------------------------------------------------------------------
 // Recorder::connectToTPU()
 //-------------------------------------------------------------------------------------
-void Recorder::connectToTPU()
+void Recorder::connectToTPU(TPU_HANDLE& handle)
 {
 	DLLErrorCode errorCode = NGS_NO_CONNECTION_WITH_TPU;
 
@@ -117,15 +234,15 @@ void Recorder::connectToTPU()
 		if (_useBlockingSockets)
 		{
 			// cast away const :(
-			_tpuHandle = DllOpenTheTpu(config, (char *)_spuIP.c_str(), &protocolVersion);
+			handle = DllOpenTheTpu(config, (char *)_spuIP.c_str(), &protocolVersion);
 		}
 		else
 		{
 			static const U32 connectTimeoutMs = 250;
-			_tpuHandle = DllOpenTheTpuNonBlocking(config, (char *)_spuIP.c_str(), connectTimeoutMs, &protocolVersion);
+			handle = DllOpenTheTpuNonBlocking(config, (char *)_spuIP.c_str(), connectTimeoutMs, &protocolVersion);
 		}
 
-		DllGetLastError(_tpuHandle, &errorCode);
+		DllGetLastError(handle, &errorCode);
 
 		switch(errorCode)
 		{
@@ -138,19 +255,19 @@ void Recorder::connectToTPU()
 				printTime(std::cerr);
 				std::cerr << " - No connection with TPU " << std::endl; 
 				// need to free the TPUHandle on failure
-				disconnectFromTPU(); 
+				disconnectFromTPU(handle); 
 				break;
 			case NGS_MASTER_ALREADY_CONNECTED:
 				printTime(std::cerr);
 				std::cerr << " - Master already connected " << std::endl; 
 				// need to free the TPUHandle on failure
-				disconnectFromTPU();
+				disconnectFromTPU(handle);
 				break;
 			default:
 				printTime(std::cerr);
 				std::cerr << " - Error code: " << errorCode << std::endl;
 				// need to free the TPUHandle on failure
-				disconnectFromTPU();
+				disconnectFromTPU(handle);
 				break;
 		}
 
@@ -164,21 +281,21 @@ lowerAlarm:
 //-------------------------------------------------------------------------------------
 // Recorder::disconnectFromTPU()
 //-------------------------------------------------------------------------------------
-void Recorder::disconnectFromTPU()
+void Recorder::disconnectFromTPU(TPU_HANDLE& handle)
 {
-	if (_tpuHandle == NULL)	//Nothing to do, already disconnected
+	if (handle == NULL)	//Nothing to do, already disconnected
 		return;
 
 	try
 	{
-		DllCloseTheTpu(_tpuHandle);
+		DllCloseTheTpu(handle);
 	}
 	catch (...)
 	{
 		std::cerr << "Connection to the TPU was not properly closed." << std::endl;
 	}
 
-	_tpuHandle = NULL;	
+	handle = NULL;	
 }
 //-------------------------------------------------------------------------------------
 // Recorder::checkStatus()
@@ -208,78 +325,86 @@ void Recorder::checkStatus(const BoolStat status)
 //-------------------------------------------------------------------------------------
 void Recorder::setStartTime()
 {
-	struct timespec current_ts;
+	_scheduler.start();
+}
+//-------------------------------------------------------------------------------------
+// Recorder::nap()
+//-------------------------------------------------------------------------------------
+void Recorder::nap(const bool gotPage)
+{
+	Metrics::Timer t(Metrics::nap);
+
+	// let the scheduler learn from this pass, then sleep until just
+	// before the next ping is expected
+	_tpuSettings.refresh(_tpuHandle);
+	_scheduler.interval(_tpuSettings.pingInterval());
+
+	_scheduler.finish(gotPage);
 
-	if (clock_gettime(CLOCK_MONOTONIC, &current_ts) == -1)
+	// Debug dump
+	if (0)
 	{
-		throw "clock_gettime() failed";
+		std::ostringstream os;
+		os << " " << _scheduler;
+		printTime(std::cout);
+		std::cout << os.str() << std::endl;
 	}
 
-	_startFetchTime_nsec = current_ts.tv_nsec;
+	_scheduler.sleep();
 }
 //-------------------------------------------------------------------------------------
-// Recorder::nap()
+// Recorder::writePage()
 //-------------------------------------------------------------------------------------
-void Recorder::nap()
+void Recorder::writePage(PageRef&& p)
 {
-	// fetch the ping interval,
-	// delta time from start
-	// nap for inter ping period - delta time
-	//
-	// TODO - there will be some timing errors introduced here
-	// it may be useful to accumulate errors and compare exepected 
-	// versus actual, maybe filter
-	// the nap period, maybe consider fetch status of pages,
-	// etc.
-
-	static U32 ipp_msec = 0; // ms
-
-	if (DllGetTheTpuPingInterval(_tpuHandle, &ipp_msec) != NGS_SUCCESS)
-	{
-		usleep(1e5); // default, rather kind to tpu
-		return;
-	}
+	_pageWriter->writePage(std::move(p));
+}
+//-------------------------------------------------------------------------------------
+// Recorder::passPage()
+//-------------------------------------------------------------------------------------
+void Recorder::passPage(PageRef&& p, const bool record)
+{
+	if (!p) return;
 
-	struct timespec current_ts;
-	if (clock_gettime(CLOCK_MONOTONIC, &current_ts) == -1)
+	if (_proxy)
 	{
-		throw "clock_gettime() failed";
+		Metrics::Timer t(Metrics::proxy);
+		_proxy->cache(p->data, p->length);
 	}
 
-	// find delta
-	{
-		long delta_nsec = current_ts.tv_nsec - _startFetchTime_nsec;
-
-		if (delta_nsec < 0)
-		{
-			delta_nsec += 1e9;
-		}
+	if (record) _pageWriter->writePage(std::move(p));
+}
+//-------------------------------------------------------------------------------------
+// Recorder::startProxy()
+//-------------------------------------------------------------------------------------
+void Recorder::startProxy()
+{
+	if (_config.proxy.address.empty()) return;
 
-		const long nap_usec = (ipp_msec * 1e3) - (delta_nsec / 1e3);
+	// the recording matters more, carry on without it
+	try
+	{
+		_proxy.reset(new TpuProxy(_config.proxy.history));
+		_proxy->start(_config.proxy.address);
 
-		// Debug dump
-		if (0)
-		{
-			std::ostringstream os;
-			os << " ipp(ms): " << ipp_msec
-				<< ", start(ns): " << _startFetchTime_nsec
-				<< ", curr(ns): " << current_ts.tv_nsec
-				<< ", delta(ns): " << delta_nsec
-				<< ", nap(us): " << nap_usec
-				;
-			printTime(std::cout);
-			std::cout << os.str() << std::endl;
-		}
-		
-		// don't ever go back in time
-		if (nap_usec > 0)
-			usleep(nap_usec);
+		printTime(std::cout);
+		std::cout << " - Serving pages on " << _config.proxy.address << std::endl;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		_proxy.reset();
 	}
 }
 //-------------------------------------------------------------------------------------
-// Recorder::writePage()
+// Recorder::stopProxy()
 //-------------------------------------------------------------------------------------
-void Recorder::writePage(const uint8_t* p, const size_t n)
+void Recorder::stopProxy()
 {
-	_pageWriter->writePage(p, n);
+	if (!_proxy) return;
+
+	_proxy->stop();
+
+	printTime(std::cout);
+	std::cout << " - " << _proxy->stats() << std::endl;
 }
@@ -7,8 +7,16 @@
 
 #include <ostream>
 #include <string>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
 
 #include "KleinSonar.h"
+#include "RecorderConfig.h"
+#include "PingScheduler.h"
+#include "PagePool.h"
+#include "TpuSettings.h"
+#include "TpuProxy.h"
 
 
 namespace klein
@@ -21,9 +29,10 @@ class Recorder
 
 public:
 
-	Recorder(const std::string& spu, const bool& bs) : 
+	Recorder(const std::string& spu, const bool& bs,
+			const RecorderConfig& c = RecorderConfig()) : 
 		_tpuHandle(NULL), _spuIP(spu), _useBlockingSockets(bs),
-		_startFetchTime_nsec(0), _pageWriter(NULL) {}
+		_config(c), _pagePool(c.pingQueueSize), _pageWriter(NULL) {}
 
 	virtual ~Recorder(void);
 
@@ -31,24 +40,58 @@ public:
 
 	inline TPU_HANDLE tpuHandle() { return _tpuHandle; }
 
+	inline const RecorderConfig& config() const { return _config; }
+
+	// cached TPU parameters, refreshed by this thread
+	inline TpuSettings& tpuSettings() { return _tpuSettings; }
+
+	// last ping interval from the TPU, 0 if unknown
+	inline uint32_t pingInterval() const { return _tpuSettings.pingInterval(); }
+
+	// also used by the fetch threads for their own connections
+	void connectToTPU(TPU_HANDLE& handle);
+	void disconnectFromTPU(TPU_HANDLE& handle);
+
 	void checkStatus(const BoolStat status);
 
-	void writePage(const uint8_t* p, const size_t n);
+	void writePage(PageRef&& p);
+
+	// a fetched page to the proxy, if serving, then the writer, if
+	// recording
+	void passPage(PageRef&& p, const bool record);
+
+	// page arena for the fetchers, a slab per Policy ping slot,
+	// regions come back once written
+	inline PagePool& pagePool() { return _pagePool; }
 
 private:
 
-	void connectToTPU();
-	void disconnectFromTPU();
+	const int executeThreaded();
+
+	inline void connectToTPU() { connectToTPU(_tpuHandle); }
+	inline void disconnectFromTPU() { disconnectFromTPU(_tpuHandle); }
 	void setStartTime();
-	void nap();
+	void nap(const bool gotPage);
+	void startProxy();
+	void stopProxy();
 
 	TPU_HANDLE _tpuHandle;
 	const std::string _spuIP;
 	const bool _useBlockingSockets;
-	long _startFetchTime_nsec;
+	const RecorderConfig _config;
+
+	// when to fetch next
+	PingScheduler _scheduler;
+	TpuSettings _tpuSettings;
+
+	// must outlive the writer and fetchers
+	PagePool _pagePool;
 
 	klein::PageWriter* _pageWriter;
 
+	// serving the pages fetched, NULL if not
+	std::unique_ptr<TpuProxy> _proxy;
+
 	friend std::ostream& operator << (std::ostream& out, const Recorder& s);
 };
 
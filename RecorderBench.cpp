@@ -0,0 +1,510 @@
+// microbenchmarks of the recorder's per ping work, so a change that
+// makes a ping dearer shows up before it gets to a vehicle.
+//
+//   policy_*         Policy::writePage() of a ping's pages, in order,
+//                    shuffled within 8 pings, or with 5% of them lost
+//   write_pings      Policy::writePings() of a queue of pings
+//   file_write       PageWriter::fileWrite() of a marker and a page
+//   write_for_real   PageWriter::fileWriteForReal() of a batch
+//   add_bathy_sdfx   PageWriter::addBathySdfx() onto a page
+//   print_time       printTime() into a stream
+//   settings_equal   the DiskRecordingSettings operator ==
+//
+// the writer is a real one, with its io thread, writing to /dev/null,
+// and its TPU is the TpuShim. pages come from the recorder's pool, as
+// the fetchers get them. arrivals are shuffled and lost from the seed,
+// so runs compare.
+//
+// one line a benchmark, allocs are operator news on the timing thread:
+//
+//   bench=policy_in_order bytes=4096 ops=100000 ns_op=412.8 allocs_op=0.00
+//
+// the RecorderBench configuration builds it, with every .cpp of the
+// recorder but main.cpp, and links libTpuShim.a from the TpuShim
+// configuration instead of the Klein SDK
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/RecorderBench.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "PageWriter.h"
+#include "PageTypes.h"
+#include "Recorder.h"
+#include "TpuShim.h"
+#include "ToolUtil.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+	extern bool operator == (const DiskRecordingSettings& lhs, const DiskRecordingSettings& rhs);
+}
+
+using namespace klein;
+
+// operator news on this thread
+static thread_local uint64_t allocs = 0;
+
+void* operator new(size_t n)
+{
+	allocs++;
+
+	void* p = malloc(n ? n : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+// what one benchmark took
+struct Result
+{
+	Result(const std::string& n, const size_t b = 0) :
+		name(n), bytes(b), ops(0), ns(0), allocs(0) {}
+
+	std::string name;
+	size_t bytes;		// page size, 0 if it doesn't matter
+	uint64_t ops;
+	int64_t ns;
+	uint64_t allocs;
+};
+
+// the time and allocations of what it is around
+class Timer
+{
+	public:
+		Timer(Result& r) : _r(r), _allocs(allocs), _start(now()) {}
+		~Timer()
+		{
+			_r.ns += now() - _start;
+			_r.allocs += allocs - _allocs;
+		}
+
+	private:
+		Result& _r;
+		const uint64_t _allocs;
+		const int64_t _start;
+};
+
+static void report(std::ostream& out, const Result& r)
+{
+	const double ops = r.ops ? r.ops : 1;
+
+	out << "bench=" << r.name
+		<< " bytes=" << r.bytes
+		<< " ops=" << r.ops
+		<< std::fixed << std::setprecision(1)
+		<< " ns_op=" << r.ns / ops
+		<< std::setprecision(2)
+		<< " allocs_op=" << r.allocs / ops << std::endl;
+}
+
+// a stream that goes nowhere, for what the writer prints
+class NullBuf : public std::streambuf
+{
+	protected:
+		int overflow(int c) { return c; }
+		std::streamsize xsputn(const char*, std::streamsize n) { return n; }
+};
+
+namespace klein
+{
+
+// the benchmarks, a friend of the PageWriter and its Policy
+class RecorderBench
+{
+	public:
+
+		RecorderBench(Recorder& r, PageWriter& pw, const uint32_t seed) :
+			_r(r), _pw(pw), _rng(seed), _ping(1)
+		{
+			// everything goes to /dev/null, the index too
+			_pw._fd = open("/dev/null", O_WRONLY);
+			_pw._indexFd = open("/dev/null", O_WRONLY);
+			_pw._numPings = 1;
+
+			if (_pw._fd < 0 || _pw._indexFd < 0) throw "Couldn't open /dev/null";
+		}
+
+		// pings of 4 pages arriving: in order, shuffled within window
+		// pings, lossy in a hundred lost
+		Result policy(const std::string& name, const size_t bytes, const uint64_t pings,
+				const size_t window, const double lossy)
+		{
+			// the arrivals, worked out up front
+			std::vector<std::pair<uint32_t, int> > arrivals;
+			arrivals.reserve(pings * PageTypes::count);
+
+			std::bernoulli_distribution lose(lossy / 100.0);
+
+			for (uint64_t i = 0; i < pings; i++)
+				for (int t = 0; t < PageTypes::count; t++)
+					if (!lossy || !lose(_rng))
+						arrivals.push_back(std::make_pair(_ping + i, t));
+
+			if (window > 1)
+			{
+				for (size_t i = 0; i < arrivals.size(); i += window * PageTypes::count)
+				{
+					const size_t end = std::min(arrivals.size(), i + window * PageTypes::count);
+					std::shuffle(arrivals.begin() + i, arrivals.begin() + end, _rng);
+				}
+			}
+
+			Result r(name, bytes);
+			r.ops = pings;
+			_ping += pings;
+
+			// a few pings' pages at a time, as the fetchers would have them
+			std::vector<PageRef> ps;
+
+			for (size_t i = 0; i < arrivals.size(); )
+			{
+				ps.clear();
+				for (const size_t end = std::min(arrivals.size(), i + 64); i < end; i++)
+					ps.push_back(page(arrivals[i].first, arrivals[i].second, bytes));
+
+				Timer t(r);
+				for (auto& p : ps)
+					_pw._policy->writePage(std::move(p));
+			}
+
+			// what is still queued, incomplete pings
+			{
+				Timer t(r);
+				_pw._policy->writePings(_ping - 1);
+				_pw.fileWriteForReal();
+			}
+			return r;
+		}
+
+		// a queue of pings, missing a page so they wait, written at once
+		Result writePings(const size_t bytes, const uint64_t pings)
+		{
+			Result r("write_pings", bytes);
+
+			const uint32_t n = _pw._policy->capacity() - 1;
+
+			for (uint64_t done = 0; done < pings; done += n)
+			{
+				// no HF page, none are ready
+				for (uint32_t i = 0; i < n; i++)
+					for (int t = 0; t < PageTypes::count; t++)
+						if (PageTypes::info[t].version != HighFrequency::version)
+							_pw._policy->writePage(page(_ping + i, t, bytes));
+
+				_ping += n;
+				r.ops += n;
+
+				Timer t(r);
+				_pw._policy->writePings(_ping - 1);
+			}
+
+			_pw.fileWriteForReal();
+			return r;
+		}
+
+		// a marker and a page onto the batch, handed over when full
+		Result fileWrite(const size_t bytes, const uint64_t pages)
+		{
+			static const uint32_t pm = 0xffffffff;
+
+			Result r("file_write", bytes);
+
+			std::vector<PageRef> ps;
+
+			for (uint64_t done = 0; done < pages; done += ps.size())
+			{
+				ps.clear();
+				for (int i = 0; i < 16; i++)
+					ps.push_back(page(_ping++, 0, bytes));
+
+				Timer t(r);
+				for (auto& p : ps)
+				{
+					_pw.fileWrite((const uint8_t*)&pm, sizeof(pm));
+					_pw.fileWrite(std::move(p));
+				}
+				r.ops += ps.size();
+			}
+
+			_pw.fileWriteForReal();
+			return r;
+		}
+
+		// a batch of pages handed to the io thread
+		Result writeForReal(const size_t bytes, const uint64_t batches)
+		{
+			static const uint32_t pm = 0xffffffff;
+
+			Result r("write_for_real", bytes);
+
+			// as many as fit without the batch going by itself
+			const size_t n = std::max<size_t>(1, std::min<size_t>(16,
+						_pw._batchLimit / (bytes + sizeof(pm)) - 1));
+
+			for (uint64_t i = 0; i < batches; i++)
+			{
+				for (size_t j = 0; j < n; j++)
+				{
+					_pw.fileWrite((const uint8_t*)&pm, sizeof(pm));
+					_pw.fileWrite(page(_ping++, 0, bytes));
+				}
+
+				Timer t(r);
+				_pw.fileWriteForReal();
+				r.ops++;
+			}
+			return r;
+		}
+
+		// the bathy sdfx onto a 3503, the page is put back each time
+		Result addBathySdfx(const size_t bytes, const uint64_t n)
+		{
+			Result r("add_bathy_sdfx", bytes);
+
+			const int t = PageTypes::slot(RawBathy::version);
+			PageRef p = page(_ping++, t, bytes);
+
+			// the records are got from the TPU once
+			_pw.bathySdfx();
+
+			for (uint64_t i = 0; i < n; i++)
+			{
+				sdfx(p, bytes);
+
+				Timer tm(r);
+				PageRef x = _pw.addBathySdfx(p);
+			}
+			r.ops = n;
+			return r;
+		}
+
+	private:
+		// no copy or operator = ctors
+		RecorderBench(const RecorderBench& rhs);
+		RecorderBench& operator = (const RecorderBench& rhs);
+
+		// a page of type t as the TPU sends it, in its ping's slab
+		PageRef page(const uint32_t ping, const int t, const size_t bytes)
+		{
+			PageRef p = _r.pagePool().acquire(bytes, PageTypes::info[t].pageType, ping);
+
+			CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(p->data);
+			memset(h, 0, sizeof(*h));
+			h->pageVersion = PageTypes::info[t].version;
+			h->pingNumber = ping;
+			h->headerSize = sizeof(*h);
+			h->capabilityMask = SYS_CAP_BATHY;
+
+			sdfx(p, bytes);
+			return p;
+		}
+
+		// the sdfx size and an END record on the end of the page
+		static void sdfx(PageRef& p, const size_t bytes)
+		{
+			CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(p->data);
+
+			const U32 n = sizeof(U32) + sizeof(SDFX_RECORD_HEADER);
+			h->numberBytes = bytes;
+			h->sdfExtensionSize = n;
+
+			SDFX_RECORD_HEADER end;
+			memset(&end, 0, sizeof(end));
+			end.recordId = SDFX_RECORD_ID_END;
+			end.recordNumBytes = sizeof(end);
+			end.headerVersion = SDFX_HEADER_VERSION_1;
+			end.recordVersion = SDFX_RECORD_VERSION_END;
+
+			memcpy(p->data + bytes - n, &n, sizeof(n));
+			memcpy(p->data + bytes - sizeof(end), &end, sizeof(end));
+			p->length = bytes;
+		}
+
+		Recorder& _r;
+		PageWriter& _pw;
+		std::mt19937 _rng;
+		uint32_t _ping;
+};
+
+} // namespace klein
+
+static Result printTimes(const uint64_t n)
+{
+	Result r("print_time");
+	std::ostringstream os;
+
+	Timer t(r);
+	for (uint64_t i = 0; i < n; i++)
+	{
+		os.str("");
+		printTime(os);
+	}
+	r.ops = n;
+	return r;
+}
+
+static Result settingsEqual(const uint64_t n)
+{
+	Result r("settings_equal");
+
+	// equal, so all of it is compared
+	DiskRecordingSettings a = TpuShim::instance().settings();
+	DiskRecordingSettings b = a;
+
+	volatile uint64_t same = 0;
+
+	Timer t(r);
+	for (uint64_t i = 0; i < n; i++)
+		same += (a == b);
+
+	r.ops = n;
+	return r;
+}
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[--ops n]"
+		<< "[--seed n]"
+		<< "[--only name]"
+		<< "[-v --verbose]"
+		<< std::endl;
+	std::cerr << "\tdefault: --ops 100000 --seed 1" << std::endl;
+	std::cerr << "\t--only runs the benchmarks whose names start with name,"
+		<< " -v shows what the writer prints" << std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	uint64_t n = 100000;
+	uint32_t seed = 1;
+	std::string only;
+	bool verbose = false;
+
+	try
+	{
+		ops >> GetOpt::Option("ops", n, n)
+			>> GetOpt::Option("seed", seed, seed)
+			>> GetOpt::Option("only", only, only)
+			>> GetOpt::OptionPresent('v', "verbose", verbose);
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	if (!n)
+	{
+		usage(av[0]);
+		return -1;
+	}
+
+	// the results go out, not what the writer has to say
+	std::streambuf* const console = std::cout.rdbuf();
+	std::streambuf* const errors = std::cerr.rdbuf();
+	std::ostream out(console);
+	NullBuf null;
+	if (!verbose)
+	{
+		std::cout.rdbuf(&null);
+		std::cerr.rdbuf(&null);
+	}
+
+	const auto wanted = [&](const std::string& name)
+	{
+		return only.empty() || !name.compare(0, only.size(), only);
+	};
+
+	out << "# seed=" << seed << " ops=" << n << std::endl;
+
+	// a writer that never writes a file, with its own io thread
+	{
+		TpuShim& shim = TpuShim::instance();
+		DiskRecordingSettings s = shim.settings();
+		strncpy(s.szFilePath, "/tmp", sizeof(s.szFilePath) - 1);
+		shim.settings(s);
+	}
+
+	RecorderConfig config;
+	config.durability.mode = Durability::none;
+
+	try
+	{
+		Recorder recorder("bench", true, config);
+		PageWriter pw(recorder);
+		RecorderBench b(recorder, pw, seed);
+
+		const size_t sizes[] = { 4096, 65536, 262144 };
+
+		// once through untimed, so the pool's slabs are their size
+		b.policy("warmup", sizes[2], 256, 0, 0);
+
+		if (wanted("policy_in_order"))
+			report(out, b.policy("policy_in_order", 4096, n, 0, 0));
+		if (wanted("policy_out_of_order"))
+			report(out, b.policy("policy_out_of_order", 4096, n, 8, 0));
+		if (wanted("policy_lossy"))
+			report(out, b.policy("policy_lossy", 4096, n, 0, 5));
+		if (wanted("write_pings"))
+			report(out, b.writePings(4096, n));
+
+		for (const size_t bytes : sizes)
+		{
+			if (wanted("file_write"))
+				report(out, b.fileWrite(bytes, std::max<uint64_t>(16, n * 4096 / bytes)));
+			if (wanted("write_for_real"))
+				report(out, b.writeForReal(bytes, std::max<uint64_t>(16, n * 4096 / bytes / 16)));
+		}
+
+		if (wanted("add_bathy_sdfx"))
+			report(out, b.addBathySdfx(sizes[2], n));
+	}
+	catch (const char* e)
+	{
+		out << "# failed: " << e << std::endl;
+		n = 0;
+	}
+
+	if (n && wanted("print_time"))
+		report(out, printTimes(n));
+	if (n && wanted("settings_equal"))
+		report(out, settingsEqual(n * 10));
+
+	std::cout.rdbuf(console);
+	std::cerr.rdbuf(errors);
+
+	return n ? 0 : -1;
+}
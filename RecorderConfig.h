@@ -0,0 +1,130 @@
+#ifndef _KLEIN_RECORDER_CONFIG_H_
+#define _KLEIN_RECORDER_CONFIG_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/RecorderConfig.h#1 $
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "PageTypes.h"
+
+namespace klein
+{
+
+// a page type's completion deadline, either milliseconds or ping
+// intervals. 0 is no deadline.
+struct Deadline
+{
+	Deadline() : value(0), pings(false) {}
+
+	uint32_t value;
+	bool pings;		// value is in ping intervals
+};
+
+// how hard the written data is pushed to the disk, i.e. how much can
+// be lost if the power goes
+//   none      - left to the kernel's writeback, even on close
+//   datasync  - fdatasync() the data file once bytes have been written
+//               or msec has passed since the first unsynced write
+//   writeback - start writeback of every bytes written, and wait for
+//               the chunk before it, so at most two chunks are dirty
+//               without the journal commit of a datasync
+// either way a file is fdatasync'd when it is closed.
+struct Durability
+{
+	enum Mode { none, datasync, writeback };
+
+	Durability() : mode(datasync), bytes(8 << 20), msec(1000) {}
+
+	Mode mode;
+	size_t bytes;
+	uint32_t msec;		// datasync only, 0 for no time limit
+};
+
+// how the io thread gets batches to the disk
+//   writev - writev() the batch, looping on short writes
+//   uring  - io_uring, a linked chain of writes per batch, the page
+//            arena registered as fixed buffers when the memlock limit
+//            allows. falls back to writev if the kernel won't do it.
+//   mmap   - copy into a mapped window of a file preallocated from
+//            the pings per file and the bytes per ping seen so far
+struct IoConfig
+{
+	enum Backend { writev, uring, mmap };
+
+	IoConfig() : backend(writev), depth(64) {}
+
+	Backend backend;
+	unsigned depth;		// uring submission queue entries
+};
+
+// the live ping bus, every ping written is also published into POSIX
+// shared memory for local readers, see PingBus.h. off without a name.
+struct BusConfig
+{
+	BusConfig() : slots(16), slotBytes(2 << 20) {}
+
+	std::string name;	// for shm_open, e.g. /klein-pings
+	size_t slots;		// pings held, rounded up to a power of two
+	size_t slotBytes;	// the biggest ping, all its pages
+};
+
+// the recorder as a TPU for local tools, the pages it fetches are held
+// and served to TpuProxyClients, see TpuProxy.h. off without an
+// address.
+struct ProxyConfig
+{
+	ProxyConfig() : history(64) {}
+
+	std::string address;	// a unix socket path or [host]:port
+	size_t history;			// pings of each type held, rounded up to a power of two
+};
+
+// run time options for the Recorder, filled in by main() from the
+// command line and handed to the Recorder at construction
+struct RecorderConfig
+{
+	RecorderConfig() : threaded(false), fetchQueueSize(64), cacheBuffers(2),
+		pingQueueSize(64), index(true) {}
+
+	// one fetch thread per page type feeding the writer thread
+	bool threaded;
+
+	// pages buffered per page type between a fetch thread and the
+	// writer, rounded up to a power of two
+	size_t fetchQueueSize;
+
+	// PageWriter cache swap buffers, at least 2, the cache is split
+	// between them
+	size_t cacheBuffers;
+
+	// pings the PageWriter::Policy holds while waiting for their pages,
+	// rounded up to a power of two
+	size_t pingQueueSize;
+
+	// data file syncing
+	Durability durability;
+
+	// data file writing
+	IoConfig io;
+
+	// write an SdfIndex next to each data file
+	bool index;
+
+	// publishing pings to local readers
+	BusConfig bus;
+
+	// serving fetched pages to local tools
+	ProxyConfig proxy;
+
+	// how long a ping waits for a missing page of each type before it
+	// is written without it, indexed by PageTypes slot. a type without a
+	// deadline waits until the ping queue is full.
+	Deadline deadline[PageTypes::count];
+};
+
+} // namespace klein
+#endif // _KLEIN_RECORDER_CONFIG_H_
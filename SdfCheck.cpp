@@ -0,0 +1,486 @@
+// checks the .sdf files under a directory, as the PageWriter writes
+// them, and their .idx page indexes.
+//
+// each file is walked marker to marker and every page is checked:
+//   - each page starts right after a 0xffffffff marker, right where
+//     the last one's numberBytes says it ends
+//   - sdfExtensionSize fits in the page and matches the size in front
+//     of the sdfx records, which end with an SDFX END record
+//   - pings don't go backwards for a page version, gaps are counted
+// a file whose last page runs off its end, or that ends in zeros (the
+// mmap backend's preallocation), is torn, anything else that isn't
+// pages is corrupt.
+//
+// the index, if there is one, must match the pages. a torn file's may
+// be stale, short of its pages or past them. with --index a missing,
+// stale or bad index is written again, from the pages that are good.
+//
+// the files are shared out over a pool of threads, biggest first, and
+// a thread that runs out takes work from the others.
+//
+//   SdfCheck -d /data/mission42 --threads 16 --index
+//
+// the SdfCheck configuration builds it, with SdfReader.cpp and
+// ToolUtil.cpp
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/SdfCheck.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "SdfReader.h"
+#include "SdfIndex.h"
+#include "ToolUtil.h"
+
+using namespace klein;
+
+// what was found in one
+struct Result
+{
+	Result() : pages(0), firstPing(0), lastPing(0), gaps(0), badSdfx(0),
+		badOrder(0), gapBytes(0), torn(false), corrupt(false) {}
+
+	uint64_t pages;
+	uint32_t firstPing;
+	uint32_t lastPing;
+	uint64_t gaps;			// pings missing between the first and last
+	uint64_t badSdfx;		// pages with a bad sdfx
+	uint64_t badOrder;		// pages whose ping went backwards
+	uint64_t gapBytes;		// bytes between pages that aren't pages
+	bool torn;
+	bool corrupt;
+	std::string index;		// ok, stale, missing, bad, built, unwritable
+	std::ostringstream detail;
+};
+
+// a check of the sdfx on the end of a page, false if it is bad
+static bool checkSdfx(const SdfReader::Page& p)
+{
+	const CKleinType3Header& h = p.header();
+	const uint32_t n = h.sdfExtensionSize;
+
+	if (!n) return true;
+
+	if (n < sizeof(uint32_t) + sizeof(SDFX_RECORD_HEADER)
+		|| n > p.length - sizeof(CKleinType3Header))
+		return false;
+
+	const uint8_t* x = p.data + p.length - n;
+
+	uint32_t size;
+	memcpy(&size, x, sizeof(size));
+	if (size != n) return false;
+
+	// records up to an END that finishes the page
+	const uint8_t* r = x + sizeof(uint32_t);
+	const uint8_t* end = p.data + p.length;
+
+	while ((size_t)(end - r) >= sizeof(SDFX_RECORD_HEADER))
+	{
+		SDFX_RECORD_HEADER rh;
+		memcpy(&rh, r, sizeof(rh));
+
+		if (rh.recordNumBytes < sizeof(rh) || rh.recordNumBytes > (size_t)(end - r))
+			return false;
+
+		r += rh.recordNumBytes;
+
+		if (rh.recordId == SDFX_RECORD_ID_END) return r == end;
+	}
+	return false;
+}
+
+// true if the n bytes at p are all zero
+static bool zeros(const uint8_t* p, const uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+		if (p[i]) return false;
+	return true;
+}
+
+// write the index for pages, next to path, in place of any there
+static bool writeIndex(const std::string& path, const std::vector<SdfIndexRecord>& pages)
+{
+	const std::string index(path + sdfIndexSuffix);
+	const std::string tmp(index + ".tmp");
+
+	const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) return false;
+
+	SdfIndexHeader h;
+	h.init();
+
+	bool ok = ::write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h);
+
+	const char* p = (const char*)pages.data();
+	size_t left = pages.size() * sizeof(SdfIndexRecord);
+
+	while (ok && left)
+	{
+		const ssize_t n = ::write(fd, p, left);
+		if (n < 0 && errno == EINTR) continue;
+		ok = n > 0;
+		if (ok)
+		{
+			p += n;
+			left -= n;
+		}
+	}
+
+	ok = (fdatasync(fd) == 0) && ok;
+	ok = (close(fd) == 0) && ok;
+
+	// a reader sees the old index or the new one, never half of one
+	ok = ok && rename(tmp.c_str(), index.c_str()) == 0;
+
+	if (!ok) unlink(tmp.c_str());
+	return ok;
+}
+
+// check one file
+static void check(const SdfFile& f, const bool build, Result& r)
+{
+	SdfReader reader(f.path, false);
+
+	// the pages as the index would have them
+	std::vector<SdfIndexRecord> pages;
+	pages.reserve(f.size / 8192);
+
+	std::vector<uint32_t> last;		// per version, last ping seen
+	std::vector<uint32_t> versions;
+
+	uint64_t expected = sizeof(uint32_t);	// where the next page should be
+	bool havePing = false;
+
+	SdfReader::Page p;
+	while (reader.next(p))
+	{
+		const CKleinType3Header& h = p.header();
+
+		if (p.offset != expected)
+		{
+			// something that isn't pages, between the last page and this
+			const uint64_t gap = p.offset - expected;
+			if (!r.gapBytes)
+				r.detail << " gap at " << expected - sizeof(uint32_t) << " (" << gap << " bytes)";
+			r.gapBytes += gap;
+			r.corrupt = true;
+		}
+		expected = p.offset + p.length + sizeof(uint32_t);
+
+		if (!checkSdfx(p))
+		{
+			if (!r.badSdfx)
+				r.detail << " bad sdfx ping " << h.pingNumber << " version " << h.pageVersion;
+			r.badSdfx++;
+			r.corrupt = true;
+		}
+
+		// ping order, per version
+		const size_t v = std::find(versions.begin(), versions.end(), h.pageVersion) - versions.begin();
+		if (v == versions.size())
+		{
+			versions.push_back(h.pageVersion);
+			last.push_back(h.pingNumber);
+		}
+		else
+		{
+			if (h.pingNumber <= last[v])
+			{
+				if (!r.badOrder)
+					r.detail << " ping " << h.pingNumber << " after " << last[v]
+						<< " version " << h.pageVersion;
+				r.badOrder++;
+				r.corrupt = true;
+			}
+			last[v] = h.pingNumber;
+		}
+
+		// gaps in the pings, of any version
+		if (!havePing)
+		{
+			r.firstPing = r.lastPing = h.pingNumber;
+			havePing = true;
+		}
+		else if (h.pingNumber > r.lastPing)
+		{
+			r.gaps += h.pingNumber - r.lastPing - 1;
+			r.lastPing = h.pingNumber;
+		}
+
+		SdfIndexRecord ir;
+		ir.offset = p.offset;
+		ir.length = p.length;
+		ir.pageVersion = h.pageVersion;
+		ir.pingNumber = h.pingNumber;
+		ir.reserved = 0;
+		ir.time_msec = sdfTime_msec(h.year, h.month, h.day, h.hour, h.minute,
+				h.second, h.hSecond);
+		pages.push_back(ir);
+
+		r.pages++;
+	}
+
+	// what's after the last page
+	const uint64_t end = expected - sizeof(uint32_t);
+	if (end < f.size)
+	{
+		const uint64_t tail = f.size - end;
+
+		const uint8_t* t = reader.file().data + end;
+
+		static const uint32_t marker = 0xffffffff;
+
+		if (zeros(t, tail) || (tail >= sizeof(marker) && !memcmp(t, &marker, sizeof(marker))))
+		{
+			r.torn = true;
+			r.detail << " torn at " << end << " (" << tail << " bytes)";
+		}
+		else
+		{
+			r.corrupt = true;
+			r.detail << " junk at " << end << " (" << tail << " bytes)";
+		}
+	}
+
+	// the index should be the pages, or short of them if torn
+	try
+	{
+		SdfReader indexed(f.path, true);
+
+		if (!indexed.indexed())
+		{
+			r.index = "missing";
+		}
+		else
+		{
+			size_t i = 0;
+			bool same = true;
+
+			SdfReader::Page q;
+			while (same && indexed.next(q))
+			{
+				same = i < pages.size() && q.offset == pages[i].offset
+					&& q.length == pages[i].length
+					&& q.version() == pages[i].pageVersion
+					&& q.pingNumber() == pages[i].pingNumber;
+				i++;
+			}
+
+			// the index and the data of a torn file may not have got
+			// to the disk together, either can be ahead
+			if (!same) r.index = "bad";
+			else if (i == pages.size() && indexed.indexedPages() == i) r.index = "ok";
+			else r.index = r.torn ? "stale" : "bad";
+		}
+	}
+	catch (const std::exception&)
+	{
+		r.index = "bad";
+	}
+
+	if (build && r.index != "ok")
+		r.index = writeIndex(f.path, pages) ? "built" : "unwritable";
+}
+
+// the files, one queue per thread, a thread takes the biggest of its
+// own and steals the smallest of someone else's
+class Pool
+{
+	public:
+
+		Pool(const size_t nFiles, const unsigned nThreads) : _queues(nThreads), _steals(0)
+		{
+			// files are sorted biggest first, dealt round the queues
+			for (size_t i = 0; i < nFiles; i++)
+				_queues[i % nThreads].files.push_back(i);
+		}
+
+		bool take(const unsigned self, size_t& file)
+		{
+			{
+				Queue& q = _queues[self];
+				std::lock_guard<std::mutex> lock(q.mutex);
+				if (!q.files.empty())
+				{
+					file = q.files.front();
+					q.files.pop_front();
+					return true;
+				}
+			}
+
+			for (size_t i = 1; i < _queues.size(); i++)
+			{
+				Queue& q = _queues[(self + i) % _queues.size()];
+				std::lock_guard<std::mutex> lock(q.mutex);
+				if (!q.files.empty())
+				{
+					file = q.files.back();
+					q.files.pop_back();
+					_steals++;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		inline uint64_t steals() const { return _steals; }
+
+	private:
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<size_t> files;
+		};
+
+		std::vector<Queue> _queues;
+		std::atomic<uint64_t> _steals;
+};
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[-d --dir path]"
+		<< "[--threads n]"
+		<< "[--index]"
+		<< "[-v --verbose]"
+		<< std::endl;
+	std::cerr << "\tdefault: -d . --threads <cores>" << std::endl;
+	std::cerr << "\t--index writes the .idx of any file whose index is missing or bad"
+		<< std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	std::string dir(".");
+	unsigned threads = std::thread::hardware_concurrency();
+	bool build = false;
+	bool verbose = false;
+
+	try
+	{
+		ops >> GetOpt::Option('d', "dir", dir, dir)
+			>> GetOpt::Option("threads", threads, threads)
+			>> GetOpt::OptionPresent("index", build)
+			>> GetOpt::OptionPresent('v', "verbose", verbose);
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	if (!threads) threads = 1;
+
+	std::vector<SdfFile> files;
+
+	if (!findSdfFiles(dir, files))
+	{
+		std::cerr << "Couldn't walk " << dir << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	std::sort(files.begin(), files.end(),
+		[](const SdfFile& a, const SdfFile& b) { return a.size > b.size; });
+
+	threads = std::min<size_t>(threads, std::max<size_t>(files.size(), 1));
+
+	Pool pool(files.size(), threads);
+
+	std::mutex out;
+	std::atomic<uint64_t> bytes(0), ok(0), torn(0), corrupt(0), failed(0), built(0);
+
+	const int64_t start = now();
+
+	const auto worker = [&](const unsigned self)
+	{
+		size_t i;
+		while (pool.take(self, i))
+		{
+			const SdfFile& f = files[i];
+			Result r;
+
+			try
+			{
+				check(f, build, r);
+			}
+			catch (const std::exception& e)
+			{
+				std::lock_guard<std::mutex> lock(out);
+				std::cerr << f.path << ": " << e.what() << std::endl;
+				failed++;
+				continue;
+			}
+
+			bytes += f.size;
+			if (r.corrupt) corrupt++;
+			else if (r.torn) torn++;
+			else ok++;
+			if (r.index == "built") built++;
+
+			const bool bad = r.corrupt || r.torn || r.index != "ok";
+			if (!bad && !verbose) continue;
+
+			std::ostringstream os;
+			os << f.path << ": "
+				<< (r.corrupt ? "CORRUPT" : r.torn ? "TORN" : "ok")
+				<< " pages=" << r.pages
+				<< " pings=" << r.firstPing << ".." << r.lastPing
+				<< " gaps=" << r.gaps
+				<< " index=" << r.index
+				<< r.detail.str();
+
+			std::lock_guard<std::mutex> lock(out);
+			std::cout << os.str() << std::endl;
+		}
+	};
+
+	std::vector<std::thread> pool_threads;
+	for (unsigned t = 0; t < threads; t++)
+		pool_threads.push_back(std::thread(worker, t));
+	for (auto& t : pool_threads)
+		t.join();
+
+	const int64_t elapsed = now() - start;
+
+	std::cout << "files=" << files.size()
+		<< " ok=" << ok
+		<< " torn=" << torn
+		<< " corrupt=" << corrupt
+		<< " unreadable=" << failed
+		<< " indexes_built=" << built
+		<< " threads=" << threads
+		<< " steals=" << pool.steals()
+		<< " mb_s=" << std::fixed << std::setprecision(1)
+		<< (elapsed ? (bytes / 1e6) / (elapsed / 1e9) : 0.0)
+		<< std::endl;
+
+	return (torn || corrupt || failed) ? 1 : 0;
+}
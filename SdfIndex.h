@@ -0,0 +1,81 @@
+#ifndef _KLEIN_SDF_INDEX_H_
+#define _KLEIN_SDF_INDEX_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/SdfIndex.h#1 $
+//
+
+#include <stdint.h>
+#include <string.h>
+
+namespace klein
+{
+
+// the page index the PageWriter writes next to each data file, named
+// for it with sdfIndexSuffix on the end, so a reader can go straight to
+// a ping, or to only the pages of one type, without scanning the file.
+//
+// an SdfIndexHeader, then an SdfIndexRecord per page in the order the
+// pages are in the data file. the pages of a ping are together, in the
+// PageTypes order. everything is little endian, as the data file is.
+//
+// a record is only written once its page has been, so a file cut short
+// by a crash has an index no longer than it, at most a batch shorter.
+struct SdfIndexRecord
+{
+	uint64_t offset;		// of the page, after its 0xffffffff marker
+	uint32_t length;		// page bytes, with any sdfx on the end
+	uint32_t pageVersion;
+	uint32_t pingNumber;
+	uint32_t reserved;
+	int64_t time_msec;		// ping time from the page header, UTC
+};
+
+struct SdfIndexHeader
+{
+	char magic[4];			// "SDFI"
+	uint32_t version;
+	uint32_t headerSize;	// sizeof(SdfIndexHeader)
+	uint32_t recordSize;	// sizeof(SdfIndexRecord)
+
+	static const uint32_t currentVersion = 1;
+
+	inline void init()
+	{
+		memcpy(magic, "SDFI", sizeof(magic));
+		version = currentVersion;
+		headerSize = sizeof(SdfIndexHeader);
+		recordSize = sizeof(SdfIndexRecord);
+	}
+
+	inline bool valid() const
+	{
+		return !memcmp(magic, "SDFI", sizeof(magic)) && version == currentVersion
+			&& headerSize >= 16 && recordSize >= 32;
+	}
+};
+
+// ms since the epoch of a page header's time, UTC, for time_msec. no
+// timegm(), the writer does this for every page.
+inline int64_t sdfTime_msec(const uint32_t year, const uint32_t month,
+		const uint32_t day, const uint32_t hour, const uint32_t minute,
+		const uint32_t second, const uint32_t hSecond)
+{
+	// days from 1970-01-01 to the civil date
+	const int64_t m = month;
+	const int64_t y = (int64_t)year - (m <= 2);
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const int64_t yoe = y - era * 400;
+	const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	const int64_t days = era * 146097 + doe - 719468;
+
+	const int64_t s = days * 86400 + (int64_t)hour * 3600 + minute * 60 + second;
+	return s * 1000 + (int64_t)hSecond * 10;
+}
+
+// "x.sdf" is indexed in "x.sdf.idx"
+static const char* const sdfIndexSuffix = ".idx";
+
+} // namespace klein
+#endif // _KLEIN_SDF_INDEX_H_
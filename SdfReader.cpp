@@ -0,0 +1,313 @@
+#include <sstream>
+#include <stdexcept>
+#include <cstring> // memcpy(), memchr(), strerror()
+#include <errno.h>
+#include <fcntl.h> // open()
+#include <unistd.h> // close()
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SdfReader.h"
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/SdfReader.cpp#1 $";
+
+static const uint32_t marker = 0xffffffff;
+
+// map all of path read only, NULL for an empty file
+static const uint8_t* mapFile(const std::string& path, uint64_t& size, const bool must)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		if (!must && errno == ENOENT) return NULL;
+
+		std::ostringstream os;
+		os << "Couldn't open file: error = " << strerror(errno)
+			<< ", fileName = " << path;
+		throw std::runtime_error(os.str());
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		const int e = errno;
+		close(fd);
+
+		std::ostringstream os;
+		os << "Couldn't stat file: error = " << strerror(e)
+			<< ", fileName = " << path;
+		throw std::runtime_error(os.str());
+	}
+
+	size = st.st_size;
+
+	void* m = NULL;
+	if (size) m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	const int e = errno;
+
+	// the mapping keeps the file
+	close(fd);
+
+	if (m == MAP_FAILED)
+	{
+		std::ostringstream os;
+		os << "Couldn't map file: error = " << strerror(e)
+			<< ", fileName = " << path;
+		throw std::runtime_error(os.str());
+	}
+
+	// the kernel reads ahead harder and drops behind
+	if (m) madvise(m, size, MADV_SEQUENTIAL);
+
+	return (const uint8_t*)m;
+}
+
+//-----------------------------------------------------------------------------
+// SdfReader::Page
+//-----------------------------------------------------------------------------
+SdfReader::Span SdfReader::Page::channels() const
+{
+	const CKleinType3Header& h = header();
+
+	// older pages have no header size
+	const size_t hs = (h.headerSize >= sizeof(CKleinType3Header) && h.headerSize <= length)
+		? h.headerSize : sizeof(CKleinType3Header);
+
+	// a short or corrupt page may not have room for both
+	const size_t x = sdfxBytes().bytes;
+	if (hs + x > length) return Span();
+
+	return Span(data + hs, length - hs - x);
+}
+SdfReader::Span SdfReader::Page::sdfxBytes() const
+{
+	// the sdfx is the end of the page, the size of it comes first
+	const uint32_t n = header().sdfExtensionSize;
+
+	if (n < sizeof(uint32_t) || n > length - sizeof(CKleinType3Header))
+		return Span();
+
+	return Span(data + length - n, n);
+}
+//-----------------------------------------------------------------------------
+// SdfReader CTOR
+//-----------------------------------------------------------------------------
+SdfReader::SdfReader(const std::string& path, const bool useIndex) :
+	_path(path), _map(NULL), _size(0), _indexMap(NULL), _indexSize(0),
+	_records(NULL), _recordSize(0), _nRecords(0), _ordered(true), _pos(0),
+	_record(0), _skipped(0)
+{
+	_map = mapFile(path, _size, true);
+
+	if (!useIndex) return;
+
+	try
+	{
+		openIndex();
+	}
+	catch (...)
+	{
+		if (_map) munmap(const_cast<uint8_t*>(_map), _size);
+		throw;
+	}
+}
+//-----------------------------------------------------------------------------
+// SdfReader DTOR
+//-----------------------------------------------------------------------------
+SdfReader::~SdfReader()
+{
+	if (_map) munmap(const_cast<uint8_t*>(_map), _size);
+	if (_indexMap) munmap(const_cast<uint8_t*>(_indexMap), _indexSize);
+}
+//-----------------------------------------------------------------------------
+// SdfReader::openIndex()
+//-----------------------------------------------------------------------------
+void SdfReader::openIndex()
+{
+	_indexMap = mapFile(_path + sdfIndexSuffix, _indexSize, false);
+
+	// none, or the recorder stopped before it got going
+	if (!_indexMap || _indexSize < sizeof(SdfIndexHeader)) return;
+
+	SdfIndexHeader h;
+	memcpy(&h, _indexMap, sizeof(h));
+
+	if (!h.valid() || h.headerSize > _indexSize)
+	{
+		std::ostringstream os;
+		os << "Bad index, fileName = " << _path << sdfIndexSuffix;
+		throw std::runtime_error(os.str());
+	}
+
+	// a record cut short by a crash isn't counted
+	_records = _indexMap + h.headerSize;
+	_recordSize = h.recordSize;
+	_nRecords = (_indexSize - h.headerSize) / h.recordSize;
+
+	// a TPU restart in the middle of the file takes the pings back to
+	// the start, then they can't be looked up or cut short
+	uint32_t last = 0;
+	for (size_t i = 0; i < _nRecords && _ordered; i++)
+	{
+		SdfIndexRecord r;
+		memcpy(&r, _records + i * _recordSize, sizeof(r));
+
+		_ordered = r.pingNumber >= last;
+		last = r.pingNumber;
+	}
+}
+//-----------------------------------------------------------------------------
+// SdfReader::filter()
+//-----------------------------------------------------------------------------
+void SdfReader::filter(const Filter& f)
+{
+	_filter = f;
+	rewind();
+}
+//-----------------------------------------------------------------------------
+// SdfReader::rewind()
+//-----------------------------------------------------------------------------
+void SdfReader::rewind()
+{
+	_pos = 0;
+	_record = 0;
+	_skipped = 0;
+
+	if (!_records || !_ordered || !_filter.firstPing) return;
+
+	// a file's pings are in order, as the Policy writes them, so
+	// the first one wanted can be looked up
+	size_t lo = 0;
+	size_t hi = _nRecords;
+
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+
+		SdfIndexRecord r;
+		memcpy(&r, _records + mid * _recordSize, sizeof(r));
+
+		if (r.pingNumber < _filter.firstPing) lo = mid + 1;
+		else hi = mid;
+	}
+	_record = lo;
+}
+//-----------------------------------------------------------------------------
+// SdfReader::page()
+//-----------------------------------------------------------------------------
+bool SdfReader::page(const uint64_t offset, const uint32_t length, Page& p) const
+{
+	// is there a page there
+	if (offset < sizeof(marker) || length < sizeof(CKleinType3Header)
+		|| offset > _size || length > _size - offset)
+		return false;
+
+	if (memcmp(_map + offset - sizeof(marker), &marker, sizeof(marker)))
+		return false;
+
+	p.data = _map + offset;
+	p.length = length;
+	p.offset = offset;
+	return true;
+}
+//-----------------------------------------------------------------------------
+// SdfReader::scan()
+//-----------------------------------------------------------------------------
+bool SdfReader::scan(Page& p)
+{
+	// the page at _pos, or the next one after it
+	while (_pos + sizeof(marker) + sizeof(CKleinType3Header) <= _size)
+	{
+		const uint64_t offset = _pos + sizeof(marker);
+
+		uint32_t n = 0;
+		memcpy(&n, _map + offset, sizeof(n)); // numberBytes
+
+		if (page(offset, n, p))
+		{
+			_pos = offset + n;
+			return true;
+		}
+
+		// not a page, on to the next 0xff that might start a marker
+		const void* f = memchr(_map + _pos + 1, 0xff, _size - _pos - 1);
+		const uint64_t next = f ? (const uint8_t*)f - _map : _size;
+
+		_skipped += next - _pos;
+		_pos = next;
+	}
+
+	_skipped += _size - _pos;
+	_pos = _size;
+	return false;
+}
+//-----------------------------------------------------------------------------
+// SdfReader::next()
+//-----------------------------------------------------------------------------
+bool SdfReader::next(Page& p)
+{
+	if (!_records)
+	{
+		while (scan(p))
+		{
+			if (_filter.wants(p.version(), p.pingNumber())) return true;
+		}
+		return false;
+	}
+
+	// only the index is looked at until a page is wanted
+	while (_record < _nRecords)
+	{
+		SdfIndexRecord r;
+		memcpy(&r, _records + _record * _recordSize, sizeof(r));
+		_record++;
+
+		// pings are in order, none after this is wanted either
+		if (_ordered && r.pingNumber > _filter.lastPing)
+		{
+			_record = _nRecords;
+			break;
+		}
+
+		if (!_filter.wants(r.pageVersion, r.pingNumber)) continue;
+
+		// an index longer than its file, the file was cut short
+		if (page(r.offset, r.length, p)) return true;
+	}
+	return false;
+}
+//-----------------------------------------------------------------------------
+// SdfReader::seek()
+//-----------------------------------------------------------------------------
+bool SdfReader::seek(const uint32_t ping, Page& p)
+{
+	if (_records)
+	{
+		if (!_filter.wants(_filter.version, ping)) return false;
+
+		// look it up, as rewind() does
+		const Filter f(_filter);
+		_filter.firstPing = ping;
+		rewind();
+
+		// out of order, the index is walked for it
+		if (!_ordered) _filter.lastPing = ping;
+
+		const bool found = next(p);
+		_filter = f;
+
+		if (found && p.pingNumber() == ping) return true;
+	}
+	else
+	{
+		rewind();
+
+		while (scan(p))
+		{
+			if (p.pingNumber() == ping && _filter.wants(p.version(), ping)) return true;
+		}
+	}
+	return false;
+}
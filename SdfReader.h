@@ -0,0 +1,222 @@
+#ifndef _KLEIN_SDF_READER_H_
+#define _KLEIN_SDF_READER_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/SdfReader.h#1 $
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#include "KleinSonar.h"
+#include "SdfIndex.h"
+
+namespace klein
+{
+
+// reads an SDF file back, as the PageWriter writes it: a 0xffffffff
+// marker, then a page starting with its CKleinType3Header, repeated.
+//
+// the file is mmapped read only and a Page is a view into the mapping,
+// nothing is copied and nothing is allocated per page. a Page is only
+// good as long as its reader.
+//
+// if the file has an SdfIndex next to it the pages are found from
+// that, so skipping the ones the filter doesn't want never touches
+// them. without one the file is walked marker to marker, and anything
+// that isn't a page is skipped to the next marker that starts one.
+//
+// throws std::runtime_error if the file can't be mapped, or its index
+// is there but bad.
+class SdfReader
+{
+	public:
+
+		// bytes in the mapping
+		struct Span
+		{
+			Span() : data(NULL), bytes(0) {}
+			Span(const uint8_t* p, const size_t n) : data(p), bytes(n) {}
+
+			// the bytes as Ts, e.g. uint16_t samples
+			template <typename T>
+			inline const T* as() const { return reinterpret_cast<const T*>(data); }
+			template <typename T>
+			inline size_t count() const { return bytes / sizeof(T); }
+
+			const uint8_t* data;
+			size_t bytes;
+		};
+
+		// the sdfx records on the end of a page, up to the END record
+		class SdfxRecords
+		{
+			public:
+
+				class iterator
+				{
+					public:
+						iterator(const uint8_t* p, const uint8_t* end) : _p(p), _end(end) { check(); }
+
+						inline const SDFX_RECORD_HEADER& operator * () const
+						{
+							return *reinterpret_cast<const SDFX_RECORD_HEADER*>(_p);
+						}
+						inline const SDFX_RECORD_HEADER* operator -> () const { return &**this; }
+
+						// what follows the record header
+						inline Span payload() const
+						{
+							return Span(_p + sizeof(SDFX_RECORD_HEADER),
+									(*this)->recordNumBytes - sizeof(SDFX_RECORD_HEADER));
+						}
+
+						inline iterator& operator ++ ()
+						{
+							_p += (*this)->recordNumBytes;
+							check();
+							return *this;
+						}
+						inline bool operator != (const iterator& rhs) const { return _p != rhs._p; }
+
+					private:
+						// the END record, or one that doesn't fit, ends it
+						inline void check()
+						{
+							if (_p == _end) return;
+
+							const SDFX_RECORD_HEADER* r = &**this;
+
+							if ((size_t)(_end - _p) < sizeof(SDFX_RECORD_HEADER)
+								|| r->recordId == SDFX_RECORD_ID_END
+								|| r->recordNumBytes < sizeof(SDFX_RECORD_HEADER)
+								|| r->recordNumBytes > (size_t)(_end - _p))
+							{
+								_p = _end;
+							}
+						}
+
+						const uint8_t* _p;
+						const uint8_t* _end;
+				};
+
+				SdfxRecords(const Span& s) : _s(s) {}
+
+				inline iterator begin() const { return iterator(_s.data, _s.data + _s.bytes); }
+				inline iterator end() const { return iterator(_s.data + _s.bytes, _s.data + _s.bytes); }
+
+			private:
+				Span _s;
+		};
+
+		// a page in the file
+		struct Page
+		{
+			const uint8_t* data;	// the header
+			uint32_t length;		// page bytes
+			uint64_t offset;		// in the file, after the marker
+
+			inline const CKleinType3Header& header() const
+			{
+				return *reinterpret_cast<const CKleinType3Header*>(data);
+			}
+			inline uint32_t version() const { return header().pageVersion; }
+			inline uint32_t pingNumber() const { return header().pingNumber; }
+
+			// between the header and the sdfx
+			Span channels() const;
+
+			// the sdfx, including the size in front of the records
+			Span sdfxBytes() const;
+
+			inline SdfxRecords sdfx() const
+			{
+				const Span s = sdfxBytes();
+				return (s.bytes < sizeof(uint32_t)) ? SdfxRecords(Span())
+					: SdfxRecords(Span(s.data + sizeof(uint32_t), s.bytes - sizeof(uint32_t)));
+			}
+		};
+
+		// which pages next() returns
+		struct Filter
+		{
+			Filter() : version(0), firstPing(0), lastPing(UINT32_MAX) {}
+
+			uint32_t version;		// 0 for any
+			uint32_t firstPing;
+			uint32_t lastPing;		// inclusive
+
+			inline bool wants(const uint32_t v, const uint32_t ping) const
+			{
+				return (!version || v == version) && ping >= firstPing && ping <= lastPing;
+			}
+		};
+
+		// path is the data file, its index is looked for next to it
+		// unless useIndex is false
+		SdfReader(const std::string& path, const bool useIndex = true);
+		~SdfReader();
+
+		inline const std::string& path() const { return _path; }
+		inline uint64_t size() const { return _size; }
+
+		// all of the file, pages or not
+		inline Span file() const { return Span(_map, _size); }
+		inline bool indexed() const { return _records != NULL; }
+
+		// pages the index has, 0 without one
+		inline size_t indexedPages() const { return _nRecords; }
+
+		// the index's pings never go back. false after a TPU restart in
+		// the file, the index is then walked from the start.
+		inline bool ordered() const { return _ordered; }
+
+		// the pages next() returns from here on, from the start
+		void filter(const Filter& f);
+		void rewind();
+
+		// the next page the filter wants, false at the end of the file
+		bool next(Page& p);
+
+		// the first page of ping n the filter wants, and next() carries
+		// on after it. with the index a binary search, if its pings are
+		// in order.
+		bool seek(const uint32_t ping, Page& p);
+
+		// bytes skipped that weren't in a page, walking without an index
+		inline uint64_t skipped() const { return _skipped; }
+
+	private:
+		// no copy or operator = ctors
+		SdfReader(const SdfReader& rhs);
+		SdfReader& operator = (const SdfReader& rhs);
+
+		bool page(const uint64_t offset, const uint32_t length, Page& p) const;
+		bool scan(Page& p);
+		void openIndex();
+
+		std::string _path;
+
+		const uint8_t* _map;
+		uint64_t _size;
+
+		// the index, if there is one
+		const uint8_t* _indexMap;
+		uint64_t _indexSize;
+		const uint8_t* _records;
+		size_t _recordSize;
+		size_t _nRecords;
+		bool _ordered;
+
+		Filter _filter;
+
+		uint64_t _pos;		// next marker, walking the file
+		size_t _record;		// next record, with the index
+
+		uint64_t _skipped;
+};
+
+} // namespace klein
+#endif // _KLEIN_SDF_READER_H_
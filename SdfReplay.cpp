@@ -0,0 +1,572 @@
+// replays recorded .sdf files through the PageWriter, as if a TPU were
+// sending them, to load test the writer and its Policy without one.
+//
+// every page under dir is put in ping order, a ping's pages in the
+// PageTypes order, and handed to PageWriter::writePage() a ping at a
+// time, each followed by the update() and flush() the Recorder does
+// every pass. the writer's files go to out.
+//
+//   --speed 1 keeps the original ping interval, from the page times or
+//   --interval, 2 is twice as fast, 0 is as fast as the writer goes,
+//   which is the most pings a second this box can record
+//   --reorder n shuffles the pages within each n pings, as threaded
+//   fetchers deliver them
+//   --drop pct loses that many pages in a hundred, the seed makes a run
+//   repeatable
+//   --loops n plays it all n times, the ping numbers carrying on
+//   --bus name publishes the pings on a PingBus, for trying readers
+//
+// the bathy sdfx records are taken off the pages they were added to and
+// served back to the writer by the TpuShim, so it adds them as it would
+// have. reports one line:
+//
+//   pings=6000 pages=24000 dropped=0 mb=1530.2 secs=2.1 pings_s=2857.1
+//   mb_s=728.7 p50_us=180 p99_us=2210 max_us=9120 behind_ms=0
+//
+// the latency is of a pass, update(), the writePage()s and flush(), and
+// behind_ms how late the worst pass started on the original clock.
+//
+// the SdfReplay configuration builds it, with every .cpp of the recorder
+// but main.cpp, and links libTpuShim.a from the TpuShim configuration
+// instead of the Klein SDK
+//
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/SdfReplay.cpp#1 $";
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// from google code
+#include <getoptpp/getopt_pp.h>
+
+#include "PageWriter.h"
+#include "PageTypes.h"
+#include "Recorder.h"
+#include "SdfReader.h"
+#include "TpuShim.h"
+#include "ToolUtil.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::atomic<bool> shutdown;
+}
+
+using namespace klein;
+
+// a recorded page, in its reader's mapping
+struct Entry
+{
+	const uint8_t* data;
+	uint32_t length;
+	uint32_t ping;
+	int slot;				// PageTypes
+	bool bathySdfx;			// has the records the writer adds
+	bool dropped;
+	int64_t time_msec;
+};
+
+// the pages handed over in one pass, [begin, end) of the entries, and
+// when on the original clock, in ms from the first ping
+struct Pass
+{
+	size_t begin;
+	size_t end;
+	int64_t due_msec;
+};
+
+// pings further apart than this were a pause in recording
+static const int64_t maxGap_msec = 5000;
+
+static bool isBathySdfx(const uint32_t id)
+{
+	return id == SDFX_RECORD_ID_BATHY_CAL_1
+		|| id == SDFX_RECORD_ID_BATHY_ENG_SETTINGS_1
+		|| id == SDFX_RECORD_ID_BATHY_PROC_SETTINGS_1;
+}
+
+// every page of the files, the bathy sdfx records go to the shim
+static void load(const std::vector<std::string>& files,
+		std::vector<std::unique_ptr<SdfReader> >& readers,
+		std::vector<Entry>& entries, uint32_t& framingMode)
+{
+	TpuShim& shim = TpuShim::instance();
+	bool haveSdfx = false;
+
+	for (const auto& path : files)
+	{
+		readers.push_back(std::unique_ptr<SdfReader>(new SdfReader(path)));
+		SdfReader& r = *readers.back();
+
+		SdfReader::Page p;
+		while (r.next(p))
+		{
+			const int t = PageTypes::slot(p.version());
+			if (t < 0) continue;
+
+			const CKleinType3Header& h = p.header();
+
+			Entry e;
+			e.data = p.data;
+			e.length = p.length;
+			e.ping = h.pingNumber;
+			e.slot = t;
+			e.bathySdfx = false;
+			e.dropped = false;
+			e.time_msec = sdfTime_msec(h.year, h.month, h.day,
+					h.hour, h.minute, h.second, h.hSecond);
+
+			for (auto it = p.sdfx().begin(); it != p.sdfx().end(); ++it)
+			{
+				if (!isBathySdfx(it->recordId)) continue;
+
+				e.bathySdfx = true;
+
+				// the first file's, as the TPU had them then
+				if (!haveSdfx)
+					shim.sdfxRecord(it->recordId, reinterpret_cast<const uint8_t*>(&*it),
+							it->recordNumBytes);
+			}
+			haveSdfx = haveSdfx || e.bathySdfx;
+
+			// the framing mode has the low bits, the Policy adds bathy
+			framingMode |= PageTypes::info[t].mask & 0x07;
+
+			entries.push_back(e);
+		}
+
+		if (r.skipped())
+			std::cerr << path << ": " << r.skipped() << " bytes not in pages skipped" << std::endl;
+	}
+
+	std::stable_sort(entries.begin(), entries.end(),
+		[](const Entry& a, const Entry& b)
+		{
+			return (a.ping != b.ping) ? a.ping < b.ping : a.slot < b.slot;
+		});
+}
+
+// the page as the TPU sent it, without the bathy sdfx records. returns
+// its length, dst has room for e.length.
+static uint32_t copyPage(const Entry& e, uint8_t* dst)
+{
+	memcpy(dst, e.data, e.length);
+
+	if (!e.bathySdfx) return e.length;
+
+	CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(dst);
+
+	// the records are put back together behind the channels, only the
+	// ones the TPU sent and the END
+	SdfReader::Page p;
+	p.data = e.data;
+	p.length = e.length;
+	p.offset = 0;
+
+	const SdfReader::Span s = p.sdfxBytes();
+	uint8_t* out = dst + e.length - s.bytes + sizeof(uint32_t);
+
+	for (auto it = p.sdfx().begin(); it != p.sdfx().end(); ++it)
+	{
+		if (isBathySdfx(it->recordId)) continue;
+
+		memcpy(out, &*it, it->recordNumBytes);
+		out += it->recordNumBytes;
+	}
+
+	SDFX_RECORD_HEADER end;
+	memset(&end, 0, sizeof(end));
+	end.recordId = SDFX_RECORD_ID_END;
+	end.recordNumBytes = sizeof(end);
+	end.headerVersion = SDFX_HEADER_VERSION_1;
+	end.recordVersion = SDFX_RECORD_VERSION_END;
+	memcpy(out, &end, sizeof(end));
+	out += sizeof(end);
+
+	// the size is in the header and in front of the records
+	const uint32_t length = out - dst;
+	uint8_t* sdfx = dst + e.length - s.bytes;
+
+	h->sdfExtensionSize = out - sdfx;
+	h->numberBytes = length;
+	memcpy(sdfx, &h->sdfExtensionSize, sizeof(uint32_t));
+
+	return length;
+}
+
+// a pass per ping, due when it was recorded or every interval ms
+static void schedule(const std::vector<Entry>& entries, const uint32_t interval_msec,
+		std::vector<Pass>& passes)
+{
+	int64_t due = 0;
+
+	for (size_t i = 0; i < entries.size(); )
+	{
+		Pass p;
+		p.begin = i;
+
+		while (i < entries.size() && entries[i].ping == entries[p.begin].ping)
+			i++;
+		p.end = i;
+
+		if (!passes.empty())
+		{
+			const int64_t dt = interval_msec ? interval_msec
+				: entries[p.begin].time_msec - entries[passes.back().begin].time_msec;
+
+			due += std::max<int64_t>(0, std::min(dt, maxGap_msec));
+		}
+		p.due_msec = due;
+
+		passes.push_back(p);
+	}
+}
+
+// shuffle the pages within each window of passes, and lose some. a
+// pass still hands over as many pages, the reordering moves pages
+// between passes.
+static void perturb(std::vector<Entry>& entries, const std::vector<Pass>& passes,
+		const size_t window, const double drop, const uint32_t seed)
+{
+	std::mt19937 rng(seed);
+
+	if (window > 1)
+	{
+		for (size_t i = 0; i < passes.size(); i += window)
+		{
+			const size_t last = std::min(i + window, passes.size()) - 1;
+			std::shuffle(entries.begin() + passes[i].begin,
+					entries.begin() + passes[last].end, rng);
+		}
+	}
+
+	if (drop > 0)
+	{
+		std::bernoulli_distribution lose(drop / 100.0);
+
+		for (auto& e : entries)
+			e.dropped = lose(rng);
+	}
+}
+
+// the latency and throughput of the replay
+struct Result
+{
+	Result() : pings(0), pages(0), dropped(0), bytes(0), elapsed(0), behind(0) {}
+
+	uint64_t pings;
+	uint64_t pages;
+	uint64_t dropped;
+	uint64_t bytes;
+	int64_t elapsed;		// ns, until the last file is closed
+	int64_t behind;			// ns, worst
+	std::vector<int64_t> ns;	// per pass
+};
+
+static void report(const Result& r)
+{
+	std::vector<int64_t> ns(r.ns);
+	const double secs = r.elapsed / 1e9;
+
+	std::cout << "pings=" << r.pings
+		<< " pages=" << r.pages
+		<< " dropped=" << r.dropped
+		<< std::fixed << std::setprecision(1)
+		<< " mb=" << r.bytes / 1e6
+		<< " secs=" << secs
+		<< " pings_s=" << (secs > 0 ? r.pings / secs : 0.0)
+		<< " mb_s=" << (secs > 0 ? (r.bytes / 1e6) / secs : 0.0)
+		<< " p50_us=" << percentile(ns, 50) / 1000
+		<< " p99_us=" << percentile(ns, 99) / 1000
+		<< " max_us=" << percentile(ns, 100) / 1000
+		<< " behind_ms=" << r.behind / 1000000 << std::endl;
+}
+
+// ^C handler
+static void terminate(const int)
+{
+	klein::shutdown = true;
+}
+
+// usage()
+static void usage(const std::string& name)
+{
+	std::cerr << "Usage: " << name
+		<< "[-d --dir path]"
+		<< "[-o --out path]"
+		<< "[--speed x]"
+		<< "[--interval msec]"
+		<< "[--reorder pings]"
+		<< "[--drop percent]"
+		<< "[--seed n]"
+		<< "[--loops n]"
+		<< "[--pingsperfile n]"
+		<< "[--pingqueue pings]"
+		<< "[--durability none|datasync|writeback]"
+		<< "[--io writev|uring|mmap]"
+		<< "[--noindex]"
+		<< "[--bus name]"
+		<< std::endl;
+	std::cerr << "\tdefault: -d . -o /tmp/replay --speed 1 --seed 1 --loops 1"
+		<< " --pingsperfile 1000 --pingqueue 64 --durability datasync --io writev"
+		<< std::endl;
+	std::cerr << "\t--speed 0 replays as fast as the writer goes, --interval sets"
+		<< " the ping interval instead of taking it from the page times" << std::endl;
+}
+
+// the main()
+int main(const int ac, const char* const av[])
+{
+	(void) signal(SIGINT, terminate);
+
+	GetOpt::GetOpt_pp ops(ac, av);
+
+	ops.exceptions(std::ios::failbit | std::ios::eofbit);
+
+	std::string dir(".");
+	std::string out("/tmp/replay");
+	double speed = 1;
+	uint32_t interval_msec = 0;
+	size_t window = 0;
+	double drop = 0;
+	uint32_t seed = 1;
+	uint32_t loops = 1;
+	uint32_t pingsPerFile = 1000;
+	RecorderConfig config;
+	std::string durability("datasync");
+	std::string io("writev");
+	bool noIndex = false;
+
+	try
+	{
+		ops >> GetOpt::Option('d', "dir", dir, dir)
+			>> GetOpt::Option('o', "out", out, out)
+			>> GetOpt::Option("speed", speed, speed)
+			>> GetOpt::Option("interval", interval_msec, interval_msec)
+			>> GetOpt::Option("reorder", window, window)
+			>> GetOpt::Option("drop", drop, drop)
+			>> GetOpt::Option("seed", seed, seed)
+			>> GetOpt::Option("loops", loops, loops)
+			>> GetOpt::Option("pingsperfile", pingsPerFile, pingsPerFile)
+			>> GetOpt::Option("pingqueue", config.pingQueueSize, config.pingQueueSize)
+			>> GetOpt::Option("durability", durability, durability)
+			>> GetOpt::Option("io", io, io)
+			>> GetOpt::OptionPresent("noindex", noIndex)
+			>> GetOpt::Option("bus", config.bus.name, config.bus.name);
+
+		config.index = !noIndex;
+
+		if (!parseDurability(durability, config.durability)
+			|| !parseIo(io, config.io)
+			|| speed < 0 || drop < 0 || drop > 100 || !pingsPerFile || !loops)
+		{
+			usage(av[0]);
+			return -1;
+		}
+	}
+	catch (const GetOpt::GetOptEx& ex)
+	{
+		std::cerr << "caught: " << ex.what() << std::endl;
+		usage(av[0]);
+		return -1;
+	}
+
+	// the writer's files would be replayed too
+	{
+		char a[PATH_MAX], b[PATH_MAX];
+		if (mkdir(out.c_str(), 0777) != 0 && errno != EEXIST)
+		{
+			std::cerr << "Couldn't make " << out << ": " << strerror(errno) << std::endl;
+			return -1;
+		}
+		if (realpath(dir.c_str(), a) && realpath(out.c_str(), b)
+			&& !strncmp(a, b, strlen(a)) && (b[strlen(a)] == '\0' || b[strlen(a)] == '/'))
+		{
+			std::cerr << "--out can't be in --dir" << std::endl;
+			return -1;
+		}
+	}
+
+	std::vector<SdfFile> found;
+
+	if (!findSdfFiles(dir, found))
+	{
+		std::cerr << "Couldn't walk " << dir << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	// file names sort in time order
+	std::vector<std::string> files;
+	for (const auto& f : found) files.push_back(f.path);
+	std::sort(files.begin(), files.end());
+
+	std::vector<std::unique_ptr<SdfReader> > readers;
+	std::vector<Entry> entries;
+	std::vector<Pass> passes;
+	uint32_t framingMode = 0;
+
+	try
+	{
+		load(files, readers, entries, framingMode);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	if (entries.empty())
+	{
+		std::cerr << "No pages in " << dir << std::endl;
+		return -1;
+	}
+
+	schedule(entries, interval_msec, passes);
+	perturb(entries, passes, window, drop, seed);
+
+	const uint32_t span = entries.back().ping - entries.front().ping + 1;
+	const int64_t length_msec = passes.back().due_msec
+		+ (passes.size() > 1 ? passes.back().due_msec / (passes.size() - 1) : 0);
+
+	// the TPU the writer asks
+	{
+		TpuShim& shim = TpuShim::instance();
+
+		DiskRecordingSettings s;
+		memset(&s, '\0', sizeof(s));
+		s.nVersion = 14;
+		s.nRecordMode = 1;
+		s.nPingsPerFile = pingsPerFile;
+		strncpy(s.szFilePrefix, "replay", sizeof(s.szFilePrefix) - 1);
+		strncpy(s.szFilePath, out.c_str(), sizeof(s.szFilePath) - 1);
+		shim.settings(s);
+
+		shim.framingMode(framingMode);
+
+		const int64_t ipp = (passes.size() > 1) ? length_msec / passes.size() : 0;
+		shim.pingInterval(speed > 0 ? (uint32_t)(ipp / speed) : 0);
+	}
+
+	std::cout << "# " << passes.size() << " pings, " << entries.size() << " pages from "
+		<< files.size() << " files, framing mode 0x" << std::hex << framingMode << std::dec
+		<< ", " << length_msec / 1000.0 << " s recorded" << std::endl;
+
+	Result r;
+	r.ns.reserve(passes.size() * loops);
+
+	{
+		Recorder recorder("replay", true, config);
+		std::unique_ptr<PageWriter> pw(new PageWriter(recorder));
+
+		const int64_t start = now();
+
+		for (uint32_t loop = 0; loop < loops && !klein::shutdown; loop++)
+		{
+			if (loop)
+			{
+				// the page times repeat, so do the file names. a new
+				// prefix and a new file.
+				TpuShim& shim = TpuShim::instance();
+				DiskRecordingSettings s = shim.settings();
+
+				snprintf(s.szFilePrefix, sizeof(s.szFilePrefix), "replay%u_", loop);
+				s.nNewFile = 1;
+				shim.settings(s);
+			}
+
+			for (const auto& p : passes)
+			{
+				if (klein::shutdown) break;
+
+				if (speed > 0)
+				{
+					// due on the original clock, sped up
+					const int64_t due = start
+						+ (int64_t)((loop * length_msec + p.due_msec) * 1e6 / speed);
+
+					struct timespec ts;
+					ts.tv_sec = due / 1000000000;
+					ts.tv_nsec = due % 1000000000;
+					while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR
+						&& !klein::shutdown);
+
+					r.behind = std::max(r.behind, now() - due);
+				}
+
+				// the pages as the fetchers would have them, in the arena
+				std::vector<PageRef> pages;
+				for (size_t i = p.begin; i < p.end; i++)
+				{
+					const Entry& e = entries[i];
+					if (e.dropped)
+					{
+						r.dropped++;
+						continue;
+					}
+
+					const uint32_t ping = e.ping + loop * span;
+					PageRef page = recorder.pagePool().acquire(e.length,
+							PageTypes::info[e.slot].pageType, ping);
+
+					page->length = copyPage(e, page->data);
+					reinterpret_cast<CKleinType3Header*>(page->data)->pingNumber = ping;
+
+					r.bytes += page->length;
+					pages.push_back(std::move(page));
+				}
+
+				const int64_t t0 = now();
+
+				try
+				{
+					pw->update();
+
+					for (auto& page : pages)
+						pw->writePage(std::move(page));
+
+					pw->flush();
+				}
+				catch (const char* e)
+				{
+					std::cerr << "PageWriter threw: " << e << std::endl;
+					klein::shutdown = true;
+				}
+
+				r.ns.push_back(now() - t0);
+				r.pages += pages.size();
+				r.pings++;
+			}
+		}
+
+		std::ostringstream os;
+		os << "# " << pw->ioStats();
+
+		// the pings the Policy still holds go out as the writer is
+		// destroyed, the run isn't over until they are on disk
+		pw.reset();
+		r.elapsed = now() - start;
+
+		os << std::endl << "# " << recorder.pagePool();
+		std::cout << os.str() << std::endl;
+	}
+
+	report(r);
+
+	return 0;
+}
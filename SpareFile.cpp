@@ -0,0 +1,249 @@
+#include <iostream>
+#include <sstream>
+#include <cstring> // strerror()
+#include <errno.h>
+#include <stdio.h> // rename()
+#include <fcntl.h> // open()
+#include <unistd.h> // close(), unlink()
+
+#include "SpareFile.h"
+#include "SdfIndex.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/SpareFile.cpp#1 $";
+
+//-----------------------------------------------------------------------------
+// SpareFile CTOR
+//-----------------------------------------------------------------------------
+SpareFile::SpareFile(const bool index) :
+	_fd(-1), _indexFd(-1), _index(index), _tried(false), _making(false),
+	_running(true)
+{
+	memset(&_stats, '\0', sizeof(_stats));
+
+	_thread = std::thread(&SpareFile::run, this);
+}
+//-----------------------------------------------------------------------------
+// SpareFile DTOR
+//-----------------------------------------------------------------------------
+SpareFile::~SpareFile()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_running = false;
+	}
+	_work.notify_one();
+
+	if (_thread.joinable())
+		_thread.join();
+
+	// an unused spare isn't left lying about
+	discard();
+}
+//-----------------------------------------------------------------------------
+// SpareFile::prepare()
+//-----------------------------------------------------------------------------
+void SpareFile::prepare(const char* dir)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// a spare that failed before is tried again, the directory may
+	// have been made since
+	_dir = dir;
+	_tried = false;
+
+	_work.notify_one();
+}
+//-----------------------------------------------------------------------------
+// SpareFile::release()
+//-----------------------------------------------------------------------------
+void SpareFile::release()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	_dir.clear();
+
+	// one being made is got rid of as soon as it is
+	_work.wait(lock, [this] { return !_making; });
+
+	discard();
+}
+//-----------------------------------------------------------------------------
+// SpareFile::discard()
+//-----------------------------------------------------------------------------
+void SpareFile::discard()
+{
+	// close and remove the spare, with the lock held
+	if (_fd < 0) return;
+
+	::close(_fd);
+	unlink(_path.c_str());
+	_fd = -1;
+
+	if (_indexFd >= 0)
+	{
+		::close(_indexFd);
+		unlink((_path + sdfIndexSuffix).c_str());
+		_indexFd = -1;
+	}
+}
+//-----------------------------------------------------------------------------
+// SpareFile::take()
+//-----------------------------------------------------------------------------
+int SpareFile::take(const char* dir, const char* path, int* indexFd)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_fd < 0 || _spareDir != dir)
+	{
+		_stats.missed++;
+		return -1;
+	}
+
+	// replaces a file of the same name, as O_TRUNC would
+	if (rename(_path.c_str(), path) != 0)
+	{
+		const int e = errno;
+		std::ostringstream os;
+		printTime(os);
+		os << " - rename(" << _path << ", " << path << ") failed: " << strerror(e);
+		std::cerr << os.str() << std::endl;
+
+		_stats.missed++;
+		return -1;
+	}
+
+	if (_index)
+	{
+		// the data file has its name already, if the index can't have
+		// its own the writer makes a new one
+		const std::string index(std::string(path) + sdfIndexSuffix);
+
+		if (rename((_path + sdfIndexSuffix).c_str(), index.c_str()) != 0)
+		{
+			::close(_indexFd);
+			unlink((_path + sdfIndexSuffix).c_str());
+			_indexFd = -1;
+		}
+
+		if (indexFd) *indexFd = _indexFd;
+		else if (_indexFd >= 0) ::close(_indexFd);
+
+		_indexFd = -1;
+	}
+
+	const int fd = _fd;
+	_fd = -1;
+	_stats.taken++;
+
+	// make the next one
+	_work.notify_one();
+
+	return fd;
+}
+//-----------------------------------------------------------------------------
+// SpareFile::stats()
+//-----------------------------------------------------------------------------
+SpareFile::Stats SpareFile::stats() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats;
+}
+//-----------------------------------------------------------------------------
+// SpareFile::run()
+//-----------------------------------------------------------------------------
+void SpareFile::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	const auto wanted = [this]
+	{
+		return !_running || (_fd >= 0 && _spareDir != _dir)
+			|| (_fd < 0 && !_tried && !_dir.empty());
+	};
+
+	for (;;)
+	{
+		_work.wait(lock, wanted);
+
+		if (!_running) break;
+
+		if (_fd >= 0)
+		{
+			// the directory changed, this one won't be used
+			discard();
+			continue;
+		}
+
+		const std::string dir(_dir);
+		const std::string path(dir + "/" + spareFileName);
+		_making = true;
+
+		lock.unlock();
+
+		// as the PageWriter opens a new file
+		const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+		int e = errno;
+
+		int indexFd = -1;
+
+		if (fd >= 0 && _index)
+		{
+			const std::string index(path + sdfIndexSuffix);
+			indexFd = open(index.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+			e = errno;
+
+			if (indexFd < 0)
+			{
+				::close(fd);
+				unlink(path.c_str());
+			}
+		}
+
+		lock.lock();
+
+		_making = false;
+		_work.notify_all();
+
+		if (fd < 0 || (_index && indexFd < 0))
+		{
+			// not again until asked
+			if (dir == _dir) _tried = true;
+			_stats.failed++;
+
+			std::ostringstream os;
+			printTime(os);
+			os << " - Couldn't make a spare file: error = " << strerror(e)
+				<< ", fileName = " << path;
+			std::cerr << os.str() << std::endl;
+			continue;
+		}
+
+		_fd = fd;
+		_indexFd = indexFd;
+		_path = path;
+		_spareDir = dir;
+
+		// not wanted any more, e.g. release()d
+		if (dir != _dir) discard();
+	}
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const SpareFile::Stats& s)
+	{
+		out << "Spare files taken: " << s.taken
+			<< ", missed: " << s.missed
+			<< ", failed: " << s.failed;
+		return out;
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef _KLEIN_SPARE_FILE_H_
+#define _KLEIN_SPARE_FILE_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/SpareFile.h#1 $
+//
+
+#include <ostream>
+#include <stdint.h>
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace klein
+{
+
+// the next data file, created ahead of time by its own thread, so the
+// PageWriter doesn't create one on the fetch thread at the rotation.
+//
+// the spare is an empty hidden file in the recording directory, open
+// for writing. take() renames it to the new file's name and hands over
+// its fd, then another spare is made in the background. if there isn't
+// one ready, e.g. the directory just changed, the writer opens the file
+// itself as before.
+//
+// with index, each spare comes with an empty index file to go with it,
+// renamed along with it.
+class SpareFile
+{
+	public:
+
+		struct Stats
+		{
+			uint64_t taken;		// rotations that used a spare
+			uint64_t missed;	// rotations that had to open their own
+			uint64_t failed;	// spares that couldn't be made
+		};
+
+		SpareFile(const bool index = false);
+		~SpareFile();
+
+		// have a spare ready in dir
+		void prepare(const char* dir);
+
+		// no spare anywhere, until the next prepare(). it is gone when
+		// this returns, e.g. so its directory can be removed.
+		void release();
+
+		// the spare in dir, renamed to path, or -1 if there isn't one.
+		// with index its index file's fd goes in indexFd.
+		int take(const char* dir, const char* path, int* indexFd = NULL);
+
+		Stats stats() const;
+
+	private:
+		// no copy or operator = ctors
+		SpareFile(const SpareFile& rhs);
+		SpareFile& operator = (const SpareFile& rhs);
+
+		void run();
+		void discard();
+
+		std::string _dir;		// where a spare is wanted, empty for none
+		std::string _spareDir;	// where it is
+		std::string _path;		// the spare
+		int _fd;				// the spare's, -1 if none ready
+		int _indexFd;			// its index file's, -1 without index
+		const bool _index;
+		bool _tried;			// a spare was tried for _dir and failed
+		bool _making;			// run() is creating one
+		bool _running;
+
+		Stats _stats;
+
+		mutable std::mutex _mutex;
+		std::condition_variable _work;	// a spare is wanted or made, or stopping
+
+		std::thread _thread;
+
+	friend std::ostream& operator << (std::ostream& out, const SpareFile::Stats& s);
+};
+
+// the spare's name in its directory, a hidden .sdf that tools walking a
+// recording pass over
+static const char* const spareFileName = ".next.sdf";
+
+} // namespace klein
+#endif // _KLEIN_SPARE_FILE_H_
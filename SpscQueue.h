@@ -0,0 +1,111 @@
+#ifndef _KLEIN_SPSC_QUEUE_H_
+#define _KLEIN_SPSC_QUEUE_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/SpscQueue.h#1 $
+//
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+namespace klein
+{
+
+// bounded, lock-free, single producer / single consumer ring
+//
+// exactly one thread may push and exactly one (other) thread may pop.
+// the capacity is rounded up to a power of two so the index wrap is a
+// mask. the head and tail are padded onto their own cache lines (padded
+// rather than alignas, operator new ignores over-alignment before C++17)
+// and each side keeps a stale copy of the other side's index so it only
+// touches the shared line when the ring looks full (producer) or empty
+// (consumer).
+template <typename T>
+class SpscQueue
+{
+	public:
+
+		explicit SpscQueue(const size_t n) :
+			_ring(roundUp(n)), _mask(_ring.size() - 1),
+			_head(0), _tailCache(0), _tail(0), _headCache(0) {}
+
+		// producer side, false if full
+		bool push(T&& t)
+		{
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+
+			if (tail - _headCache == _ring.size())
+			{
+				_headCache = _head.load(std::memory_order_acquire);
+				if (tail - _headCache == _ring.size()) return false;
+			}
+
+			_ring[tail & _mask] = std::move(t);
+			_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool push(const T& t)
+		{
+			T c(t);
+			return push(std::move(c));
+		}
+
+		// consumer side, false if empty
+		bool pop(T& t)
+		{
+			const size_t head = _head.load(std::memory_order_relaxed);
+
+			if (head == _tailCache)
+			{
+				_tailCache = _tail.load(std::memory_order_acquire);
+				if (head == _tailCache) return false;
+			}
+
+			t = std::move(_ring[head & _mask]);
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// approximate when called from either side while the other runs
+		inline size_t size() const
+		{
+			return _tail.load(std::memory_order_acquire)
+				- _head.load(std::memory_order_acquire);
+		}
+
+		inline size_t capacity() const { return _ring.size(); }
+
+	private:
+		// no copy or operator = ctors
+		SpscQueue(const SpscQueue& rhs);
+		SpscQueue& operator = (const SpscQueue& rhs);
+
+		static size_t roundUp(size_t n)
+		{
+			size_t p = 2;
+			while (p < n) p <<= 1;
+			return p;
+		}
+
+		static const size_t cacheLine = 64;
+
+		std::vector<T> _ring;
+		const size_t _mask;
+
+		// consumer owned
+		char _pad0[cacheLine];
+		std::atomic<size_t> _head;
+		size_t _tailCache;
+
+		// producer owned
+		char _pad1[cacheLine];
+		std::atomic<size_t> _tail;
+		size_t _headCache;
+		char _pad2[cacheLine];
+};
+
+} // namespace klein
+#endif // _KLEIN_SPSC_QUEUE_H_
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cstring> // strlen(), strrchr()
+#include <ftw.h>
+#include <time.h> // clock_gettime()
+#include <sys/stat.h>
+
+#include "ToolUtil.h"
+#include "SpareFile.h"
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/ToolUtil.cpp#1 $";
+
+namespace klein
+{
+
+// klein::now()
+int64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// klein::percentile()
+int64_t percentile(std::vector<int64_t>& v, const int p)
+{
+	if (v.empty()) return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+// klein::parseDurability()
+bool parseDurability(const std::string& s, Durability& d)
+{
+	if (s == "none") d.mode = Durability::none;
+	else if (s == "datasync") d.mode = Durability::datasync;
+	else if (s == "writeback") d.mode = Durability::writeback;
+	else return false;
+
+	return true;
+}
+
+// klein::parseIo()
+bool parseIo(const std::string& s, IoConfig& io)
+{
+	if (s == "writev") io.backend = IoConfig::writev;
+	else if (s == "uring") io.backend = IoConfig::uring;
+	else if (s == "mmap") io.backend = IoConfig::mmap;
+	else return false;
+
+	return true;
+}
+
+// the walk, from nftw(), which has no room for a pointer of its own
+static std::vector<SdfFile>* found = NULL;
+
+static int addFile(const char* path, const struct stat* st, int type, struct FTW*)
+{
+	const size_t n = strlen(path);
+	const char* base = strrchr(path, '/');
+
+	// not the recorder's spare, it is only preallocated
+	if (strcmp(base ? base + 1 : path, spareFileName) == 0) return 0;
+
+	if (type == FTW_F && n > 4 && !strcmp(path + n - 4, ".sdf"))
+	{
+		SdfFile f = { path, (uint64_t)st->st_size };
+		found->push_back(f);
+	}
+	return 0;
+}
+
+// klein::findSdfFiles()
+bool findSdfFiles(const std::string& dir, std::vector<SdfFile>& files)
+{
+	found = &files;
+	const bool ok = nftw(dir.c_str(), addFile, 64, FTW_PHYS) == 0;
+	found = NULL;
+
+	return ok;
+}
+
+} // namespace klein
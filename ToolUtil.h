@@ -0,0 +1,43 @@
+#ifndef _KLEIN_TOOL_UTIL_H_
+#define _KLEIN_TOOL_UTIL_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/ToolUtil.h#1 $
+//
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "RecorderConfig.h"
+
+namespace klein
+{
+
+// helpers the recorder's main(), the TpuShim and the tools share, so
+// each doesn't have its own copy. build ToolUtil.cpp in with them.
+
+// the monotonic clock, ns
+int64_t now();
+
+// the pth percentile of v, 100 for the max. v is sorted here.
+int64_t percentile(std::vector<int64_t>& v, const int p);
+
+// the --durability and --io options, false for a name it doesn't know
+bool parseDurability(const std::string& s, Durability& d);
+bool parseIo(const std::string& s, IoConfig& io);
+
+// an .sdf file in a recording
+struct SdfFile
+{
+	std::string path;
+	uint64_t size;
+};
+
+// the .sdf files under dir, not the recorder's spare, in the order
+// they are found. false if dir can't be walked.
+bool findSdfFiles(const std::string& dir, std::vector<SdfFile>& files);
+
+} // namespace klein
+#endif // _KLEIN_TOOL_UTIL_H_
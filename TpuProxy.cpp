@@ -0,0 +1,527 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "TpuProxy.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+using namespace klein::ProxyProtocol;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/TpuProxy.cpp#1 $";
+
+// a thread each, a tool that doesn't let go shouldn't starve the box
+const size_t TpuProxy::maxClients = 64;
+
+// how often the threads look for stop() while nobody asks
+const int TpuProxy::pollPeriod_msec = 250;
+
+// the slot of a TPU page type, -1 if the recorder doesn't fetch it
+static int typeSlot(const uint32_t pageType)
+{
+	for (int t = 0; t < PageTypes::count; t++)
+		if ((uint32_t)PageTypes::info[t].pageType == pageType) return t;
+	return -1;
+}
+
+// history rounded up to a power of two, less one
+static uint32_t ringMask(const size_t history)
+{
+	size_t n = 2;
+	while (n < history) n <<= 1;
+	return n - 1;
+}
+
+// all of n or false, the other end went away
+static bool sendAll(const int fd, const void* p, const size_t n)
+{
+	const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+
+	for (size_t done = 0; done < n; )
+	{
+		const ssize_t r = send(fd, b + done, n - done, MSG_NOSIGNAL);
+
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		done += r;
+	}
+	return true;
+}
+
+static bool recvAll(const int fd, void* p, const size_t n)
+{
+	uint8_t* b = reinterpret_cast<uint8_t*>(p);
+
+	for (size_t done = 0; done < n; )
+	{
+		const ssize_t r = recv(fd, b + done, n - done, 0);
+
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		done += r;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// proxySocket()
+//-----------------------------------------------------------------------------
+int klein::proxySocket(const std::string& address, const bool listening)
+{
+	int fd = -1;
+	bool ok = false;
+
+	if (address.find('/') != std::string::npos)
+	{
+		struct sockaddr_un a;
+		memset(&a, 0, sizeof(a));
+		a.sun_family = AF_UNIX;
+
+		if (address.size() >= sizeof(a.sun_path))
+			throw std::runtime_error("Proxy socket path too long");
+
+		strcpy(a.sun_path, address.c_str());
+
+		// a socket left by the last run
+		if (listening) (void) unlink(address.c_str());
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		ok = fd >= 0 && (listening
+			? bind(fd, (struct sockaddr*)&a, sizeof(a)) == 0 && listen(fd, 16) == 0
+			: connect(fd, (struct sockaddr*)&a, sizeof(a)) == 0);
+	}
+	else
+	{
+		const size_t colon = address.rfind(':');
+		if (colon == std::string::npos)
+			throw std::runtime_error("Proxy address is neither a path nor [host]:port");
+
+		const std::string host = (colon == 0) ? "127.0.0.1" : address.substr(0, colon);
+		const std::string port = address.substr(colon + 1);
+
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* ai = NULL;
+		const int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+		if (rc != 0)
+		{
+			std::ostringstream os;
+			os << "Couldn't resolve proxy address: " << gai_strerror(rc)
+				<< ", address = " << address;
+			throw std::runtime_error(os.str());
+		}
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (fd >= 0)
+		{
+			const int one = 1;
+
+			// a request is a few bytes, it shouldn't wait for more
+			(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+			if (listening)
+			{
+				(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+				ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0;
+			}
+			else
+				ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+		}
+
+		freeaddrinfo(ai);
+	}
+
+	if (!ok)
+	{
+		std::ostringstream os;
+		os << "Couldn't " << (listening ? "serve" : "connect to") << " proxy: error = "
+			<< strerror(errno) << ", address = " << address;
+
+		if (fd >= 0) close(fd);
+		throw std::runtime_error(os.str());
+	}
+
+	return fd;
+}
+//-----------------------------------------------------------------------------
+// TpuProxy CTOR
+//-----------------------------------------------------------------------------
+TpuProxy::TpuProxy(const size_t history) :
+	_mask(ringMask(history)),
+	_fd(-1), _running(false),
+	_cached(0), _connections(0), _requests(0), _pages(0), _bytes(0)
+{
+	for (auto& c : _cache)
+		c.ring.resize(_mask + 1);
+}
+//-----------------------------------------------------------------------------
+// TpuProxy DTOR
+//-----------------------------------------------------------------------------
+TpuProxy::~TpuProxy()
+{
+	stop();
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::start()
+//-----------------------------------------------------------------------------
+void TpuProxy::start(const std::string& address)
+{
+	if (_running) return;
+
+	_fd = proxySocket(address, true);
+	_address = address;
+	_running = true;
+	_thread = std::thread(&TpuProxy::accept, this);
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::stop()
+//-----------------------------------------------------------------------------
+void TpuProxy::stop()
+{
+	_running = false;
+
+	if (_thread.joinable())
+		_thread.join();
+
+	{
+		std::lock_guard<std::mutex> lock(_clientsMutex);
+
+		// wakes a client thread in the middle of a request
+		for (auto& c : _clients)
+			shutdown(c->fd, SHUT_RDWR);
+
+		for (auto& c : _clients)
+		{
+			c->thread.join();
+			close(c->fd);
+		}
+		_clients.clear();
+	}
+
+	if (_fd >= 0)
+	{
+		close(_fd);
+		_fd = -1;
+		if (_address.find('/') != std::string::npos)
+			(void) unlink(_address.c_str());
+	}
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::cache()
+//-----------------------------------------------------------------------------
+void TpuProxy::cache(const uint8_t* p, const size_t n)
+{
+	if (n < sizeof(CKleinType3Header)) return;
+
+	const CKleinType3Header* h = reinterpret_cast<const CKleinType3Header*>(p);
+	const int t = PageTypes::slot(h->pageVersion);
+	const uint32_t ping = h->pingNumber;
+
+	if (t < 0 || !ping) return;
+
+	Cache& c = _cache[t];
+	std::lock_guard<std::mutex> lock(c.mutex);
+
+	// pings of a type only go back when the TPU started over, as the
+	// Policy takes it, however few back. what is held is from before.
+	if (ping < c.newest)
+	{
+		for (auto& e : c.ring) e.ping = 0;
+		c.newest = 0;
+	}
+
+	Cache::Entry& e = c.ring[ping & _mask];
+
+	// the vector keeps its capacity, after the first lap no allocations
+	e.ping = ping;
+	e.data.assign(p, p + n);
+
+	c.newest = std::max(c.newest, ping);
+
+	_cached.fetch_add(1, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::stats()
+//-----------------------------------------------------------------------------
+TpuProxy::Stats TpuProxy::stats() const
+{
+	Stats s;
+
+	s.cached = _cached.load(std::memory_order_relaxed);
+	s.clients = _connections.load(std::memory_order_relaxed);
+	s.requests = _requests.load(std::memory_order_relaxed);
+	s.pages = _pages.load(std::memory_order_relaxed);
+	s.bytes = _bytes.load(std::memory_order_relaxed);
+
+	return s;
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::accept()
+//-----------------------------------------------------------------------------
+void TpuProxy::accept()
+{
+	while (_running)
+	{
+		struct pollfd p = { _fd, POLLIN, 0 };
+
+		if (poll(&p, 1, pollPeriod_msec) <= 0) continue;
+
+		const int fd = accept4(_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) continue;
+
+		std::lock_guard<std::mutex> lock(_clientsMutex);
+
+		// the ones that have gone
+		for (auto i = _clients.begin(); i != _clients.end(); )
+		{
+			if ((*i)->done)
+			{
+				(*i)->thread.join();
+				close((*i)->fd);
+				i = _clients.erase(i);
+			}
+			else
+				++i;
+		}
+
+		if (_clients.size() >= maxClients)
+		{
+			std::ostringstream os;
+			printTime(os);
+			os << " - TpuProxy has " << maxClients << " clients, refused another";
+			std::cerr << os.str() << std::endl;
+
+			close(fd);
+			continue;
+		}
+
+		const int one = 1;
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		_clients.push_back(std::unique_ptr<Client>(new Client(fd)));
+		Client* const c = _clients.back().get();
+		c->thread = std::thread(&TpuProxy::serve, this, c);
+
+		_connections.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::serve()
+//-----------------------------------------------------------------------------
+void TpuProxy::serve(Client* c)
+{
+	while (_running)
+	{
+		struct pollfd p = { c->fd, POLLIN, 0 };
+
+		if (poll(&p, 1, pollPeriod_msec) == 0) continue;
+
+		Request r;
+		if (!recvAll(c->fd, &r, sizeof(r)) || r.magic != magic) break;
+
+		_requests.fetch_add(1, std::memory_order_relaxed);
+
+		Reply a;
+		if (r.op == ProxyProtocol::info) a = info(*c, r);
+		else if (r.op == ProxyProtocol::page) a = page(*c, r);
+		else break;
+
+		if (!sendAll(c->fd, &a, sizeof(a))) break;
+
+		if (r.op == ProxyProtocol::page && a.status == NGS_SUCCESS)
+		{
+			if (!sendAll(c->fd, &c->buf[0], a.bytes)) break;
+
+			_pages.fetch_add(1, std::memory_order_relaxed);
+			_bytes.fetch_add(a.bytes, std::memory_order_relaxed);
+		}
+	}
+
+	// accept() joins and closes it
+	c->done = true;
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::info()
+//-----------------------------------------------------------------------------
+Reply TpuProxy::info(Client& c, const Request& r)
+{
+	Reply a = { magic, NGS_SUCCESS, NGS_NO_ERROR, NGS_GETDATA_NO_PAGE, 0 };
+
+	c.slot = -1;
+
+	const int t = typeSlot(r.pageType);
+	if (t < 0)
+	{
+		a.status = NGS_FAILURE;
+		a.error = NGS_TPU_REPORTS_COMMAND_FAILED;
+		return a;
+	}
+
+	Cache& cache = _cache[t];
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	// nothing yet, or not yet
+	if (!cache.newest || r.ping > cache.newest) return a;
+
+	const uint32_t want = r.ping ? r.ping : cache.newest;
+
+	if (cache.newest - want > _mask)
+	{
+		a.pageStatus = NGS_GETDATA_ERROR_OLD;
+		return a;
+	}
+
+	// a ping the recorder lost goes on to the next one held
+	for (uint32_t ping = want; ping <= cache.newest; ping++)
+	{
+		const Cache::Entry& e = cache.ring[ping & _mask];
+		if (e.ping != ping) continue;
+
+		c.slot = t;
+		c.ping = ping;
+
+		a.pageStatus = NGS_GETDATA_SUCCESS;
+		a.bytes = e.data.size();
+		break;
+	}
+
+	return a;
+}
+//-----------------------------------------------------------------------------
+// TpuProxy::page()
+//-----------------------------------------------------------------------------
+Reply TpuProxy::page(Client& c, const Request& r)
+{
+	Reply a = { magic, NGS_FAILURE, NGS_TPU_REPORTS_COMMAND_FAILED, 0, 0 };
+
+	if (c.slot < 0) return a;
+
+	Cache& cache = _cache[c.slot];
+	c.slot = -1;
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	// gone since the info, the TPU would have said the same
+	const Cache::Entry& e = cache.ring[c.ping & _mask];
+	if (e.ping != c.ping) return a;
+
+	if (r.bytes < e.data.size())
+	{
+		a.error = NGS_RECEIVE_COMMAND_FAILURE;
+		return a;
+	}
+
+	// out of the lock before it goes on the socket
+	c.buf.assign(e.data.begin(), e.data.end());
+
+	a.status = NGS_SUCCESS;
+	a.error = NGS_NO_ERROR;
+	a.bytes = e.data.size();
+	return a;
+}
+//-----------------------------------------------------------------------------
+// TpuProxyClient CTOR
+//-----------------------------------------------------------------------------
+TpuProxyClient::TpuProxyClient(const std::string& address) :
+	_fd(proxySocket(address, false)), _lastError(NGS_NO_ERROR)
+{
+}
+//-----------------------------------------------------------------------------
+// TpuProxyClient DTOR
+//-----------------------------------------------------------------------------
+TpuProxyClient::~TpuProxyClient()
+{
+	close(_fd);
+}
+//-----------------------------------------------------------------------------
+// TpuProxyClient::call()
+//-----------------------------------------------------------------------------
+bool TpuProxyClient::call(const Request& r, Reply& a)
+{
+	if (!sendAll(_fd, &r, sizeof(r)))
+	{
+		_lastError = NGS_SEND_COMMAND_FAILURE;
+		return false;
+	}
+
+	if (!recvAll(_fd, &a, sizeof(a)) || a.magic != magic)
+	{
+		_lastError = NGS_RECEIVE_COMMAND_FAILURE;
+		return false;
+	}
+
+	if (a.status != NGS_SUCCESS)
+	{
+		_lastError = (DLLErrorCode)a.error;
+		return false;
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------
+// TpuProxyClient::pageInfo()
+//-----------------------------------------------------------------------------
+BoolStat TpuProxyClient::pageInfo(const U32 pageType, const U32 ping, U32* pageStatus, U32* numBytes)
+{
+	const Request r = { magic, ProxyProtocol::info, pageType, ping, 0 };
+	Reply a;
+
+	if (!call(r, a)) return NGS_FAILURE;
+
+	*pageStatus = a.pageStatus;
+	*numBytes = a.bytes;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuProxyClient::page()
+//-----------------------------------------------------------------------------
+BoolStat TpuProxyClient::page(U8* p, const U32 n)
+{
+	const Request r = { magic, ProxyProtocol::page, 0, 0, n };
+	Reply a;
+
+	if (!call(r, a)) return NGS_FAILURE;
+
+	// the proxy never sends more than asked for
+	if (a.bytes > n || !recvAll(_fd, p, a.bytes))
+	{
+		_lastError = NGS_RECEIVE_COMMAND_FAILURE;
+		return NGS_FAILURE;
+	}
+
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const TpuProxy::Stats& s)
+	{
+		out << "TpuProxy pages cached: " << s.cached
+			<< ", clients: " << s.clients
+			<< ", requests: " << s.requests
+			<< ", pages served: " << s.pages
+			<< ", bytes served: " << s.bytes;
+		return out;
+	}
+}
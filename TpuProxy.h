@@ -0,0 +1,195 @@
+#ifndef _KLEIN_TPU_PROXY_H_
+#define _KLEIN_TPU_PROXY_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/TpuProxy.h#1 $
+//
+
+#include <ostream>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "KleinSonar.h"
+#include "PageTypes.h"
+
+namespace klein
+{
+
+// the recorder as a TPU for the tools on the box. only one master may
+// connect to a TPU and every slave polling it for pages loads it, so
+// with --proxy the recorder keeps the last pages of each type it
+// fetched, keyed by ping number, and serves them to any number of
+// clients on a unix or TCP socket. the TPU sees one client however
+// many tools are watching.
+//
+// a TpuProxyClient asks the way a slave asks the TPU, with the same
+// answers:
+//
+//   pageInfo(pageType, ping) - NGS_GETDATA_SUCCESS and its size if the
+//       ping is held, or the next one held after it, the newest for
+//       ping 0, NGS_GETDATA_ERROR_OLD if it has gone, no page (0) if
+//       it hasn't come yet
+//   page()                   - the page the last pageInfo() found,
+//       NGS_TPU_REPORTS_COMMAND_FAILED if it has gone since
+//
+// the address is a path for a unix socket, or [host]:port for TCP,
+// the host defaulting to the loopback.
+namespace ProxyProtocol
+{
+	static const uint32_t magic = 0x4b505258;	// "KPRX"
+
+	enum Op { info = 1, page = 2 };
+
+	// native byte order, it is a local socket
+	struct Request
+	{
+		uint32_t magic;
+		uint32_t op;
+		uint32_t pageType;		// info
+		uint32_t ping;			// info
+		uint32_t bytes;			// page, the client's buffer
+	};
+
+	// a successful page reply is followed by bytes of page
+	struct Reply
+	{
+		uint32_t magic;
+		int32_t status;			// BoolStat
+		uint32_t error;			// DLLErrorCode, if it failed
+		uint32_t pageStatus;	// info
+		uint32_t bytes;
+	};
+}
+
+class TpuProxy
+{
+	public:
+
+		// history pings of each type, rounded up to a power of two
+		explicit TpuProxy(const size_t history);
+		~TpuProxy();
+
+		// serve clients on address, throws std::runtime_error if it can't
+		void start(const std::string& address);
+		void stop();
+
+		// a page fetched from the TPU, starting with its header. copied,
+		// a type the recorder doesn't know is ignored.
+		void cache(const uint8_t* p, const size_t n);
+
+		struct Stats
+		{
+			uint64_t cached;		// pages from the TPU
+			uint64_t clients;		// connections taken
+			uint64_t requests;
+			uint64_t pages;			// served
+			uint64_t bytes;			// served
+		};
+
+		Stats stats() const;
+
+	private:
+		// no copy or operator = ctors
+		TpuProxy(const TpuProxy& rhs);
+		TpuProxy& operator = (const TpuProxy& rhs);
+
+		// the pages of one type, slot ping & mask
+		struct Cache
+		{
+			struct Entry
+			{
+				Entry() : ping(0) {}
+
+				uint32_t ping;		// 0 for none
+				std::vector<uint8_t> data;
+			};
+
+			Cache() : newest(0) {}
+
+			std::mutex mutex;
+			std::vector<Entry> ring;
+			uint32_t newest;		// 0 for none yet
+		};
+
+		// a downstream connection on its own thread
+		struct Client
+		{
+			Client(const int f) : fd(f), slot(-1), ping(0), done(false) {}
+
+			int fd;
+			int slot;				// what the last info found
+			uint32_t ping;
+			std::vector<uint8_t> buf;
+			std::atomic<bool> done;
+			std::thread thread;
+		};
+
+		void accept();
+		void serve(Client* c);
+
+		ProxyProtocol::Reply info(Client& c, const ProxyProtocol::Request& r);
+		ProxyProtocol::Reply page(Client& c, const ProxyProtocol::Request& r);
+
+		Cache _cache[PageTypes::count];
+		const uint32_t _mask;
+
+		std::string _address;
+		int _fd;
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		std::mutex _clientsMutex;
+		std::vector<std::unique_ptr<Client> > _clients;
+
+		std::atomic<uint64_t> _cached;
+		std::atomic<uint64_t> _connections;
+		std::atomic<uint64_t> _requests;
+		std::atomic<uint64_t> _pages;
+		std::atomic<uint64_t> _bytes;
+
+		static const size_t maxClients;
+		static const int pollPeriod_msec;
+
+	friend std::ostream& operator << (std::ostream& out, const TpuProxy::Stats& s);
+};
+
+// a tool's connection to a TpuProxy, in place of a slave connection to
+// the TPU. one thread at a time.
+class TpuProxyClient
+{
+	public:
+
+		// throws std::runtime_error if the proxy isn't there
+		explicit TpuProxyClient(const std::string& address);
+		~TpuProxyClient();
+
+		// as DllGetTheTpuDataPageInfo2() and DllGetTheTpuDataPage()
+		BoolStat pageInfo(const U32 pageType, const U32 ping, U32* pageStatus, U32* numBytes);
+		BoolStat page(U8* p, const U32 n);
+
+		// as DllGetLastError()
+		inline DLLErrorCode lastError() const { return _lastError; }
+
+	private:
+		// no copy or operator = ctors
+		TpuProxyClient(const TpuProxyClient& rhs);
+		TpuProxyClient& operator = (const TpuProxyClient& rhs);
+
+		bool call(const ProxyProtocol::Request& r, ProxyProtocol::Reply& a);
+
+		int _fd;
+		DLLErrorCode _lastError;
+};
+
+// a socket for address, listening or connected, throws
+// std::runtime_error if it can't
+extern int proxySocket(const std::string& address, const bool listen);
+
+} // namespace klein
+#endif // _KLEIN_TPU_PROXY_H_
@@ -0,0 +1,58 @@
+#include "TpuSettings.h"
+#include "PingScheduler.h"
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/TpuSettings.cpp#1 $";
+
+// how often to ask the TPU when nothing says the settings changed
+const int64_t TpuSettings::period = 1000000000;
+
+//-----------------------------------------------------------------------------
+// TpuSettings CTOR
+//-----------------------------------------------------------------------------
+TpuSettings::TpuSettings() :
+	_framingMode(0), _pingInterval_msec(0), _next(0), _queries(0)
+{
+}
+//-----------------------------------------------------------------------------
+// TpuSettings::refresh()
+//-----------------------------------------------------------------------------
+void TpuSettings::refresh(TPU_HANDLE h, const bool force)
+{
+	const int64_t now = PingScheduler::now();
+
+	if (!force && now < _next) return;
+
+	_next = now + period;
+
+	U32 mode = 0;
+	_queries++;
+	if (DllGetTheTpuFramingMode(h, &mode) != NGS_SUCCESS)
+	{
+		// try again next time round
+		_next = 0;
+		throw "GetTheTpuFramingMode() failed";
+	}
+	_framingMode.store(mode, std::memory_order_relaxed);
+
+	U32 ipp_msec = 0; // ms
+	_queries++;
+	if (DllGetTheTpuPingInterval(h, &ipp_msec) != NGS_SUCCESS)
+	{
+		ipp_msec = 0; // scheduler default, rather kind to tpu
+	}
+	_pingInterval_msec.store(ipp_msec, std::memory_order_relaxed);
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const TpuSettings& s)
+	{
+		out << "TPU framing mode: 0x" << std::hex << s.framingMode() << std::dec
+			<< ", ping interval: " << s.pingInterval() << " ms"
+			<< ", queries: " << s.queries();
+		return out;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef _KLEIN_TPU_SETTINGS_H_
+#define _KLEIN_TPU_SETTINGS_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/TpuSettings.h#1 $
+//
+
+#include <ostream>
+#include <atomic>
+#include <stdint.h>
+
+#include "KleinSonar.h"
+
+namespace klein
+{
+
+// TPU parameters the data path needs but that rarely change, kept so
+// that reading one is a load instead of an SDK round trip.
+//
+// refresh() asks the TPU again about once a second, or straight away
+// after invalidate(), e.g. when the record settings change or the
+// connection was lost. only the thread that owns the TPU handle calls
+// refresh(), any thread may read.
+class TpuSettings
+{
+	public:
+
+		TpuSettings();
+
+		// ask the TPU if the period is up, or now if forced. throws if
+		// the framing mode can't be read
+		void refresh(TPU_HANDLE h, const bool force = false);
+
+		// the next refresh() asks the TPU
+		inline void invalidate() { _next = 0; }
+
+		// TPU framing mode, the low bits of the Policy ping mask
+		inline uint32_t framingMode() const { return _framingMode.load(std::memory_order_relaxed); }
+
+		// ping interval, 0 if unknown
+		inline uint32_t pingInterval() const { return _pingInterval_msec.load(std::memory_order_relaxed); }
+
+		// SDK round trips made
+		inline uint64_t queries() const { return _queries; }
+
+	private:
+		// no copy or operator = ctors
+		TpuSettings(const TpuSettings& rhs);
+		TpuSettings& operator = (const TpuSettings& rhs);
+
+		std::atomic<uint32_t> _framingMode;
+		std::atomic<uint32_t> _pingInterval_msec;
+
+		int64_t _next;		// ns monotonic, 0 to refresh now
+		uint64_t _queries;
+
+		static const int64_t period;
+
+	friend std::ostream& operator << (std::ostream& out, const TpuSettings& s);
+};
+
+} // namespace klein
+#endif // _KLEIN_TPU_SETTINGS_H_
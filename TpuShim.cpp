@@ -0,0 +1,631 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring> // memset(), memcpy(), strncpy()
+#include <cstdlib> // getenv(), strtoul(), strtod()
+#include <errno.h>
+#include <time.h> // clock_gettime(), gmtime_r()
+#include <sys/stat.h> // mkdir()
+
+#include "TpuShim.h"
+#include "ToolUtil.h"
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/TpuShim.cpp#2 $";
+
+// the TPU hands back sdfx record sizes rounded up to this
+static const U32 sdfxBlock = 64;
+
+// the bathy sdfx records made up until a tool sets its own
+static const U32 sdfxRecordBytes = 256;
+
+//-----------------------------------------------------------------------------
+// TpuShim::Config CTOR
+//-----------------------------------------------------------------------------
+TpuShim::Config::Config() :
+	interval_msec(100), jitter_msec(0), framingMode(LowFrequency::mask
+		| HighFrequency::mask | RawBathy::mask), history(64),
+	loss(0), old(0), sdfx(0), seed(1)
+{
+	// about what a 3500 sends at 75 m range
+	for (int t = 0; t < PageTypes::count; t++)
+	{
+		bytes[t] = 65536;
+		delay_msec[t] = 0;
+	}
+	bytes[PageTypes::slot(HighFrequency::version)] = 131072;
+	bytes[PageTypes::slot(RawBathy::version)] = 262144;
+
+	// the bathy process takes a while
+	delay_msec[PageTypes::slot(ProcessedBathy::version)] = 150;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::Connection CTOR
+//-----------------------------------------------------------------------------
+TpuShim::Connection::Connection(const uint32_t n) :
+	id(n), lastError(NGS_NO_ERROR), slot(-1), ping(0), requests(0)
+{
+}
+//-----------------------------------------------------------------------------
+// TpuShim CTOR
+//-----------------------------------------------------------------------------
+TpuShim::TpuShim() :
+	_start(0), _start_msec(0), _connections(0), _pages(0), _bytes(0),
+	_noPage(0), _old(0), _errors(0), _skipped(0)
+{
+	memset(&_status, '\0', sizeof(_status));
+
+	memset(&_settings, '\0', sizeof(_settings));
+	_settings.nVersion = 14;
+	_settings.nRecordMode = 1;
+	_settings.nPingsPerFile = 1000;
+	strncpy(_settings.szFilePrefix, "shim", sizeof(_settings.szFilePrefix) - 1);
+	strncpy(_settings.szFilePath, "/tmp/shim", sizeof(_settings.szFilePath) - 1);
+
+	// bathy sdfx records, nothing in them
+	const U32 ids[] = { SDFX_RECORD_ID_BATHY_CAL_1,
+		SDFX_RECORD_ID_BATHY_ENG_SETTINGS_1, SDFX_RECORD_ID_BATHY_PROC_SETTINGS_1 };
+
+	for (const U32 id : ids)
+	{
+		std::vector<uint8_t>& r = _sdfx[id];
+		r.assign(sdfxRecordBytes, 0);
+
+		SDFX_RECORD_HEADER h;
+		memset(&h, 0, sizeof(h));
+		h.recordId = id;
+		h.recordNumBytes = sdfxRecordBytes;
+		h.headerVersion = SDFX_HEADER_VERSION_1;
+		h.recordVersion = 1;
+		memcpy(r.data(), &h, sizeof(h));
+	}
+
+	const char* spec = getenv("KLEIN_TPU_SHIM");
+	if (spec && !configure(spec))
+		std::cerr << "TpuShim: bad KLEIN_TPU_SHIM: " << spec << std::endl;
+}
+//-----------------------------------------------------------------------------
+// TpuShim DTOR
+//-----------------------------------------------------------------------------
+TpuShim::~TpuShim()
+{
+	// what a run was fed, if it was
+	if (_pages || _noPage)
+		std::cout << "TpuShim: " << stats() << std::endl;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::instance()
+//-----------------------------------------------------------------------------
+TpuShim& TpuShim::instance()
+{
+	static TpuShim shim;
+	return shim;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::configure()
+//-----------------------------------------------------------------------------
+bool TpuShim::configure(const std::string& spec)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::istringstream is(spec);
+	std::string kv;
+
+	while (is >> kv)
+	{
+		const size_t eq = kv.find('=');
+		if (eq == std::string::npos) return false;
+
+		const std::string key(kv, 0, eq);
+		const std::string value(kv, eq + 1);
+
+		char* e;
+		const double d = strtod(value.c_str(), &e);
+		const bool number = !value.empty() && *e == '\0' && d >= 0;
+
+		// bytes.3503=262144
+		const size_t dot = key.find('.');
+		if (dot != std::string::npos)
+		{
+			const int t = PageTypes::slot(strtoul(key.c_str() + dot + 1, NULL, 10));
+			if (t < 0 || !number) return false;
+
+			const std::string what(key, 0, dot);
+			if (what == "bytes") _config.bytes[t] = d;
+			else if (what == "delay") _config.delay_msec[t] = d;
+			else return false;
+			continue;
+		}
+
+		if (key == "path")
+		{
+			strncpy(_settings.szFilePath, value.c_str(), sizeof(_settings.szFilePath) - 1);
+			continue;
+		}
+		if (key == "prefix")
+		{
+			strncpy(_settings.szFilePrefix, value.c_str(), sizeof(_settings.szFilePrefix) - 1);
+			continue;
+		}
+		if (key == "mode")
+		{
+			// hex, 0x7
+			_config.framingMode = strtoul(value.c_str(), &e, 0);
+			if (*e) return false;
+			continue;
+		}
+
+		if (!number) return false;
+
+		if (key == "rate") _config.interval_msec = d ? 1000 / d : 0;
+		else if (key == "interval") _config.interval_msec = d;
+		else if (key == "jitter") _config.jitter_msec = d;
+		else if (key == "history") _config.history = d;
+		else if (key == "loss") _config.loss = d;
+		else if (key == "old") _config.old = d;
+		else if (key == "sdfx") _config.sdfx = d;
+		else if (key == "seed") _config.seed = d;
+		else if (key == "pings") _settings.nPingsPerFile = d;
+		else return false;
+	}
+
+	if (!_config.history) _config.history = 1;
+
+	return true;
+}
+TpuShim::Config TpuShim::config() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _config;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::settings()
+//-----------------------------------------------------------------------------
+void TpuShim::settings(const DiskRecordingSettings& s)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_settings = s;
+}
+DiskRecordingSettings TpuShim::settings() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _settings;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::status()
+//-----------------------------------------------------------------------------
+DiskRecordingStatus TpuShim::status() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _status;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::framingMode()
+//-----------------------------------------------------------------------------
+void TpuShim::framingMode(const uint32_t m)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_config.framingMode = m;
+}
+BoolStat TpuShim::framingMode(U32* m)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	*m = _config.framingMode;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::pingInterval()
+//-----------------------------------------------------------------------------
+void TpuShim::pingInterval(const uint32_t msec)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_config.interval_msec = msec;
+}
+BoolStat TpuShim::pingInterval(U32* msec)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	*msec = _config.interval_msec;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::sdfxRecord()
+//-----------------------------------------------------------------------------
+void TpuShim::sdfxRecord(const uint32_t id, const uint8_t* p, const size_t n)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_sdfx[id].assign(p, p + n);
+}
+BoolStat TpuShim::sdfxRecord(Connection& c, const U32 id, U8* p, const U32 n)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	const auto it = _sdfx.find(id);
+	if (it == _sdfx.end()) return fail(c, NGS_SDFX_RECORD_TYPE_UNKNOWN);
+
+	const std::vector<uint8_t>& r = it->second;
+	if (n < r.size()) return fail(c, NGS_SDFX_RECEIVE_BUFFER_TOO_SMALL);
+
+	// the rest of the block is padding
+	memcpy(p, r.data(), r.size());
+	memset(p + r.size(), '\0', n - r.size());
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::sdfxRecordSize()
+//-----------------------------------------------------------------------------
+BoolStat TpuShim::sdfxRecordSize(Connection& c, const U32 id, U32* n)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	const auto it = _sdfx.find(id);
+	if (it == _sdfx.end()) return fail(c, NGS_SDFX_RECORD_TYPE_UNKNOWN);
+
+	*n = (it->second.size() + sdfxBlock - 1) / sdfxBlock * sdfxBlock;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::recordInfo()
+//-----------------------------------------------------------------------------
+BoolStat TpuShim::recordInfo(DiskRecordingStatus* status, DiskRecordingSettings* settings)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// the status goes to the TPU, the settings come back
+	_status = *status;
+	*settings = _settings;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::stats()
+//-----------------------------------------------------------------------------
+TpuShim::Stats TpuShim::stats() const
+{
+	Stats s;
+	s.pages = _pages;
+	s.bytes = _bytes;
+	s.noPage = _noPage;
+	s.old = _old;
+	s.errors = _errors;
+	s.skipped = _skipped;
+	return s;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::open()
+//-----------------------------------------------------------------------------
+TpuShim::Connection* TpuShim::open()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// the pings start with the first connection
+	if (!_start)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		_start = now();
+		_start_msec = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+		std::cout << "TpuShim: " << _config << std::endl;
+
+		// the TPU's disk would have it
+		if (mkdir(_settings.szFilePath, 0777) != 0 && errno != EEXIST)
+			std::cerr << "TpuShim: Couldn't make " << _settings.szFilePath
+				<< ": " << strerror(errno) << std::endl;
+	}
+
+	return new Connection(_connections++);
+}
+//-----------------------------------------------------------------------------
+// TpuShim::close()
+//-----------------------------------------------------------------------------
+void TpuShim::close(Connection* c)
+{
+	if (c != &_none) delete c;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::draw()
+//-----------------------------------------------------------------------------
+double TpuShim::draw(const uint64_t a, const uint64_t b) const
+{
+	// splitmix64 of the three, the top 53 bits
+	uint64_t z = _config.seed * 0x9e3779b97f4a7c15ULL + a * 0xbf58476d1ce4e5b9ULL
+		+ b * 0x94d049bb133111ebULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z = z ^ (z >> 31);
+	return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+//-----------------------------------------------------------------------------
+// TpuShim::ready()
+//-----------------------------------------------------------------------------
+int64_t TpuShim::ready(const uint32_t n, const int t) const
+{
+	// 0 for unknown, as fast as can be
+	const int64_t interval = (int64_t)std::max<uint32_t>(_config.interval_msec, 1) * 1000000;
+
+	// less than half an interval either way, so pings stay in order
+	const int64_t j = std::min<int64_t>((int64_t)_config.jitter_msec * 1000000,
+			(interval - 1) / 2);
+	const int64_t jitter = j ? (int64_t)((draw(n, PageTypes::count) * 2 - 1) * j) : 0;
+
+	return _start + n * interval + jitter + (int64_t)_config.delay_msec[t] * 1000000;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::lost()
+//-----------------------------------------------------------------------------
+bool TpuShim::lost(const uint32_t n, const int t) const
+{
+	return _config.loss > 0 && draw(n, t) * 100 < _config.loss;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::made()
+//-----------------------------------------------------------------------------
+bool TpuShim::made(const int t) const
+{
+	// as the Policy has them, the shim's pings always have the bathy
+	// capability if the mode makes 3503s
+	const bool bathy = _config.framingMode & RawBathy::mask;
+
+	return PageTypes::wanted(_config.framingMode, bathy ? SYS_CAP_BATHY : 0)
+		& PageTypes::info[t].mask;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::latest()
+//-----------------------------------------------------------------------------
+uint32_t TpuShim::latest(const int t, const int64_t now) const
+{
+	// 0 for unknown, as fast as can be
+	const int64_t interval = (int64_t)std::max<uint32_t>(_config.interval_msec, 1) * 1000000;
+	const int64_t since = now - _start - (int64_t)_config.delay_msec[t] * 1000000;
+
+	if (since < interval / 2) return 0;
+
+	// the one due by now, or the one before it jittered late
+	uint32_t n = (since + interval / 2) / interval;
+	while (n && ready(n, t) > now) n--;
+
+	return n;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::pageInfo()
+//-----------------------------------------------------------------------------
+BoolStat TpuShim::pageInfo(Connection& c, const U32 pageType, const U32 ping,
+		U32* pageStatus, U32* numBytes)
+{
+	*pageStatus = NGS_GETDATA_NO_PAGE;
+	*numBytes = 0;
+	c.slot = -1;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	const uint64_t request = c.requests++;
+
+	int t = -1;
+	for (int i = 0; i < PageTypes::count; i++)
+		if (PageTypes::info[i].pageType == (int)pageType) t = i;
+
+	if (t < 0 || !_start || !made(t))
+	{
+		_noPage++;
+		return NGS_SUCCESS;
+	}
+
+	// thrown in, as a TPU that sent a bad sdfx
+	if (_config.sdfx > 0 && draw(((uint64_t)c.id << 40) | request, PageTypes::count + 1) * 100 < _config.sdfx)
+	{
+		_errors++;
+		return fail(c, NGS_SDFX_RECORD_TYPE_UNKNOWN);
+	}
+
+	const uint32_t last = latest(t, now());
+
+	if (!last || ping > last)
+	{
+		_noPage++;
+		return NGS_SUCCESS;
+	}
+
+	uint32_t n = ping;
+
+	if (!ping)
+	{
+		// the newest there is
+		n = last;
+		while (n && lost(n, t) && last - n < _config.history) n--;
+	}
+	else if (last - ping >= _config.history
+		|| (_config.old > 0 && draw(((uint64_t)c.id << 40) | request, PageTypes::count + 2) * 100 < _config.old))
+	{
+		_old++;
+		*pageStatus = NGS_GETDATA_ERROR_OLD;
+		return NGS_SUCCESS;
+	}
+	else
+	{
+		// a lost page never comes, the next one does
+		while (n <= last && lost(n, t))
+		{
+			_skipped++;
+			n++;
+		}
+	}
+
+	if (!n || n > last || lost(n, t))
+	{
+		_noPage++;
+		return NGS_SUCCESS;
+	}
+
+	c.slot = t;
+	c.ping = n;
+
+	*pageStatus = NGS_GETDATA_SUCCESS;
+	*numBytes = std::max<uint32_t>(_config.bytes[t],
+			sizeof(CKleinType3Header) + sizeof(U32) + sizeof(SDFX_RECORD_HEADER));
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// TpuShim::page()
+//-----------------------------------------------------------------------------
+BoolStat TpuShim::page(Connection& c, U8* p, const U32 n)
+{
+	if (c.slot < 0) return fail(c, NGS_TPU_REPORTS_COMMAND_FAILED);
+
+	const int t = c.slot;
+	const uint32_t ping = c.ping;
+	c.slot = -1;
+
+	uint32_t bytes;
+	int64_t time_msec;
+	bool bathy;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		bytes = std::max<uint32_t>(_config.bytes[t],
+				sizeof(CKleinType3Header) + sizeof(U32) + sizeof(SDFX_RECORD_HEADER));
+		time_msec = _start_msec + (ready(ping, t) - _start) / 1000000
+			- _config.delay_msec[t];
+		bathy = _config.framingMode & RawBathy::mask;
+	}
+
+	if (n < bytes) return fail(c, NGS_RECEIVE_COMMAND_FAILURE);
+
+	CKleinType3Header* h = reinterpret_cast<CKleinType3Header*>(p);
+	memset(h, 0, sizeof(*h));
+
+	const U32 sdfxSize = sizeof(U32) + sizeof(SDFX_RECORD_HEADER);
+
+	h->numberBytes = bytes;
+	h->pageVersion = PageTypes::info[t].version;
+	h->pingNumber = ping;
+	h->numSamples = (bytes - sizeof(*h) - sdfxSize) / sizeof(uint16_t);
+	h->headerSize = sizeof(*h);
+	h->capabilityMask = bathy ? SYS_CAP_BATHY : 0;
+	h->sdfExtensionSize = sdfxSize;
+
+	{
+		const time_t s = time_msec / 1000;
+		struct tm tm;
+		gmtime_r(&s, &tm);
+
+		h->year = tm.tm_year + 1900;
+		h->month = tm.tm_mon + 1;
+		h->day = tm.tm_mday;
+		h->hour = tm.tm_hour;
+		h->minute = tm.tm_min;
+		h->second = tm.tm_sec;
+		h->hSecond = (time_msec % 1000) / 10;
+	}
+
+	// the samples, then the sdfx with its size in front and an END
+	uint8_t* x = p + bytes - sdfxSize;
+	memset(p + sizeof(*h), (int)(ping & 0xff), x - p - sizeof(*h));
+
+	memcpy(x, &sdfxSize, sizeof(sdfxSize));
+
+	SDFX_RECORD_HEADER end;
+	memset(&end, 0, sizeof(end));
+	end.recordId = SDFX_RECORD_ID_END;
+	end.recordNumBytes = sizeof(end);
+	end.headerVersion = SDFX_HEADER_VERSION_1;
+	end.recordVersion = SDFX_RECORD_VERSION_END;
+	memcpy(x + sizeof(U32), &end, sizeof(end));
+
+	_pages++;
+	_bytes += bytes;
+	return NGS_SUCCESS;
+}
+//-----------------------------------------------------------------------------
+// the Klein SDK, as the recorder calls it
+//-----------------------------------------------------------------------------
+TPU_HANDLE DllOpenTheTpu(U32, char*, U32* protocolVersion)
+{
+	if (protocolVersion) *protocolVersion = 0;
+	return TpuShim::instance().open();
+}
+TPU_HANDLE DllOpenTheTpuNonBlocking(U32 config, char* ip, U32, U32* protocolVersion)
+{
+	return DllOpenTheTpu(config, ip, protocolVersion);
+}
+BoolStat DllCloseTheTpu(TPU_HANDLE h)
+{
+	TpuShim& shim = TpuShim::instance();
+	if (h) shim.close(&shim.connection(h));
+	return NGS_SUCCESS;
+}
+BoolStat DllGetLastError(TPU_HANDLE h, DLLErrorCode* e)
+{
+	*e = TpuShim::instance().connection(h).lastError;
+	return NGS_SUCCESS;
+}
+BoolStat DllClearLastError(TPU_HANDLE h)
+{
+	TpuShim::instance().connection(h).lastError = NGS_NO_ERROR;
+	return NGS_SUCCESS;
+}
+BoolStat DllGetTheTpuDataPageInfo2(TPU_HANDLE h, U32 pageType, U32 pingNumber,
+		U32* pageStatus, U32* numBytes)
+{
+	TpuShim& shim = TpuShim::instance();
+	return shim.pageInfo(shim.connection(h), pageType, pingNumber, pageStatus, numBytes);
+}
+BoolStat DllGetTheTpuDataPage(TPU_HANDLE h, U8* p, U32 n)
+{
+	TpuShim& shim = TpuShim::instance();
+	return shim.page(shim.connection(h), p, n);
+}
+BoolStat DllGetTheTpuRecordInfo(TPU_HANDLE, DiskRecordingStatus* status,
+		DiskRecordingSettings* settings)
+{
+	return TpuShim::instance().recordInfo(status, settings);
+}
+BoolStat DllGetTheTpuFramingMode(TPU_HANDLE, U32* m)
+{
+	return TpuShim::instance().framingMode(m);
+}
+BoolStat DllGetTheTpuPingInterval(TPU_HANDLE, U32* msec)
+{
+	return TpuShim::instance().pingInterval(msec);
+}
+BoolStat DllGetTheSdfxRecordSize(TPU_HANDLE h, U32 id, U32* n)
+{
+	TpuShim& shim = TpuShim::instance();
+	return shim.sdfxRecordSize(shim.connection(h), id, n);
+}
+BoolStat DllGetTheSdfxRecord(TPU_HANDLE h, U32 id, U8* p, U32 n)
+{
+	TpuShim& shim = TpuShim::instance();
+	return shim.sdfxRecord(shim.connection(h), id, p, n);
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const TpuShim::Config& c)
+	{
+		out << "interval: " << c.interval_msec << " ms"
+			<< ", jitter: " << c.jitter_msec << " ms"
+			<< ", framing mode: 0x" << std::hex << c.framingMode << std::dec
+			<< ", history: " << c.history
+			<< ", loss: " << c.loss << "%"
+			<< ", old: " << c.old << "%"
+			<< ", sdfx errors: " << c.sdfx << "%"
+			<< ", seed: " << c.seed;
+
+		for (int t = 0; t < PageTypes::count; t++)
+			out << ", " << PageTypes::info[t].version << ": " << c.bytes[t]
+				<< " bytes +" << c.delay_msec[t] << " ms";
+		return out;
+	}
+	std::ostream& operator << (std::ostream& out, const TpuShim::Stats& s)
+	{
+		out << "pages: " << s.pages
+			<< ", bytes: " << s.bytes
+			<< ", no page: " << s.noPage
+			<< ", old: " << s.old
+			<< ", errors: " << s.errors
+			<< ", lost skipped: " << s.skipped;
+		return out;
+	}
+}
@@ -0,0 +1,197 @@
+#ifndef _KLEIN_TPU_SHIM_H_
+#define _KLEIN_TPU_SHIM_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/TpuShim.h#2 $
+//
+
+#include <ostream>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "KleinSonar.h"
+#include "PageTypes.h"
+
+namespace klein
+{
+
+// a TPU that isn't there. TpuShim.cpp defines the Dll* functions of the
+// Klein SDK that the recorder calls, so linking it instead of the SDK
+// runs the recorder, unchanged, on any box:
+//
+//   KLEIN_TPU_SHIM="rate=20 jitter=10 loss=0.5 delay.3511=300" ./Recorder
+//
+// the TpuShim configuration builds it, with ToolUtil.cpp, into
+// libTpuShim.a. the RecorderShim configuration builds the Recorder on
+// it, the Default configuration leaves it out and links the SDK.
+//
+// pings start when the first connection is opened and come every
+// interval, give or take the jitter. a page of each type in the framing
+// mode is made for every ping, 3511 too if the mode has 3503, and is
+// ready its type's delay after the ping. the TPU keeps history pings,
+// an older one asked for is NGS_GETDATA_ERROR_OLD. a lost page is never
+// ready, asking for it gets the next one. pages are made as they are
+// read, a header, the sample bytes and an sdfx END record.
+//
+// errors can be thrown in, a share of the page requests answered with
+// NGS_GETDATA_ERROR_OLD or failed with NGS_SDFX_RECORD_TYPE_UNKNOWN.
+// losses and jitter are the same for a seed, run to run.
+//
+// the record settings, ping interval and sdfx records can also be set
+// by a tool, e.g. SdfReplay, which has its own pages. the status the
+// recorder sends is kept for it to look at.
+//
+// any thread may call anything. a connection's last error is its own.
+class TpuShim
+{
+	public:
+
+		// what the TPU is like, KLEIN_TPU_SHIM is read into it
+		struct Config
+		{
+			Config();
+
+			uint32_t interval_msec;
+			uint32_t jitter_msec;		// +/-, at most half the interval
+			uint32_t framingMode;
+			uint32_t history;			// pings kept
+
+			// per PageTypes slot
+			uint32_t bytes[PageTypes::count];
+			uint32_t delay_msec[PageTypes::count];
+
+			double loss;		// % of pages
+			double old;			// % of page requests
+			double sdfx;		// % of page requests
+			uint32_t seed;
+		};
+
+		// served, all connections
+		struct Stats
+		{
+			uint64_t pages;
+			uint64_t bytes;
+			uint64_t noPage;		// not ready yet
+			uint64_t old;			// too old, or thrown in
+			uint64_t errors;		// failed requests, thrown in
+			uint64_t skipped;		// lost pages asked for
+		};
+
+		// a connection, what a TPU_HANDLE points at
+		struct Connection
+		{
+			Connection(const uint32_t n = 0);
+
+			uint32_t id;			// opened nth
+			DLLErrorCode lastError;
+
+			// the page the last DllGetTheTpuDataPageInfo2 found
+			int slot;
+			uint32_t ping;
+			uint64_t requests;
+		};
+
+		// the one the Dll* functions use
+		static TpuShim& instance();
+
+		// "key=value ...", false on a bad one. keys: rate (pings a
+		// second) or interval (ms), jitter, mode, history, loss, old,
+		// sdfx, seed, bytes.<version>, delay.<version>, and path,
+		// prefix and pings for the record settings
+		bool configure(const std::string& spec);
+		Config config() const;
+
+		// what DllGetTheTpuRecordInfo hands back
+		void settings(const DiskRecordingSettings& s);
+		DiskRecordingSettings settings() const;
+
+		// the last status the recorder sent
+		DiskRecordingStatus status() const;
+
+		void framingMode(const uint32_t m);
+		void pingInterval(const uint32_t msec);
+
+		// an sdfx record as DllGetTheSdfxRecord returns it, starting
+		// with its SDFX_RECORD_HEADER
+		void sdfxRecord(const uint32_t id, const uint8_t* p, const size_t n);
+
+		Stats stats() const;
+
+		// the SDK calls
+		Connection* open();
+		void close(Connection* c);
+		BoolStat recordInfo(DiskRecordingStatus* status, DiskRecordingSettings* settings);
+		BoolStat framingMode(U32* m);
+		BoolStat pingInterval(U32* msec);
+		BoolStat sdfxRecordSize(Connection& c, const U32 id, U32* n);
+		BoolStat sdfxRecord(Connection& c, const U32 id, U8* p, const U32 n);
+		BoolStat pageInfo(Connection& c, const U32 pageType, const U32 ping,
+				U32* pageStatus, U32* numBytes);
+		BoolStat page(Connection& c, U8* p, const U32 n);
+
+		// the connection of a handle, NULL for the one without
+		inline Connection& connection(TPU_HANDLE h)
+		{
+			return h ? *static_cast<Connection*>(h) : _none;
+		}
+
+	private:
+		TpuShim();
+		~TpuShim();
+
+		// no copy or operator = ctors
+		TpuShim(const TpuShim& rhs);
+		TpuShim& operator = (const TpuShim& rhs);
+
+		// a number in [0, 1) from the seed and its arguments
+		double draw(const uint64_t a, const uint64_t b) const;
+
+		// ns monotonic ping n of type t is ready, with the lock held
+		int64_t ready(const uint32_t n, const int t) const;
+		bool lost(const uint32_t n, const int t) const;
+
+		// the newest ping of type t ready at now, 0 for none
+		uint32_t latest(const int t, const int64_t now) const;
+
+		// a type in the framing mode
+		bool made(const int t) const;
+
+		static inline BoolStat fail(Connection& c, const DLLErrorCode e)
+		{
+			c.lastError = e;
+			return NGS_FAILURE;
+		}
+
+		mutable std::mutex _mutex;
+
+		Config _config;
+		DiskRecordingSettings _settings;
+		DiskRecordingStatus _status;
+
+		std::map<uint32_t, std::vector<uint8_t> > _sdfx;
+
+		int64_t _start;			// ns monotonic of ping 0, 0 until opened
+		int64_t _start_msec;	// ms since the epoch of ping 0
+
+		Connection _none;
+		uint32_t _connections;
+
+		std::atomic<uint64_t> _pages;
+		std::atomic<uint64_t> _bytes;
+		std::atomic<uint64_t> _noPage;
+		std::atomic<uint64_t> _old;
+		std::atomic<uint64_t> _errors;
+		std::atomic<uint64_t> _skipped;
+
+	friend std::ostream& operator << (std::ostream& out, const TpuShim::Config& c);
+	friend std::ostream& operator << (std::ostream& out, const TpuShim::Stats& s);
+};
+
+} // namespace klein
+#endif // _KLEIN_TPU_SHIM_H_
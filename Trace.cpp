@@ -0,0 +1,227 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>	// rename()
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Trace.h"
+#include "Metrics.h"
+#include "PingScheduler.h"
+
+namespace klein
+{
+	// from Util.cpp
+	extern std::ostream& printTime(std::ostream&);
+}
+
+using namespace klein;
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/Trace.cpp#1 $";
+
+// spans kept, about half a minute of a busy recorder, 2.5MB
+const size_t Trace::ringSize = 1 << 16;
+
+// how often the trace thread looks for a dump to do
+const useconds_t Trace::pollPeriod_usec = 100000;
+
+//-----------------------------------------------------------------------------
+// Trace::instance()
+//-----------------------------------------------------------------------------
+Trace& Trace::instance()
+{
+	static Trace trace;
+	return trace;
+}
+//-----------------------------------------------------------------------------
+// Trace CTOR
+//-----------------------------------------------------------------------------
+Trace::Trace() :
+	_ring(new Event[ringSize]), _mask(ringSize - 1), _next(0),
+	_slowStage(-1), _dump(false), _dumps(0), _lastSlowDump(0),
+	_window(10), _running(false)
+{
+	for (size_t i = 0; i < ringSize; i++)
+		_ring[i].seq.store(0, std::memory_order_relaxed);
+
+	memset(_threshold, '\0', sizeof(_threshold));
+}
+//-----------------------------------------------------------------------------
+// Trace DTOR
+//-----------------------------------------------------------------------------
+Trace::~Trace()
+{
+	stop();
+}
+//-----------------------------------------------------------------------------
+// Trace::start()
+//-----------------------------------------------------------------------------
+void Trace::start(const std::string& dir, const uint32_t window)
+{
+	if (_running) return;
+
+	_dir = dir;
+	_window = window ? window : 1;
+
+	_running = true;
+	_thread = std::thread(&Trace::run, this);
+}
+//-----------------------------------------------------------------------------
+// Trace::stop()
+//-----------------------------------------------------------------------------
+void Trace::stop()
+{
+	_running = false;
+
+	if (_thread.joinable())
+		_thread.join();
+}
+//-----------------------------------------------------------------------------
+// Trace::tid()
+//-----------------------------------------------------------------------------
+uint32_t Trace::tid()
+{
+	static thread_local uint32_t t = 0;
+
+	if (!t) t = syscall(SYS_gettid);
+	return t;
+}
+//-----------------------------------------------------------------------------
+// Trace::run()
+//-----------------------------------------------------------------------------
+void Trace::run()
+{
+	while (_running)
+	{
+		usleep(pollPeriod_usec);
+
+		if (_dump.exchange(false, std::memory_order_relaxed))
+			write("signal");
+
+		const int slow = _slowStage.exchange(-1, std::memory_order_relaxed);
+
+		if (slow >= 0)
+		{
+			const int64_t now = PingScheduler::now();
+
+			// a window after the last, or it would be much the same
+			if (!_lastSlowDump || now - _lastSlowDump >= (int64_t)_window * 1000000000)
+			{
+				write(std::string("slow ") + Metrics::stageName(slow));
+				_lastSlowDump = now;
+			}
+		}
+	}
+}
+//-----------------------------------------------------------------------------
+// Trace::write()
+//-----------------------------------------------------------------------------
+size_t Trace::write(const std::string& why)
+{
+	struct Span
+	{
+		int64_t start;
+		int64_t dur;
+		uint32_t ping;
+		int32_t pageType;
+		uint32_t stage;
+		uint32_t tid;
+
+		bool operator < (const Span& rhs) const { return start < rhs.start; }
+	};
+
+	const int64_t from = PingScheduler::now() - (int64_t)_window * 1000000000;
+
+	// what is in the ring, left out if it changed while it was copied
+	std::vector<Span> spans;
+	spans.reserve(ringSize);
+
+	for (size_t i = 0; i < ringSize; i++)
+	{
+		const Event& e = _ring[i];
+		const uint64_t seq = e.seq.load(std::memory_order_acquire);
+
+		if (!seq) continue;
+
+		const Span s = { e.start, e.dur, e.ping, e.pageType, e.stage, e.tid };
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (e.seq.load(std::memory_order_relaxed) != seq) continue;
+
+		if (s.start + s.dur >= from && s.stage < (uint32_t)Metrics::stages)
+			spans.push_back(s);
+	}
+
+	std::sort(spans.begin(), spans.end());
+
+	// named for when it was dumped
+	char name[64];
+	const time_t t = time(NULL);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	strftime(name, sizeof(name), "trace-%Y%m%d-%H%M%S.json", &tm);
+
+	const std::string path(_dir + "/" + name);
+	const std::string tmp(path + ".tmp");
+
+	std::ofstream out(tmp.c_str());
+
+	out << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"why\":\"" << why
+		<< "\",\"window_s\":" << _window << "},\"traceEvents\":[";
+
+	const pid_t pid = getpid();
+	out << std::fixed << std::setprecision(3);
+
+	for (size_t i = 0; i < spans.size(); i++)
+	{
+		const Span& s = spans[i];
+
+		out << (i ? ",\n" : "\n")
+			<< "{\"name\":\"" << Metrics::stageName(s.stage)
+			<< "\",\"cat\":\"recorder\",\"ph\":\"X\",\"pid\":" << pid
+			<< ",\"tid\":" << s.tid
+			<< ",\"ts\":" << s.start / 1e3
+			<< ",\"dur\":" << s.dur / 1e3
+			<< ",\"args\":{\"ping\":" << s.ping
+			<< ",\"page_type\":" << s.pageType << "}}";
+	}
+
+	out << "\n]}\n";
+	out.close();
+
+	std::ostringstream os;
+	printTime(os);
+
+	if (!out || rename(tmp.c_str(), path.c_str()) < 0)
+	{
+		os << " - Trace dump failed: " << strerror(errno) << ", fileName = " << path;
+		(void) unlink(tmp.c_str());
+		std::cerr << os.str() << std::endl;
+		return 0;
+	}
+
+	_dumps++;
+
+	os << " - Trace dumped, " << why << ", spans: " << spans.size()
+		<< ", fileName = " << path;
+	std::cerr << os.str() << std::endl;
+
+	return spans.size();
+}
+//-----------------------------------------------------------------------------
+// helper functions
+namespace klein
+{
+	std::ostream& operator << (std::ostream& out, const Trace& t)
+	{
+		out << "Trace spans: " << t.spans() << ", ring: " << Trace::ringSize
+			<< ", dumps: " << t.dumps();
+		return out;
+	}
+}
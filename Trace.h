@@ -0,0 +1,131 @@
+#ifndef _KLEIN_TRACE_H_
+#define _KLEIN_TRACE_H_
+
+//
+// $Id: //TPU-4XXX-Stream/2.13/Recorder/Trace.h#1 $
+//
+
+#include <ostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <unistd.h> // useconds_t
+#include <stdint.h>
+
+namespace klein
+{
+
+// a flight recorder for timing glitches. every Metrics::Timer span,
+// fetches, assembly, writes, flushes, rotations, reconnects and naps, is
+// kept in a fixed ring with its ping and page type, always, costing the
+// span one slot store on top of the timer's clock reads.
+//
+// dump() (kill -USR1), or a span slower than its stage's threshold,
+// has the trace thread write the last seconds of the ring to
+//
+//   <dir>/trace-YYYYmmdd-HHMMSS.json
+//
+// in the Chrome trace event format, for chrome://tracing or Perfetto.
+// slow spans dump at most once a window, the dump would be the same.
+//
+// a slot is claimed with a fetch_add so any thread can add spans. a
+// writer lapped by the ring while it fills its slot, or a slot the dump
+// reads while it is being filled, is left out of the dump.
+class Trace
+{
+	public:
+
+		static const int maxStages = 16;
+
+		static Trace& instance();
+
+		// start the trace thread, dumping window seconds into dir
+		void start(const std::string& dir, const uint32_t window);
+		void stop();
+
+		// ns, a span of stage longer than this dumps, 0 for never
+		inline void threshold(const int stage, const int64_t ns) { _threshold[stage] = ns; }
+
+		// ask for a dump, safe in a signal handler
+		inline void dump() { _dump.store(true, std::memory_order_relaxed); }
+
+		// start and duration ns monotonic
+		inline void span(const int stage, const int64_t start, const int64_t dur,
+				const uint32_t ping, const int pageType)
+		{
+			const uint64_t n = _next.fetch_add(1, std::memory_order_relaxed);
+			Event& e = _ring[n & _mask];
+
+			e.seq.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			e.start = start;
+			e.dur = dur;
+			e.ping = ping;
+			e.pageType = pageType;
+			e.stage = stage;
+			e.tid = tid();
+
+			e.seq.store(n + 1, std::memory_order_release);
+
+			// the first slow span since the last look is the one named
+			int none = -1;
+			if (_threshold[stage] && dur > _threshold[stage])
+				_slowStage.compare_exchange_strong(none, (int)stage, std::memory_order_relaxed);
+		}
+
+		inline uint64_t spans() const { return _next.load(std::memory_order_relaxed); }
+		inline uint64_t dumps() const { return _dumps; }
+
+	private:
+		Trace();
+		~Trace();
+
+		// no copy or operator = ctors
+		Trace(const Trace& rhs);
+		Trace& operator = (const Trace& rhs);
+
+		struct Event
+		{
+			std::atomic<uint64_t> seq;	// claim + 1 once filled, 0 while filling
+			int64_t start;
+			int64_t dur;
+			uint32_t ping;
+			int32_t pageType;
+			uint32_t stage;
+			uint32_t tid;
+		};
+
+		// the kernel's thread id, for the trace viewer's rows
+		static uint32_t tid();
+
+		void run();
+
+		// writes the window up to now, returns the spans written
+		size_t write(const std::string& why);
+
+		std::unique_ptr<Event[]> _ring;
+		const uint64_t _mask;
+		std::atomic<uint64_t> _next;
+
+		int64_t _threshold[maxStages];
+		std::atomic<int> _slowStage;		// of a slow span, -1 for none
+
+		std::atomic<bool> _dump;
+		uint64_t _dumps;
+		int64_t _lastSlowDump;		// ns monotonic
+
+		std::string _dir;
+		uint32_t _window;			// s
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		static const size_t ringSize;
+		static const useconds_t pollPeriod_usec;
+
+	friend std::ostream& operator << (std::ostream& out, const Trace& t);
+};
+
+} // namespace klein
+#endif // _KLEIN_TRACE_H_
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <time.h> // localtime_r(), strftime()
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h> // gettimeofday
+
+#include "KleinSonar.h"
+
+const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/Util.cpp#1 $";
+
+// helpers every module uses, here rather than in main.cpp so the tools
+// can link the recorder without its main()
+
+namespace klein
+{
+
+// set by the ^C handler, read by every fetch thread
+std::atomic<bool> shutdown(false);
+
+// klein::printTime()
+std::ostream& printTime(std::ostream& os)
+{
+	// a function to print the curent time to ostream, the fetch threads
+	// and the recorder all call this so nothing static
+	char buf[64];
+	static const char format[] = "%X";
+	struct timeval tv;
+	struct timezone tz;
+
+	// ignore return value
+	(void) gettimeofday(&tv, &tz);
+
+	struct tm tm;
+	const struct tm* const tmp = localtime_r(&tv.tv_sec, &tm);
+	
+	if (tmp == NULL)
+	{
+		throw strerror(errno);
+	} 
+	if (strftime(buf, sizeof(buf), format, tmp) == 0)
+		throw "strftime failure";
+
+	os << buf << "." << std::setw(3) << std::setfill('0') << (int)(tv.tv_usec/ 1e3);
+	return os;
+}
+
+// klein::errorName()
+//  - the text for a DLLErrorCode, NULL for one it doesn't know
+const char* errorName(const DLLErrorCode ec)
+{
+	switch(ec)
+	{
+		case NGS_NO_ERROR:
+			return "No Error";
+		case NGS_NO_NETWORK_SOCKET_OBJECT:
+			return "No Socket";
+		case NGS_NO_CONNECTION_WITH_TPU:
+			return "No Connection";
+		case NGS_ALREADY_CONNECTED:
+			return "Already Connected";
+		case NGS_INVALID_IP_ADDRESS:
+			return "Invalid IpAddr";
+		case NGS_REQUIRES_A_MASTER_CONNECTION:
+			return "Requres Master";
+		case NGS_MASTER_ALREADY_CONNECTED:
+			return "Already Master Connected";
+		case NGS_GETHOSTBYNAME_ERROR:
+			return "GetHostByName Error";
+		case NGS_COMMAND_HANDSHAKE_ERROR:
+			return "Command Handshake Error";
+		case NGS_COMMAND_NOT_SUPPORTTED_BY_CURRENT_PROTOCOL:
+			return "Command Not Supported";
+		case NGS_SEND_COMMAND_FAILURE:
+			return "Send Failure";
+		case NGS_RECEIVE_COMMAND_FAILURE:
+			return "Receive Failure";
+		case NGS_TPU_REPORTS_COMMAND_FAILED:
+			return "TPU Reports Failure";
+		case NGS_UNKNOWN_DATA_PAGE_VERSION:
+			return "Unknown Data Page Version";
+		case NGS_SDFX_RECORD_TYPE_UNKNOWN:
+			return "Unknown SDFX Type";
+		case NGS_SDFX_RECEIVE_BUFFER_TOO_SMALL:
+			return "SDRX Receive Buffer To Small";
+		case NGS_SDFX_HEADER_VERSION_UNKNOWN:
+			return "SDFX Header Version Unknown";
+		case NGS_SDFX_RECORD_VERSION_UNKNOWN:
+			return "SDFX Record Version Unknown";
+		default:
+			return NULL;
+	}
+}
+
+// klein::printError()
+std::ostream& printError(TPU_HANDLE tpu, std::ostream& os)
+{
+	DLLErrorCode ec = NGS_NO_ERROR;
+
+	DllGetLastError(tpu, &ec);
+
+	const char* const name = errorName(ec);
+
+	if (name) os << name;
+	else os << "Unknown Error Code: " << ec;
+
+	return os;
+}
+
+bool operator == (const DiskRecordingSettings& lhs, const DiskRecordingSettings& rhs)
+{
+	bool ret = false;
+	if (lhs.nVersion != rhs.nVersion) return ret;
+	if (lhs.nRecordMode != rhs.nRecordMode) return ret;
+	if (lhs.nFileFormat != rhs.nFileFormat) return ret;
+	if (lhs.nPingsPerFile != rhs.nPingsPerFile) return ret;
+	if (lhs.nNewFile != rhs.nNewFile) return ret;
+	if (lhs.nTpuDiagLevel != rhs.nTpuDiagLevel) return ret;
+	if (lhs.nPathAction != rhs.nPathAction) return ret;
+
+	if (strcmp(lhs.szFilePrefix, rhs.szFilePrefix)) return ret;
+	if (strcmp(lhs.szFilePath, rhs.szFilePath)) return ret;
+	
+	return true;
+}
+
+} // namespace klein
@@ -3,21 +3,23 @@
 #include <iomanip>
 // #include <sstream>
 #include <cstdlib> // exit
+#include <stdexcept>
 // #include <unistd.h>
 #include <signal.h>
 // #include <memory>
 
 
 #include <stdint.h>
-#include <errno.h>
-#include <string.h>
 #include <stdio.h> // fopen
-#include <sys/time.h> // gettimeofday
 
 // options processing code
 #include <getoptpp/getopt_pp.h>
 
 #include "Recorder.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ToolUtil.h"
 
 const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/main.cpp#3 $";
 
@@ -25,123 +27,10 @@ const char* const _id = "$Id: //TPU-4XXX-Stream/2.13/Recorder/main.cpp#3 $";
 
 namespace klein
 {
-
-bool shutdown = false;
-
-// klein::printTime()
-std::ostream& printTime(std::ostream& os)
-{
-	// a function to print the curent time to ostream
-	static char buf[255];
-	static const char format[] = "%X";
-	struct timeval tv;
-	struct timezone tz;
-
-	// ignore return value
-	(void) gettimeofday(&tv, &tz);
-
-	const struct tm* const tmp = localtime(&tv.tv_sec);
-	
-	if (tmp == NULL)
-	{
-		throw strerror(errno);
-	} 
-	if (strftime(buf, sizeof(buf), format, tmp) == 0)
-		throw "strftime failure";
-
-	os << buf << "." << std::setw(3) << std::setfill('0') << (int)(tv.tv_usec/ 1e3);
-	return os;
-}
-
-// klein::printError()
-std::ostream& printError(TPU_HANDLE tpu, std::ostream& os)
-{
-	DLLErrorCode ec = NGS_NO_ERROR;
-
-	DllGetLastError(tpu, &ec);
-
-	switch(ec)
-	{
-		case NGS_NO_ERROR:
-			os << "No Error";
-			break;
-		case NGS_NO_NETWORK_SOCKET_OBJECT:
-			os << "No Socket";
-			break;
-		case NGS_NO_CONNECTION_WITH_TPU:
-			os << "No Connection";
-			break;
-		case NGS_ALREADY_CONNECTED:
-			os << "Already Connected";
-			break;
-		case NGS_INVALID_IP_ADDRESS:
-			os << "Invalid IpAddr";
-			break;
-		case NGS_REQUIRES_A_MASTER_CONNECTION:
-			os << "Requres Master";
-			break;
-		case NGS_MASTER_ALREADY_CONNECTED:
-			os << "Already Master Connected";
-			break;
-		case NGS_GETHOSTBYNAME_ERROR:
-			os << "GetHostByName Error";
-			break;
-		case NGS_COMMAND_HANDSHAKE_ERROR:
-			os << "Command Handshake Error";
-			break;
-		case NGS_COMMAND_NOT_SUPPORTTED_BY_CURRENT_PROTOCOL:
-			os << "Command Not Supported";
-			break;
-		case NGS_SEND_COMMAND_FAILURE:
-			os << "Send Failure";
-			break;
-		case NGS_RECEIVE_COMMAND_FAILURE:
-			os << "Receive Failure";
-			break;
-		case NGS_TPU_REPORTS_COMMAND_FAILED:
-			os << "TPU Reports Failure";
-			break;
-		case NGS_UNKNOWN_DATA_PAGE_VERSION:
-			os << "Unknown Data Page Version";
-			break;
-		case NGS_SDFX_RECORD_TYPE_UNKNOWN:
-			os << "Unknown SDFX Type";
-			break;
-		case NGS_SDFX_RECEIVE_BUFFER_TOO_SMALL:
-			os << "SDRX Receive Buffer To Small";
-			break;
-		case NGS_SDFX_HEADER_VERSION_UNKNOWN:
-			os << "SDFX Header Version Unknown";
-			break;
-		case NGS_SDFX_RECORD_VERSION_UNKNOWN:
-			os << "SDFX Record Version Unknown";
-			break;
-		default:
-			os << "Unknown Error Code: " << ec;
-			break;
-	}
-	return os;
-}
-
-bool operator == (const DiskRecordingSettings& lhs, const DiskRecordingSettings& rhs)
-{
-	bool ret = false;
-	if (lhs.nVersion != rhs.nVersion) return ret;
-	if (lhs.nRecordMode != rhs.nRecordMode) return ret;
-	if (lhs.nFileFormat != rhs.nFileFormat) return ret;
-	if (lhs.nPingsPerFile != rhs.nPingsPerFile) return ret;
-	if (lhs.nNewFile != rhs.nNewFile) return ret;
-	if (lhs.nTpuDiagLevel != rhs.nTpuDiagLevel) return ret;
-	if (lhs.nPathAction != rhs.nPathAction) return ret;
-
-	if (strcmp(lhs.szFilePrefix, rhs.szFilePrefix)) return ret;
-	if (strcmp(lhs.szFilePath, rhs.szFilePath)) return ret;
-	
-	return true;
+	// from Util.cpp
+	extern std::atomic<bool> shutdown;
 }
 
-} // namespace klein
-
 // ^C handler
 static void terminate(const int param)
 {
@@ -153,14 +42,103 @@ static void terminate(const int param)
 	klein::shutdown = true;
 }
 
+// SIGUSR2 handler, the next log verbosity
+static void cycleVerbosity(const int)
+{
+	klein::Log::instance().cycle();
+}
+
+// SIGUSR1 handler, the last seconds of the trace to a file
+static void dumpTrace(const int)
+{
+	klein::Trace::instance().dump();
+}
+
 // usage()
 static void usage(const std::string& name)
 {
 	std::cerr << "Usage: " << name
 		<< "[-h --host hostname]"
 		<< "[-n --noblocking | -b --blocking]" 
+		<< "[-t --threaded]"
+		<< "[--fetchqueue pages]"
+		<< "[--cachebuffers n]"
+		<< "[--pingqueue pings]"
+		<< "[--deadline version:msec[p][,...]]"
+		<< "[--durability none|datasync|writeback]"
+		<< "[--syncbytes bytes]"
+		<< "[--syncmsec msec]"
+		<< "[--io writev|uring|mmap]"
+		<< "[--uringdepth entries]"
+		<< "[--noindex]"
+		<< "[-v --verbosity 0|1|2]"
+		<< "[--metrics socket]"
+		<< "[--bus name]"
+		<< "[--busslots pings]"
+		<< "[--busbytes bytes]"
+		<< "[--proxy socket|[host]:port]"
+		<< "[--proxyhistory pings]"
+		<< "[--tracedir dir]"
+		<< "[--tracesecs seconds]"
+		<< "[--traceslow msec]"
+		<< std::endl;
+	std::cerr << "\tdefault: -h 127.0.0.1 --blocking --fetchqueue 64 --cachebuffers 2"
+		<< " --pingqueue 64 --durability datasync --syncbytes 8388608 --syncmsec 1000"
+		<< " --io writev --uringdepth 64 --verbosity 2"
+		<< " --busslots 16 --busbytes 2097152 --proxyhistory 64"
+		<< " --tracedir /tmp --tracesecs 10 --traceslow 0" << std::endl;
+	std::cerr << "\t--bus publishes every ping written into shared memory, e.g."
+		<< " /klein-pings, for local PingBusReaders, busbytes is the biggest ping"
+		<< std::endl;
+	std::cerr << "\t--proxy serves the pages fetched to TpuProxyClients, as a TPU"
+		<< " would, pages are fetched while not recording too. without --threaded"
+		<< " the TPU sees one connection however many clients there are"
+		<< std::endl;
+	std::cerr << "\t--noindex doesn't write the .idx page index next to each data file"
+		<< std::endl;
+	std::cerr << "\t--verbosity logs nothing (0), warnings (1) or every page too (2),"
+		<< " kill -USR2 steps through them while running" << std::endl;
+	std::cerr << "\t--metrics serves stage timings and page counts, Prometheus text,"
+		<< " to each connection on the unix socket" << std::endl;
+	std::cerr << "\tkill -USR1 writes the last tracesecs of stage spans to tracedir as"
+		<< " Chrome trace json, as does any stage but nap or reconnect taking"
+		<< " over traceslow msec, 0 for never" << std::endl;
+	std::cerr << "\t--deadline writes a ping without a missing page of that version"
+		<< " after msec, or after that many pings with p, e.g. 3511:4p,3503:200"
 		<< std::endl;
-	std::cerr << "\tdefault: -h 127.0.0.1 --blocking" << std::endl;
+}
+
+// parseDeadlines()
+//  - "3511:4p,3503:200", page version then milliseconds, or ping
+//    intervals with a trailing p
+static bool parseDeadlines(const std::string& s, klein::RecorderConfig& c)
+{
+	const char* p = s.c_str();
+
+	while (*p)
+	{
+		char* e;
+		const unsigned long v = strtoul(p, &e, 10);
+		if (e == p || *e != ':') return false;
+		p = e + 1;
+
+		const unsigned long d = strtoul(p, &e, 10);
+		if (e == p) return false;
+		p = e;
+
+		const bool pings = (*p == 'p');
+		if (pings) p++;
+
+		if (*p == ',') p++;
+		else if (*p) return false;
+
+		const int t = klein::PageTypes::slot(v);
+		if (t < 0) return false;
+
+		c.deadline[t].value = d;
+		c.deadline[t].pings = pings;
+	}
+	return true;
 }
 
 // the main()
@@ -177,12 +155,73 @@ int main(const int ac, const char* const av[])
 	std::string hostname("127.0.0.1");
 	bool useBlocking = true;
 	bool useNoBlocking = !useBlocking;
+	klein::RecorderConfig config;
+	std::string deadlines;
+	std::string durability("datasync");
+	std::string io("writev");
+	bool noIndex = false;
+	int verbosity = klein::Log::pages;
+	std::string metrics;
+	std::string traceDir("/tmp");
+	uint32_t traceSecs = 10;
+	uint32_t traceSlow = 0;
 
 	try
 	{
 		ops >> GetOpt::Option('h', "host", hostname, hostname)
 			>> GetOpt::OptionPresent('n', "noblocking", useNoBlocking)
-			>> GetOpt::OptionPresent('b', "blocking", useBlocking);
+			>> GetOpt::OptionPresent('b', "blocking", useBlocking)
+			>> GetOpt::OptionPresent('t', "threaded", config.threaded)
+			>> GetOpt::Option("fetchqueue", config.fetchQueueSize, config.fetchQueueSize)
+			>> GetOpt::Option("cachebuffers", config.cacheBuffers, config.cacheBuffers)
+			>> GetOpt::Option("pingqueue", config.pingQueueSize, config.pingQueueSize)
+			>> GetOpt::Option("deadline", deadlines, deadlines)
+			>> GetOpt::Option("durability", durability, durability)
+			>> GetOpt::Option("syncbytes", config.durability.bytes, config.durability.bytes)
+			>> GetOpt::Option("syncmsec", config.durability.msec, config.durability.msec)
+			>> GetOpt::Option("io", io, io)
+			>> GetOpt::Option("uringdepth", config.io.depth, config.io.depth)
+			>> GetOpt::OptionPresent("noindex", noIndex)
+			>> GetOpt::Option('v', "verbosity", verbosity, verbosity)
+			>> GetOpt::Option("metrics", metrics, metrics)
+			>> GetOpt::Option("bus", config.bus.name, config.bus.name)
+			>> GetOpt::Option("busslots", config.bus.slots, config.bus.slots)
+			>> GetOpt::Option("busbytes", config.bus.slotBytes, config.bus.slotBytes)
+			>> GetOpt::Option("proxy", config.proxy.address, config.proxy.address)
+			>> GetOpt::Option("proxyhistory", config.proxy.history, config.proxy.history)
+			>> GetOpt::Option("tracedir", traceDir, traceDir)
+			>> GetOpt::Option("tracesecs", traceSecs, traceSecs)
+			>> GetOpt::Option("traceslow", traceSlow, traceSlow);
+
+		config.index = !noIndex;
+
+		if (!parseDeadlines(deadlines, config))
+		{
+			std::cerr << "bad --deadline: " << deadlines << std::endl;
+			usage(av[0]);
+			return -1;
+		}
+
+		if (!parseDurability(durability, config.durability))
+		{
+			std::cerr << "bad --durability: " << durability << std::endl;
+			usage(av[0]);
+			return -1;
+		}
+
+		if (!parseIo(io, config.io))
+		{
+			std::cerr << "bad --io: " << io << std::endl;
+			usage(av[0]);
+			return -1;
+		}
+
+		if (verbosity < klein::Log::quiet || verbosity > klein::Log::pages)
+		{
+			std::cerr << "bad --verbosity: " << verbosity << std::endl;
+			usage(av[0]);
+			return -1;
+		}
 
 		// both set is error
 		if (useNoBlocking && useBlocking)
@@ -202,11 +241,48 @@ int main(const int ac, const char* const av[])
 	}
 
 	std::cout << "Using blocking sockets: " << std::boolalpha << useBlocking
-		<< " with SPU: " <<  hostname << std::endl;
+		<< " with SPU: " <<  hostname
+		<< ", threaded fetch: " << config.threaded << std::endl;
+
+	// the fetchers' lines are written by the log's thread
+	klein::Log& log = klein::Log::instance();
+	log.verbosity((klein::Log::Verbosity)verbosity);
+	log.start();
+	(void) signal(SIGUSR2, cycleVerbosity);
+
+	// spans are always traced, this thread dumps them
+	klein::Trace& trace = klein::Trace::instance();
+	for (int s = 0; s < klein::Metrics::stages; s++)
+		if (s != klein::Metrics::nap && s != klein::Metrics::reopen)
+			trace.threshold(s, (int64_t)traceSlow * 1000000);
+	trace.start(traceDir, traceSecs);
+	(void) signal(SIGUSR1, dumpTrace);
+
+	// the recording matters more, carry on without them
+	if (!metrics.empty())
+	{
+		try
+		{
+			klein::Metrics::instance().start(metrics);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+	}
 
-	klein::Recorder recorder(hostname, useBlocking);
+	{
+		klein::Recorder recorder(hostname, useBlocking, config);
+
+		// not in the one statement, what it prints would land after the
+		// label and before its value
+		const int ret = recorder.execute();
+		std::cout << "recorder.execute returns: " << ret << std::endl;
+	}
 
-	std::cout << "recorder.execute returns: " << recorder.execute() << std::endl;
+	klein::Metrics::instance().stop();
+	trace.stop();
+	log.stop();
 
 	return 0;
 }